@@ -0,0 +1,93 @@
+// Base64 decoding of log lines: CryptoPP filter chain vs. base64::decode.
+//
+// Build with `make bench`, run ./bench/bench_base64
+
+#include "../include/main.hpp"
+#include "bench_util.hpp"
+
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+std::string encode(const std::string &bytes) {
+  static const char alphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  size_t i = 0;
+  for (; i + 2 < bytes.size(); i += 3) {
+    const unsigned v = (static_cast<unsigned char>(bytes[i]) << 16) |
+                       (static_cast<unsigned char>(bytes[i + 1]) << 8) |
+                       static_cast<unsigned char>(bytes[i + 2]);
+    out += alphabet[v >> 18];
+    out += alphabet[(v >> 12) & 63];
+    out += alphabet[(v >> 6) & 63];
+    out += alphabet[v & 63];
+  }
+  if (bytes.size() - i == 1) {
+    const unsigned v = static_cast<unsigned char>(bytes[i]) << 16;
+    out += alphabet[v >> 18];
+    out += alphabet[(v >> 12) & 63];
+    out += "==";
+  } else if (bytes.size() - i == 2) {
+    const unsigned v = (static_cast<unsigned char>(bytes[i]) << 16) |
+                       (static_cast<unsigned char>(bytes[i + 1]) << 8);
+    out += alphabet[v >> 18];
+    out += alphabet[(v >> 12) & 63];
+    out += alphabet[(v >> 6) & 63];
+    out += '=';
+  }
+  return out;
+}
+
+} // namespace
+
+int main() {
+  std::mt19937 rng(42);
+
+  std::printf("%-12s %12s %12s %8s\n", "line bytes", "cryptopp", "simd",
+              "speedup");
+
+  // Log lines are the encrypted message plus a 16-byte tag
+  for (size_t len : {64, 160, 400, 4096}) {
+    std::vector<std::string> lines;
+    size_t total = 0;
+    while (total < (64u << 20)) {
+      std::string bytes(len + rng() % 32, '\0');
+      for (auto &c : bytes) {
+        c = static_cast<char>(rng());
+      }
+      lines.push_back(encode(bytes));
+      total += lines.back().size();
+    }
+
+    size_t check_a = 0, check_b = 0;
+    const double cryptopp = bench::seconds([&] {
+      for (const auto &line : lines) {
+        std::string decoded;
+        CryptoPP::StringSource ss(
+            line, true,
+            new CryptoPP::Base64Decoder(new CryptoPP::StringSink(decoded)));
+        check_a += decoded.size();
+      }
+    });
+    const double simd = bench::seconds([&] {
+      std::string decoded;
+      for (const auto &line : lines) {
+        pka2xml::base64::decode(line, decoded);
+        check_b += decoded.size();
+      }
+    });
+
+    if (check_a != check_b) {
+      std::fprintf(stderr, "decoded sizes differ\n");
+      return 1;
+    }
+    std::printf("%-12zu %8.1fMB/s %8.1fMB/s %7.2fx\n", len,
+                total / cryptopp / 1e6, total / simd / 1e6, cryptopp / simd);
+  }
+
+  return 0;
+}
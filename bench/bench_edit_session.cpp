@@ -0,0 +1,79 @@
+// Multi-edit sessions: std::string::replace per edit vs. the piece table of
+// edit_session, each followed by one save.
+//
+// Build with `make bench`, run ./bench/bench_edit_session [document size in
+// MB] [edits]
+
+#include "../include/edit_session.hpp"
+#include "../include/main.hpp"
+#include "bench_util.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+struct edit {
+  double at; // fraction of the document size at the time of the edit
+  size_t count;
+  std::string text;
+};
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  using namespace pka2xml;
+  const size_t mb = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 16;
+  const size_t count = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 200;
+  std::mt19937 rng(42);
+  const std::string xml = bench::make_document(mb << 20, rng);
+
+  std::vector<edit> edits;
+  for (size_t i = 0; i < count; i++) {
+    edits.push_back({(rng() % 1000000) / 1e6, rng() % 16,
+                     "<NOTE>edit " + std::to_string(i) + "</NOTE>"});
+  }
+  auto position = [](const edit &e, size_t size) {
+    const size_t at = static_cast<size_t>(e.at * size);
+    return std::make_pair(at, std::min(e.count, size - at));
+  };
+
+  std::string copied = xml;
+  const double string_edits = bench::seconds([&] {
+    for (const auto &e : edits) {
+      const auto [at, n] = position(e, copied.size());
+      copied.replace(at, n, e.text);
+    }
+  });
+  std::string saved_copy;
+  const double string_save =
+      bench::seconds([&] { saved_copy = encrypt_pka(copied); });
+
+  edit_session session(xml);
+  const double session_edits = bench::seconds([&] {
+    for (const auto &e : edits) {
+      const auto [at, n] = position(e, session.size());
+      session.replace(at, n, e.text);
+    }
+  });
+  std::string saved;
+  const double session_save = bench::seconds([&] { saved = session.save(); });
+
+  if (decrypt_pka(saved) != copied) {
+    std::fprintf(stderr, "edit session does not match the edited copy\n");
+    return 1;
+  }
+
+  std::printf("%zu edits on a %zu MB document (%zu pieces)\n", count, mb,
+              session.piece_count());
+  std::printf("%-26s %8.4fs edits %8.4fs save\n", "std::string::replace",
+              string_edits, string_save);
+  std::printf("%-26s %8.4fs edits %8.4fs save\n", "edit_session",
+              session_edits, session_save);
+  return 0;
+}
@@ -0,0 +1,81 @@
+// --grep: one RE2 scan per pattern over the decrypted xml vs. one RE2::Set
+// pass per inflate chunk with grep::searcher.
+//
+// Build with `make bench`, run ./bench/bench_grep [document size in MB]
+// [patterns]
+
+#include "../include/grep.hpp"
+#include "../include/main.hpp"
+#include "bench_util.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+// A device with a running config line, one per line of the document
+void append_configured_device(std::string &xml, std::mt19937 &rng) {
+  xml += "<DEVICE><ENGINE><NAME>R" + std::to_string(rng() % 100000) +
+         "</NAME><SERIAL>" + std::to_string(rng()) + "</SERIAL></ENGINE>";
+  xml += "<RUNNINGCONFIG><LINE>hostname R" + std::to_string(rng() % 100000) +
+         "</LINE></RUNNINGCONFIG></DEVICE>\n";
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  const size_t mb = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 32;
+  const size_t count = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 16;
+  std::mt19937 rng(42);
+  const std::string pka = pka2xml::encrypt_pka(
+      bench::make_document(mb << 20, rng, append_configured_device));
+
+  // Mostly rare patterns, as when looking for a few devices in an archive
+  std::vector<std::string> list;
+  for (size_t i = 0; i < count; i++) {
+    list.push_back("hostname R" + std::to_string(rng() % 100000) + "<");
+  }
+  list.push_back("enable secret [0-9]+");
+  const grep::patterns patterns(list);
+
+  size_t separate = 0;
+  const double separate_time = bench::seconds([&] {
+    const std::string xml = pka2xml::decrypt_pka(pka);
+    for (const auto &pattern : list) {
+      const RE2 regex(pattern);
+      re2::StringPiece text(xml.data(), xml.size());
+      while (RE2::FindAndConsume(&text, regex)) {
+        separate++;
+      }
+    }
+  });
+
+  size_t streamed = 0;
+  const double streamed_time = bench::seconds([&] {
+    grep::searcher searcher(patterns, [](const grep::hit &) {});
+    const std::string compressed =
+        pka2xml::decrypt_compressed(pka, pka2xml::eax::pka);
+    pka2xml::uncompress_chunks(
+        reinterpret_cast<const unsigned char *>(compressed.data()),
+        compressed.size(), [&searcher](const char *data, size_t size) {
+          searcher.feed(data, size);
+          return true;
+        });
+    searcher.finish();
+    streamed = searcher.hits();
+  });
+
+  if (separate != streamed) {
+    std::fprintf(stderr, "hit counts differ: %zu vs %zu\n", separate,
+                 streamed);
+    return 1;
+  }
+  std::printf("%zu patterns over a %zu MB document, %zu hits\n", list.size(),
+              mb, streamed);
+  std::printf("%-26s %8.4fs\n", "decrypt + RE2 per pattern", separate_time);
+  std::printf("%-26s %8.4fs\n", "streamed RE2::Set", streamed_time);
+  return 0;
+}
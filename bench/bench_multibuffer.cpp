@@ -0,0 +1,84 @@
+// Multi-buffer EAX vs. one file at a time, on pka-sized inputs.
+//
+// Build with `make bench`, run ./bench/bench_multibuffer
+
+#include "../include/main.hpp"
+#include "bench_util.hpp"
+
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Roughly what a topology looks like to zlib: repetitive markup with some
+// varying values
+} // namespace
+
+int main() {
+  using namespace pka2xml;
+  std::mt19937 rng(42);
+  const size_t files = 64;
+
+  std::printf("%-8s %-22s %10s %10s %8s\n", "size", "stage", "single", "batch",
+              "speedup");
+
+  for (size_t kb : {50, 100, 250, 500}) {
+    // Stage 2 only: raw EAX over (compressed-sized) random messages
+    std::vector<std::vector<unsigned char>> cts(files), outs(files);
+    size_t total = 0;
+    for (auto &ct : cts) {
+      std::vector<unsigned char> pt(kb * 1024 / 16);
+      for (auto &b : pt) {
+        b = static_cast<unsigned char>(rng());
+      }
+      ct.resize(pt.size() + 16);
+      eax::encrypt(eax::pka, pt.data(), pt.size(), ct.data());
+      total += ct.size();
+    }
+    for (size_t i = 0; i < files; i++) {
+      outs[i].resize(cts[i].size() - 16);
+    }
+
+    const double single = bench::seconds(5, [&] {
+      for (size_t i = 0; i < files; i++) {
+        eax::decrypt(eax::pka, cts[i].data(), cts[i].size(), outs[i].data());
+      }
+    });
+    std::vector<eax::job> jobs(files);
+    const double batch = bench::seconds(5, [&] {
+      for (size_t i = 0; i < files; i++) {
+        jobs[i].in = cts[i].data();
+        jobs[i].length = cts[i].size();
+        jobs[i].out = outs[i].data();
+      }
+      eax::decrypt_batch(eax::pka, jobs.data(), files);
+    });
+    std::printf("%-8s %-22s %8.1fMB/s %8.1fMB/s %7.2fx\n",
+                (std::to_string(kb) + "KB").c_str(), "eax (compressed size)",
+                total / single / 1e6, total / batch / 1e6, single / batch);
+
+    // Whole pipeline on real pka files of that plaintext size
+    std::vector<std::string> pkas;
+    total = 0;
+    for (size_t i = 0; i < files; i++) {
+      pkas.push_back(encrypt_pka(bench::make_document(kb * 1024, rng)));
+      total += pkas.back().size();
+    }
+    const double single_pka = bench::seconds(3, [&] {
+      for (const auto &p : pkas) {
+        decrypt_pka(p);
+      }
+    });
+    const double batch_pka = bench::seconds(3, [&] {
+      std::vector<std::exception_ptr> errors;
+      decrypt_pka_batch(pkas, errors);
+    });
+    std::printf("%-8s %-22s %8.1fMB/s %8.1fMB/s %7.2fx\n", "",
+                "decrypt_pka", total / single_pka / 1e6,
+                total / batch_pka / 1e6, single_pka / batch_pka);
+  }
+
+  return 0;
+}
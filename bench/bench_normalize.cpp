@@ -0,0 +1,118 @@
+// Packet Tracer's load-time clean-up: four replace-all passes over the
+// decrypted xml, as decryptFileBytes does, vs. one normalizer scan, and the
+// normalizer fed straight from inflate.
+//
+// Build with `make bench`, run ./bench/bench_normalize [document size in MB]
+
+#include "../include/main.hpp"
+#include "../include/normalize.hpp"
+#include "bench_util.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+
+namespace {
+
+// The passes of decryptFileBytes, one QByteArray::replace each
+const char *const passes[][2] = {
+    {"\xC3\x82\xC2\x82", ""},
+    {"\xC3\x83\xC2\x83", ""},
+    {"\xC2\x98\xC2\x94", ""},
+    {"\xC2\x93\xC2\x92", "\""},
+};
+
+std::string replace_all(const std::string &s, const std::string &from,
+                        const std::string &to) {
+  std::string out;
+  size_t at = 0;
+  for (size_t hit; (hit = s.find(from, at)) != std::string::npos;
+       at = hit + from.size()) {
+    out.append(s, at, hit - at);
+    out += to;
+  }
+  out.append(s, at, std::string::npos);
+  return out;
+}
+
+std::string four_passes(std::string xml) {
+  for (const auto &p : passes) {
+    xml = replace_all(xml, p[0], p[1]);
+  }
+  return xml;
+}
+
+// Mostly ASCII with some UTF-8 and, now and then, a doubly encoded sequence
+void append_described_device(std::string &xml, std::mt19937 &rng) {
+  xml += "<DEVICE><ENGINE><NAME>R" + std::to_string(rng() % 100000) +
+         "</NAME><DESCRIPTION>Caf\xC3\xA9 ";
+  if (rng() % 64 == 0) {
+    xml += passes[rng() % 4][0];
+  }
+  xml += "</DESCRIPTION></ENGINE></DEVICE>\n";
+}
+
+// Short strings over the pattern bytes, where passes interact the most
+bool fuzz(std::mt19937 &rng) {
+  const char alphabet[] = "\xC2\xC3\x82\x83\x92\x93\x94\x98x";
+  for (int round = 0; round < 200000; round++) {
+    std::string s(rng() % 24, '\0');
+    for (auto &c : s) {
+      c = alphabet[rng() % (sizeof(alphabet) - 1)];
+    }
+    std::string chunked;
+    pka2xml::normalizer n;
+    for (size_t at = 0; at < s.size();) {
+      const size_t size = std::min<size_t>(1 + rng() % 5, s.size() - at);
+      n.feed(s.data() + at, size, chunked);
+      at += size;
+    }
+    n.finish(chunked);
+    if (chunked != four_passes(s) || pka2xml::normalize(s) != chunked) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  const size_t mb = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 64;
+  std::mt19937 rng(42);
+  if (!fuzz(rng)) {
+    std::fprintf(stderr, "normalizer differs from the four passes\n");
+    return 1;
+  }
+  const std::string xml =
+      bench::make_document(mb << 20, rng, append_described_device);
+  const std::string pka = pka2xml::encrypt_pka(xml);
+
+  std::string expected;
+  const double replace_time =
+      bench::seconds([&] { expected = four_passes(xml); });
+  std::string scanned;
+  const double scan_time =
+      bench::seconds([&] { scanned = pka2xml::normalize(xml); });
+
+  std::string decrypted;
+  const double decrypt_time = bench::seconds([&] {
+    decrypted = four_passes(pka2xml::decrypt_pka(pka));
+  });
+  std::string fused;
+  const double fused_time =
+      bench::seconds([&] { fused = pka2xml::decrypt_pka_normalized(pka); });
+
+  if (scanned != expected || decrypted != expected || fused != expected) {
+    std::fprintf(stderr, "outputs differ\n");
+    return 1;
+  }
+  std::printf("%zu MB document, %zu bytes removed\n", mb,
+              xml.size() - expected.size());
+  std::printf("%-28s %8.4fs\n", "four replace passes", replace_time);
+  std::printf("%-28s %8.4fs\n", "one normalizer scan", scan_time);
+  std::printf("%-28s %8.4fs\n", "decrypt + four passes", decrypt_time);
+  std::printf("%-28s %8.4fs\n", "decrypt, normalized inflate", fused_time);
+  return 0;
+}
@@ -0,0 +1,74 @@
+// --query: decrypting to xml and parsing it again vs. matching during
+// inflate, for a query over the whole document and one that stops early.
+//
+// Build with `make bench`, run ./bench/bench_query [document size in MB]
+
+#include "../include/main.hpp"
+#include "../include/xml.hpp"
+#include "../include/xml_query.hpp"
+#include "bench_util.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+
+namespace {
+
+void append_translated_device(std::string &xml, std::mt19937 &rng) {
+  xml += "<DEVICE><ENGINE><NAME translate=\"true\">R" +
+         std::to_string(rng() % 100000) + "</NAME><SERIAL>" +
+         std::to_string(rng()) + "</SERIAL></ENGINE>";
+  xml += "<PORT speed=\"" + std::to_string(rng() % 1000) + "\"/></DEVICE>\n";
+}
+
+size_t streamed(const std::string &pka, const xml::query &q) {
+  size_t sink = 0;
+  xml::query_matcher matcher(
+      q, [&sink](const xml::match &m) { sink += m.value.size(); });
+  xml::scanner scanner(matcher);
+  const std::string compressed =
+      pka2xml::decrypt_compressed(pka, pka2xml::eax::pka);
+  pka2xml::uncompress_chunks(
+      reinterpret_cast<const unsigned char *>(compressed.data()),
+      compressed.size(),
+      [&scanner](const char *data, size_t size) {
+        return scanner.feed(data, size);
+      });
+  return sink;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  const size_t mb = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 32;
+  std::mt19937 rng(42);
+  const std::string pka = pka2xml::encrypt_pka(bench::make_document(
+      mb << 20, rng, append_translated_device, "<VERSION>8.2</VERSION>"));
+  const int reps = 3;
+
+  const xml::query names(
+      "PACKETTRACER5/NETWORK/DEVICES/DEVICE/ENGINE/NAME/text()");
+  const xml::query version("PACKETTRACER5/VERSION[1]/text()");
+
+  size_t sink = 0;
+  const double two_pass = bench::seconds(reps, [&] {
+    const std::string xml = pka2xml::decrypt_pka(pka);
+    xml::query_matcher matcher(
+        names, [&sink](const xml::match &m) { sink += m.value.size(); });
+    xml::scan(xml, matcher);
+  });
+  const double all =
+      bench::seconds(reps, [&] { sink += streamed(pka, names); });
+  const double early =
+      bench::seconds(reps, [&] { sink += streamed(pka, version); });
+
+  std::printf("%zu MB document, %zu bytes encrypted (%zu)\n", mb, pka.size(),
+              sink);
+  std::printf("%-32s %8.3fs\n", "decrypt, then scan", two_pass);
+  std::printf("%-32s %8.3fs %7.2fx\n", "streamed, every device name", all,
+              two_pass / all);
+  std::printf("%-32s %8.3fs %7.2fx\n", "streamed, stops after VERSION", early,
+              two_pass / early);
+  return 0;
+}
@@ -0,0 +1,75 @@
+// Tape DOM: build throughput and memory per record, and walking the tree
+// through child/sibling links vs. scanning the document again.
+//
+// Build with `make bench`, run ./bench/bench_tape [document size in MB]
+
+#include "../include/xml.hpp"
+#include "../include/xml_tape.hpp"
+#include "bench_util.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+
+namespace {
+
+// Device names through the scanner, for comparison with the tape walk
+class names : public xml::handler {
+public:
+  bool on_event(const xml::event &e) override {
+    if (e.kind == xml::event::text && e.depth == 6 &&
+        e.path == "PACKETTRACER5/NETWORK/DEVICES/DEVICE/ENGINE/NAME") {
+      bytes += e.value.size();
+    }
+    return true;
+  }
+  size_t bytes = 0;
+};
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  const size_t mb = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 64;
+  std::mt19937 rng(42);
+  const std::string doc =
+      bench::make_document(mb << 20, rng, bench::append_scanned_device);
+  const int reps = 3;
+
+  const double build = bench::seconds(reps, [&] { xml::tape::build(doc); });
+  const xml::tape t = xml::tape::build(doc);
+
+  // Every DEVICE/ENGINE/NAME through the links; ids are looked up once
+  size_t walked = 0;
+  const uint32_t device = t.name_id("DEVICE");
+  const uint32_t engine = t.name_id("ENGINE");
+  const uint32_t name = t.name_id("NAME");
+  const double walk = bench::seconds(reps, [&] {
+    walked = 0;
+    const uint32_t devices = t.child(t.child(t.root(), "NETWORK"), "DEVICES");
+    for (uint32_t d = t.child(devices, device); d != xml::tape::none;
+         d = t.next_named(d)) {
+      const uint32_t n = t.child(t.child(d, engine), name);
+      walked += t.value(t.first_child(n)).size();
+    }
+  });
+
+  names scanned;
+  const double rescan = bench::seconds(reps, [&] {
+    scanned.bytes = 0;
+    xml::scan(doc, scanned);
+  });
+  if (walked != scanned.bytes) {
+    std::fprintf(stderr, "tape walk found %zu bytes, scan %zu\n", walked,
+                 scanned.bytes);
+    return 1;
+  }
+
+  const double size = static_cast<double>(doc.size());
+  std::printf("%zu MB document, %zu records, %zu bytes of records\n", mb,
+              t.size(), t.size() * sizeof(xml::tape::node));
+  std::printf("%-28s %8.1fMB/s\n", "build", size / build / 1e6);
+  std::printf("%-28s %8.4fs\n", "walk device names", walk);
+  std::printf("%-28s %8.4fs\n", "scan for device names", rescan);
+  return 0;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+// Fixture and timer shared by the benchmarks in this directory
+
+#include <chrono>
+#include <cstddef>
+#include <random>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace bench {
+
+/**
+ * @brief Appends a <DEVICE> with a random name, serial and port speed
+ */
+inline void append_device(std::string &xml, std::mt19937 &rng) {
+  xml += "<DEVICE><ENGINE><NAME>R" + std::to_string(rng() % 100000) +
+         "</NAME><SERIAL>" + std::to_string(rng()) + "</SERIAL></ENGINE>";
+  xml += "<PORT speed=\"" + std::to_string(rng() % 1000) + "\"/></DEVICE>";
+}
+
+/**
+ * @brief Appends a <DEVICE> with an attribute, an entity and whitespace
+ * between tags, for the scanner benchmarks
+ */
+inline void append_scanned_device(std::string &xml, std::mt19937 &rng) {
+  xml += "<DEVICE><ENGINE><NAME translate=\"true\">R" +
+         std::to_string(rng() % 100000) + "</NAME><SERIAL>" +
+         std::to_string(rng()) + "</SERIAL></ENGINE>\n";
+  xml += "  <PORT speed=\"" + std::to_string(rng() % 1000) +
+         "\"/><DESC>a &amp; b</DESC></DEVICE>\n";
+}
+
+/**
+ * @brief A document shaped like a Packet Tracer file, of at least @p size
+ * bytes
+ *
+ * @param device Appends one device to the string, as append_device() does
+ * @param head Written before <NETWORK>
+ */
+template <typename Device = void (*)(std::string &, std::mt19937 &)>
+std::string make_document(size_t size, std::mt19937 &rng,
+                          Device device = append_device,
+                          std::string_view head = {}) {
+  std::string xml = "<PACKETTRACER5>";
+  xml += head;
+  xml += "<NETWORK><DEVICES>";
+  while (xml.size() < size) {
+    device(xml, rng);
+  }
+  xml += "</DEVICES></NETWORK></PACKETTRACER5>";
+  return xml;
+}
+
+/**
+ * @brief Wall time of @p f in seconds, averaged over @p reps calls
+ */
+template <typename F> double seconds(int reps, F &&f) {
+  const auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < reps; r++) {
+    f();
+  }
+  const auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(end - start).count() / reps;
+}
+
+/**
+ * @brief Wall time of one call of @p f in seconds
+ */
+template <typename F> double seconds(F &&f) {
+  return seconds(1, std::forward<F>(f));
+}
+
+} // namespace bench
@@ -0,0 +1,113 @@
+// -rbm variants: full recompression per name vs. resuming a shared deflate
+// state at the name.
+//
+// Build with `make bench`, run ./bench/bench_variants [document size in KB]
+// [variants]
+
+#include "../include/main.hpp"
+#include "../include/thread_pool.hpp"
+#include "bench_util.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <future>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+// A topology with the user profile in the middle, so the shared prefix is a
+// real share of the work
+std::string make_topology(size_t size, std::mt19937 &rng) {
+  auto devices = [&rng](std::string &xml, size_t until) {
+    while (xml.size() < until) {
+      bench::append_device(xml, rng);
+    }
+  };
+  std::string xml = "<PACKETTRACER5><NETWORK><DEVICES>";
+  devices(xml, size / 2);
+  xml += "</DEVICES></NETWORK><USER_PROFILE><NAME>Base</NAME>"
+         "<EMAIL>user@example.com</EMAIL></USER_PROFILE><ACTIVITY>";
+  devices(xml, size);
+  xml += "</ACTIVITY></PACKETTRACER5>";
+  return xml;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  using namespace pka2xml;
+  const size_t kb = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 500;
+  const size_t count = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1000;
+  std::mt19937 rng(42);
+
+  const std::string xml = make_topology(kb * 1024, rng);
+  std::vector<std::string> names;
+  for (size_t i = 0; i < count; i++) {
+    names.push_back("Student " + std::to_string(i));
+  }
+
+  profile_name at{};
+  if (!find_user_profile_name(xml, at)) {
+    std::fprintf(stderr, "no user profile in the document\n");
+    return 1;
+  }
+  const std::string_view view = xml;
+  const std::string_view suffix = view.substr(at.end);
+
+  size_t sink = 0;
+  const double full = bench::seconds([&] {
+    for (const auto &name : names) {
+      sink += encrypt_pka(splice_user_profile(xml, name)).size();
+    }
+  });
+
+  const double shared = bench::seconds([&] {
+    const prefix_compressor prefix(view.substr(0, at.begin));
+    for (const auto &name : names) {
+      sink += encrypt_compressed(prefix.compress({name, suffix}), eax::pka)
+                  .size();
+    }
+  });
+
+  const unsigned jobs = utils::default_jobs();
+  const double parallel = bench::seconds([&] {
+    const prefix_compressor prefix(view.substr(0, at.begin));
+    utils::thread_pool pool(jobs);
+    std::deque<std::future<std::string>> pending;
+    for (const auto &name : names) {
+      pending.push_back(pool.submit([&prefix, &name, suffix] {
+        return encrypt_compressed(prefix.compress({name, suffix}), eax::pka);
+      }));
+      if (pending.size() >= 2 * jobs) {
+        sink += pending.front().get().size();
+        pending.pop_front();
+      }
+    }
+    for (auto &f : pending) {
+      sink += f.get().size();
+    }
+  });
+
+  // Every variant must be a standalone pka with the right name
+  const prefix_compressor prefix(view.substr(0, at.begin));
+  for (const auto &name : {names.front(), names.back()}) {
+    const std::string pka =
+        encrypt_compressed(prefix.compress({name, suffix}), eax::pka);
+    if (decrypt_pka(pka) != modify_user_profile(xml, name)) {
+      std::fprintf(stderr, "variant %s does not round trip\n", name.c_str());
+      return 1;
+    }
+  }
+
+  std::printf("%zu variants of a %zu KB document (%zu bytes written)\n",
+              count, kb, sink);
+  std::printf("%-28s %8.3fs\n", "full recompression", full);
+  std::printf("%-28s %8.3fs %7.2fx\n", "shared prefix", shared,
+              full / shared);
+  std::printf("%-28s %8.3fs %7.2fx (%u threads)\n", "shared prefix, parallel",
+              parallel, full / parallel, jobs);
+  return 0;
+}
@@ -0,0 +1,69 @@
+// Streaming XML scanner throughput, whole buffer vs. inflate-sized chunks,
+// against a plain memchr pass over the same bytes.
+//
+// Build with `make bench`, run ./bench/bench_xml_scan [document size in MB]
+
+#include "../include/xml.hpp"
+#include "bench_util.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+
+namespace {
+
+class counter : public xml::handler {
+public:
+  bool on_event(const xml::event &e) override {
+    events++;
+    bytes += e.value.size();
+    return true;
+  }
+  size_t events = 0;
+  size_t bytes = 0;
+};
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  const size_t mb = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 64;
+  std::mt19937 rng(42);
+  const std::string doc =
+      bench::make_document(mb << 20, rng, bench::append_scanned_device);
+  const int reps = 5;
+
+  size_t sink = 0;
+  const double memchr_pass = bench::seconds(reps, [&] {
+    const char *p = doc.data();
+    const char *end = p + doc.size();
+    while ((p = static_cast<const char *>(std::memchr(p, '<', end - p)))) {
+      sink++;
+      p++;
+    }
+  });
+
+  counter whole;
+  const double whole_scan =
+      bench::seconds(reps, [&] { xml::scan(doc, whole); });
+
+  counter chunked;
+  const size_t chunk = 256 << 10;
+  const double chunked_scan = bench::seconds(reps, [&] {
+    xml::scanner s(chunked);
+    for (size_t i = 0; i < doc.size(); i += chunk) {
+      s.feed(doc.data() + i, std::min(chunk, doc.size() - i));
+    }
+    s.finish();
+  });
+
+  const double size = static_cast<double>(doc.size());
+  std::printf("%zu MB document, %zu events per scan (%zu)\n", mb,
+              whole.events / reps, sink);
+  std::printf("%-24s %8.1fMB/s\n", "memchr('<')", size / memchr_pass / 1e6);
+  std::printf("%-24s %8.1fMB/s\n", "scan, whole buffer", size / whole_scan / 1e6);
+  std::printf("%-24s %8.1fMB/s\n", "scan, 256 KB chunks",
+              size / chunked_scan / 1e6);
+  return 0;
+}
@@ -0,0 +1,268 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PKA2XML_BASE64_X86 1
+#endif
+
+namespace pka2xml {
+namespace base64 {
+
+/**
+ * @brief Worst-case decoded size of n input characters, plus the slack the
+ * vector paths need for their full-width stores
+ */
+constexpr size_t decoded_capacity(size_t n) { return n / 4 * 3 + 3 + 32; }
+
+namespace detail {
+
+struct table {
+  signed char v[256];
+  constexpr table() : v() {
+    for (int i = 0; i < 256; i++) {
+      v[i] = -1;
+    }
+    const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    for (int i = 0; i < 64; i++) {
+      v[static_cast<unsigned char>(alphabet[i])] = static_cast<signed char>(i);
+    }
+  }
+};
+
+inline constexpr table values{};
+
+/**
+ * @brief Decoder state carried between the vector and scalar paths
+ *
+ * The vector paths only run on a quartet boundary (pos == 0); everything
+ * else, including characters outside the alphabet, goes through scalar().
+ */
+struct state {
+  const unsigned char *in;
+  const unsigned char *end;
+  unsigned char *out;
+  uint32_t acc = 0;
+  int pos = 0;
+};
+
+/**
+ * @brief Decodes up to n characters one at a time
+ *
+ * Characters outside the alphabet, including '=' and line endings, are
+ * skipped, which is what CryptoPP::Base64Decoder does.
+ */
+inline void scalar(state &s, size_t n) {
+  const unsigned char *stop = s.in + n < s.end ? s.in + n : s.end;
+  for (; s.in < stop; s.in++) {
+    const int v = values.v[*s.in];
+    if (v < 0) {
+      continue;
+    }
+    s.acc = (s.acc << 6) | static_cast<uint32_t>(v);
+    if (++s.pos == 4) {
+      s.out[0] = static_cast<unsigned char>(s.acc >> 16);
+      s.out[1] = static_cast<unsigned char>(s.acc >> 8);
+      s.out[2] = static_cast<unsigned char>(s.acc);
+      s.out += 3;
+      s.acc = 0;
+      s.pos = 0;
+    }
+  }
+}
+
+/**
+ * @brief Consumes characters until the next quartet boundary
+ */
+inline void realign(state &s) {
+  while (s.pos != 0 && s.in < s.end) {
+    scalar(s, 1);
+  }
+}
+
+/**
+ * @brief Flushes a trailing partial quartet
+ */
+inline void finish(state &s) {
+  if (s.pos == 2) {
+    *s.out++ = static_cast<unsigned char>(s.acc >> 4);
+  } else if (s.pos == 3) {
+    *s.out++ = static_cast<unsigned char>(s.acc >> 10);
+    *s.out++ = static_cast<unsigned char>(s.acc >> 2);
+  }
+}
+
+#ifdef PKA2XML_BASE64_X86
+
+/*
+ * Vector decoding follows Muła and Lemire, "Faster Base64 Encoding and
+ * Decoding Using AVX2 Instructions": the high nibble of each character
+ * selects an offset that maps it to its 6-bit value, two nibble lookups
+ * flag characters outside the alphabet, and multiply-adds pack four 6-bit
+ * values into three bytes.
+ */
+
+__attribute__((target("ssse3"))) inline void ssse3(state &s) {
+  const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                       0x11, 0x11, 0x11, 0x11, 0x13, 0x1a,
+                                       0x1b, 0x1b, 0x1b, 0x1a);
+  const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08,
+                                       0x04, 0x08, 0x10, 0x10, 0x10, 0x10,
+                                       0x10, 0x10, 0x10, 0x10);
+  const __m128i lut_roll =
+      _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                     -1, -1, -1, -1);
+
+  while (s.end - s.in >= 16) {
+    const __m128i in =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(s.in));
+    const __m128i hi = _mm_and_si128(_mm_srli_epi32(in, 4), nibble);
+    const __m128i lo = _mm_and_si128(in, nibble);
+    const __m128i invalid = _mm_and_si128(_mm_shuffle_epi8(lut_lo, lo),
+                                          _mm_shuffle_epi8(lut_hi, hi));
+    if (_mm_movemask_epi8(_mm_cmpgt_epi8(invalid, _mm_setzero_si128())) !=
+        0) {
+      // Padding, whitespace or garbage somewhere in this block
+      scalar(s, 16);
+      realign(s);
+      continue;
+    }
+
+    const __m128i slash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+    const __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(slash, hi));
+    const __m128i v = _mm_add_epi8(in, roll);
+    const __m128i ab = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+    const __m128i abcd = _mm_madd_epi16(ab, _mm_set1_epi32(0x00011000));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(s.out),
+                     _mm_shuffle_epi8(abcd, pack));
+    s.in += 16;
+    s.out += 12;
+  }
+}
+
+__attribute__((target("avx2"))) inline void avx2(state &s) {
+  const __m256i lut_lo = _mm256_setr_epi8(
+      0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a,
+      0x1b, 0x1b, 0x1b, 0x1a, 0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+      0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+  const __m256i lut_hi = _mm256_setr_epi8(
+      0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10,
+      0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+      0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m256i lut_roll =
+      _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0,
+                       0, 0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0,
+                       0, 0);
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  const __m256i pack = _mm256_setr_epi8(
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1, 2, 1, 0, 6, 5,
+      4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  const __m256i compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+
+  while (s.end - s.in >= 32) {
+    const __m256i in =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s.in));
+    const __m256i hi = _mm256_and_si256(_mm256_srli_epi32(in, 4), nibble);
+    const __m256i lo = _mm256_and_si256(in, nibble);
+    const __m256i invalid = _mm256_and_si256(_mm256_shuffle_epi8(lut_lo, lo),
+                                             _mm256_shuffle_epi8(lut_hi, hi));
+    if (_mm256_movemask_epi8(
+            _mm256_cmpgt_epi8(invalid, _mm256_setzero_si256())) != 0) {
+      scalar(s, 32);
+      realign(s);
+      continue;
+    }
+
+    const __m256i slash = _mm256_cmpeq_epi8(in, _mm256_set1_epi8('/'));
+    const __m256i roll =
+        _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(slash, hi));
+    const __m256i v = _mm256_add_epi8(in, roll);
+    const __m256i ab = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+    const __m256i abcd = _mm256_madd_epi16(ab, _mm256_set1_epi32(0x00011000));
+    const __m256i packed = _mm256_permutevar8x32_epi32(
+        _mm256_shuffle_epi8(abcd, pack), compact);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(s.out), packed);
+    s.in += 32;
+    s.out += 24;
+  }
+}
+
+#endif
+
+/**
+ * @brief Best vector path for this CPU, picked once
+ */
+inline void (*vector_path())(state &) {
+#ifdef PKA2XML_BASE64_X86
+  static void (*const path)(state &) = [] {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return &avx2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+      return &ssse3;
+    }
+    return static_cast<void (*)(state &)>(nullptr);
+  }();
+  return path;
+#else
+  return nullptr;
+#endif
+}
+
+} // namespace detail
+
+/**
+ * @brief Decodes base64 into a caller-provided buffer
+ *
+ * Accepts the same input as CryptoPP::Base64Decoder: characters outside the
+ * alphabet (padding, CR/LF, spaces) are skipped and trailing bits that do
+ * not make a whole byte are dropped. Runs of valid characters are decoded 32
+ * (AVX2) or 16 (SSSE3) at a time, with a scalar fallback.
+ *
+ * @param in The base64 text
+ * @param n Length of the text
+ * @param out At least decoded_capacity(n) bytes
+ * @return size_t Number of bytes written
+ */
+inline size_t decode(const char *in, size_t n, unsigned char *out) {
+  detail::state s;
+  s.in = reinterpret_cast<const unsigned char *>(in);
+  s.end = s.in + n;
+  s.out = out;
+
+  if (auto path = detail::vector_path()) {
+    path(s);
+  }
+  detail::scalar(s, static_cast<size_t>(s.end - s.in));
+  detail::finish(s);
+  return static_cast<size_t>(s.out - out);
+}
+
+/**
+ * @brief Decodes base64 into a reusable string
+ *
+ * out is resized to the decoded length; its capacity is kept, so decoding
+ * many lines into the same string does not allocate once it has grown.
+ *
+ * @param in The base64 text
+ * @param out Receives the decoded bytes
+ */
+inline void decode(const std::string &in, std::string &out) {
+  const size_t capacity = decoded_capacity(in.size());
+  if (out.size() < capacity) {
+    out.resize(capacity);
+  }
+  out.resize(decode(in.data(), in.size(),
+                    reinterpret_cast<unsigned char *>(&out[0])));
+}
+
+} // namespace base64
+} // namespace pka2xml
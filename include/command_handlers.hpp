@@ -1,7 +1,10 @@
 #pragma once
 
+#include "../include/logs.hpp"
 #include "../include/utils.hpp"
+#include <cstdint>
 #include <cstdlib>
+#include <exception>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
@@ -11,6 +14,12 @@
 namespace pka2xml {
 std::string decrypt_pka(const std::string &input);
 std::string encrypt_pka(const std::string &input);
+std::vector<std::string>
+decrypt_pka_batch(const std::vector<std::string> &inputs,
+                  std::vector<std::exception_ptr> &errors);
+std::vector<std::string>
+encrypt_pka_batch(const std::vector<std::string> &inputs,
+                  std::vector<std::exception_ptr> &errors);
 std::string decrypt_logs(const std::string &input);
 std::string decrypt_nets(const std::string &input);
 std::string encrypt_nets(const std::string &input);
@@ -25,15 +34,46 @@ void write_file_contents(const std::string &filename,
 
 namespace handlers {
 
-void handle_decrypt(const char *infile, const char *outfile, bool verbose);
-void handle_encrypt(const char *infile, const char *outfile, bool verbose);
-void handle_logs(const char *infile, bool verbose);
+/**
+ * @brief What -d writes: the xml as stored, re-laid out, or as JSON
+ */
+enum class decrypt_output { xml, minified, pretty, json };
+
+void handle_decrypt(const char *infile, const char *outfile, bool verbose,
+                    bool normalize = false,
+                    decrypt_output output = decrypt_output::xml);
+void handle_encrypt(const char *infile, const char *outfile, bool verbose,
+                    bool minify = false);
+void handle_logs(const char *infile, unsigned jobs, bool follow,
+                 const logs::filter &keep, uint32_t stride,
+                 utils::output_format format, bool verbose);
+void handle_log_merge(const std::vector<std::string> &files, unsigned jobs,
+                      const logs::filter &keep, utils::output_format format,
+                      bool verbose);
+void handle_log_index(const char *infile, uint32_t stride, unsigned jobs,
+                      bool verbose);
 void handle_nets(const char *infile, bool verbose);
+void handle_stats(const char *infile, bool verbose);
+void handle_query(const char *expression,
+                  const std::vector<std::string> &files, unsigned jobs,
+                  utils::output_format format, bool verbose);
+void handle_grep(const std::vector<std::string> &patterns,
+                 const std::vector<std::string> &files, unsigned jobs,
+                 utils::output_format format, bool verbose);
+void handle_canon_hash(const std::vector<std::string> &inputs,
+                       const std::vector<std::string> &ignore, unsigned jobs,
+                       utils::output_format format, bool verbose);
+void handle_diff(const char *file_a, const char *file_b,
+                 utils::output_format format, bool verbose);
+void handle_edit_script(const char *script_file, const char *infile,
+                        const char *outfile, bool verbose);
 void handle_forge(const char *outfile, bool verbose);
 void handle_fix(const char *infile, const char *outfile, bool verbose);
 void handle_rename(const char *infile, const char *new_name_arg, bool verbose);
-void handle_batch_rename(int argc, char *argv[], int name_index, bool verbose);
+void handle_batch_rename(int argc, char *argv[], int name_index,
+                         utils::output_format format, bool verbose);
 void handle_batch_rename_multiple(const char *infile, int argc, char *argv[],
+                                  unsigned jobs, utils::output_format format,
                                   bool verbose);
 
 } // namespace handlers
\ No newline at end of file
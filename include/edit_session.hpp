@@ -0,0 +1,204 @@
+#pragma once
+
+#include "main.hpp"
+
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace pka2xml {
+
+/**
+ * @brief A decrypted document open for any number of edits
+ *
+ * Edits go to a piece table: the document is a list of pieces of the
+ * original text and of an append-only buffer holding inserted text. An edit
+ * splits at most two pieces and inserts one, so it costs O(pieces) however
+ * large the document is, and the original is never copied. save() hands
+ * the pieces to encrypt(), which deflates them in order, so there is no
+ * copy of the edited document either.
+ *
+ * Offsets are bytes of the document as it is after the edits so far.
+ */
+class edit_session {
+public:
+  explicit edit_session(std::string document)
+      : original(std::move(document)), length(original.size()) {
+    if (length != 0) {
+      table.push_back({false, 0, length});
+    }
+  }
+
+  /**
+   * @brief Opens an encrypted pka/pkt file for editing
+   *
+   * @param pka The encrypted file contents
+   */
+  static edit_session open(const std::string &pka) {
+    return edit_session(decrypt_pka(pka));
+  }
+
+  /**
+   * @brief Replaces count bytes at offset at with text
+   *
+   * @throws std::out_of_range If the range is not inside the document
+   */
+  void replace(uint64_t at, uint64_t count, std::string_view text) {
+    if (at > length || count > length - at) {
+      throw std::out_of_range("edit at " + std::to_string(at) + "+" +
+                              std::to_string(count) +
+                              " is outside the document of " +
+                              std::to_string(length) + " bytes");
+    }
+
+    const size_t first = split(at);
+    const size_t last = count == 0 ? first : split(at + count);
+    table.erase(table.begin() + first, table.begin() + last);
+    length -= count;
+    hint = first;
+    hint_start = at;
+    if (text.empty()) {
+      return;
+    }
+
+    // Consecutive insertions, such as typing, extend one piece
+    if (first != 0 && table[first - 1].added &&
+        table[first - 1].offset + table[first - 1].size == added.size()) {
+      table[first - 1].size += text.size();
+    } else {
+      table.insert(table.begin() + first, {true, added.size(), text.size()});
+      hint++;
+    }
+    added.append(text);
+    length += text.size();
+    hint_start += text.size();
+  }
+
+  void insert(uint64_t at, std::string_view text) { replace(at, 0, text); }
+  void erase(uint64_t at, uint64_t count) { replace(at, count, {}); }
+
+  uint64_t size() const { return length; }
+  size_t piece_count() const { return table.size(); }
+
+  /**
+   * @brief The edited document as slices of the session's buffers
+   *
+   * The views are invalidated by the next edit.
+   */
+  pieces view() const {
+    pieces document;
+    document.reserve(table.size());
+    for (const auto &p : table) {
+      const std::string &source = p.added ? added : original;
+      document.emplace_back(source.data() + p.offset, p.size);
+    }
+    return document;
+  }
+
+  /**
+   * @brief Copies out the edited document
+   */
+  std::string str() const {
+    std::string result;
+    result.reserve(length);
+    for (const auto &piece : view()) {
+      result.append(piece);
+    }
+    return result;
+  }
+
+  /**
+   * @brief Encrypts the edited document as a pka/pkt file
+   */
+  std::string save() const { return encrypt_pka(view()); }
+
+private:
+  struct piece {
+    bool added; // from the insert buffer rather than the original
+    uint64_t offset;
+    uint64_t size;
+  };
+
+  // Makes a piece start at document offset at and returns its index, or
+  // the number of pieces if at is the end of the document
+  size_t split(uint64_t at) {
+    // Edits in document order start from where the last one ended
+    size_t i = 0;
+    uint64_t start = 0;
+    if (at >= hint_start) {
+      i = hint;
+      start = hint_start;
+    }
+    for (; i < table.size(); i++) {
+      piece &p = table[i];
+      if (at == start) {
+        break;
+      }
+      if (at < start + p.size) {
+        const uint64_t head = at - start;
+        const piece tail{p.added, p.offset + head, p.size - head};
+        p.size = head;
+        table.insert(table.begin() + i + 1, tail);
+        i++;
+        break;
+      }
+      start += p.size;
+    }
+    hint = i;
+    hint_start = at;
+    return i;
+  }
+
+  std::string original;
+  std::string added;
+  std::vector<piece> table;
+  uint64_t length;
+  size_t hint = 0;         // a piece index, or the number of pieces
+  uint64_t hint_start = 0; // the document offset where that piece starts
+};
+
+/**
+ * @brief Sets the NAME of the USER_PROFILE section in a session
+ *
+ * The edited document is scanned as it stands, up to the name, which is
+ * then replaced in the piece table.
+ *
+ * @return bool false if there is no USER_PROFILE section, no NAME in it, or
+ * the document is malformed before it
+ */
+inline bool set_user_profile_name(edit_session &session,
+                                  std::string_view new_name,
+                                  bool verbose = false) {
+  detail::profile_name_finder finder(verbose);
+  try {
+    xml::scanner scanner(finder);
+    bool more = true;
+    for (const auto &piece : session.view()) {
+      if (!(more = scanner.feed(piece))) {
+        break;
+      }
+    }
+    if (more) {
+      scanner.finish();
+    }
+  } catch (const xml::parse_error &e) {
+    if (verbose)
+      std::cerr << "Error: Malformed XML: " << e.what() << std::endl;
+    return false;
+  }
+  if (!finder.found) {
+    if (verbose)
+      std::cerr << "Error: Could not find NAME tag within USER_PROFILE"
+                << std::endl;
+    return false;
+  }
+  session.replace(finder.name.begin, finder.name.end - finder.name.begin,
+                  new_name);
+  return true;
+}
+
+} // namespace pka2xml
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <re2/re2.h>
+#include <re2/set.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace grep {
+
+/**
+ * @brief Regular expressions searched for together
+ *
+ * Compiled once into an RE2::Set, which finds every pattern that occurs in
+ * a buffer in one pass, and into one RE2 each to locate the occurrences of
+ * the patterns the set found. A pattern set can be shared by any number of
+ * threads.
+ */
+class patterns {
+public:
+  /**
+   * @throws std::invalid_argument If a pattern does not compile
+   */
+  explicit patterns(const std::vector<std::string> &list);
+  ~patterns();
+
+  size_t size() const { return list.size(); }
+  const std::string &pattern(size_t i) const { return list[i]; }
+
+private:
+  friend class searcher;
+
+  std::vector<std::string> list;
+  std::vector<std::unique_ptr<RE2>> regexes;
+  std::unique_ptr<RE2::Set> set;
+};
+
+/**
+ * @brief One occurrence of a pattern
+ */
+struct hit {
+  uint64_t offset;    // in the whole stream
+  size_t pattern;     // index in the pattern set
+  std::string_view text; // only valid during the callback
+};
+
+/**
+ * @brief Searches a stream given in chunks, such as inflate output
+ *
+ * An occurrence is reported once overlap bytes of the stream follow its
+ * start, or at finish(), so for occurrences no longer than overlap the hits
+ * are those of one search of the whole stream: a greedy match cut by a
+ * chunk boundary is reported whole, and as each pattern's search goes on
+ * from the end of its last hit, never again in part. Hits are reported in
+ * stream order; empty matches are not reported.
+ */
+class searcher {
+public:
+  static constexpr size_t overlap = 4096;
+
+  using callback = std::function<void(const hit &)>;
+
+  searcher(const patterns &p, callback on_hit);
+
+  void feed(const char *data, size_t size);
+
+  /**
+   * @brief Reports the occurrences held back, at the end of the stream
+   */
+  void finish();
+
+  uint64_t hits() const { return found; }
+
+private:
+  void search(bool last);
+
+  const patterns &p;
+  callback on_hit;
+  std::string window; // end of the previous chunk, then the current one
+  uint64_t consumed = 0;
+  uint64_t from = 0; // where the search goes on; hits before it are out
+  std::vector<uint64_t> resume; // per pattern, after its last hit
+  std::vector<int> which;
+  std::vector<hit> pending;
+  uint64_t found = 0;
+};
+
+} // namespace grep
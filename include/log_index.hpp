@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace logs {
+
+/**
+ * @brief Sparse time index of an encrypted log file
+ *
+ * The log is cut into segments of stride lines; for each the index stores
+ * the byte offset of its first line and the earliest and latest timestamp in
+ * it. A time range query then only decrypts the segments that overlap it.
+ * Keeping the extremes rather than one sampled time makes the index exact
+ * even for files that are not in time order, such as several sessions
+ * appended together.
+ *
+ * The index is kept next to the log as "<log>.idx". It records the size and
+ * modification time of the log it was built from and is rebuilt when either
+ * changes.
+ */
+class index {
+public:
+  static constexpr uint32_t default_stride = 1024;
+
+  struct segment {
+    uint64_t offset;
+    int64_t first; // ms, see parse_timestamp; max() if no line had one
+    int64_t last;  // min() if no line had a timestamp
+  };
+
+  /**
+   * @brief Decrypts a log file once and records its segments
+   *
+   * @param path The encrypted log
+   * @param stride Lines per segment
+   * @param jobs Workers decrypting segments in parallel
+   * @return index The index, not yet saved
+   */
+  static index build(const std::string &path, uint32_t stride = default_stride,
+                     unsigned jobs = 1);
+
+  /**
+   * @brief Loads the sidecar index of a log if it is still current
+   *
+   * @param path The encrypted log (not the index)
+   * @param result Receives the index
+   * @return bool false if there is no index, it is unreadable, or the log
+   * changed since it was built
+   */
+  static bool load(const std::string &path, index &result);
+
+  /**
+   * @brief Writes the index next to the log
+   *
+   * @param path The encrypted log (not the index)
+   * @throws std::runtime_error If the index cannot be written
+   */
+  void save(const std::string &path) const;
+
+  /**
+   * @brief Byte ranges holding every line with a timestamp in [from, to]
+   *
+   * @return std::vector<std::pair<uint64_t, uint64_t>> Start and end offsets
+   * of runs of overlapping segments, in file order; all are line boundaries
+   */
+  std::vector<std::pair<uint64_t, uint64_t>> ranges(int64_t from,
+                                                    int64_t to) const;
+
+  const std::vector<segment> &segments() const { return segments_; }
+  uint64_t file_size() const { return file_size_; }
+  uint32_t stride() const { return stride_; }
+
+private:
+  uint64_t file_size_ = 0;
+  int64_t modified_ = 0;
+  uint32_t stride_ = default_stride;
+  std::vector<segment> segments_;
+};
+
+/**
+ * @brief Path of the sidecar index of a log file
+ */
+inline std::string index_path(const std::string &log) { return log + ".idx"; }
+
+} // namespace logs
@@ -0,0 +1,155 @@
+#pragma once
+
+#include "utils.hpp"
+
+#include <re2/re2.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace logs {
+
+/**
+ * @brief Parses the timestamp at the start of a decrypted log line
+ *
+ * Accepts Packet Tracer's "dd.MM.yyyy HH:mm:ss[.zzz]" and ISO 8601
+ * "yyyy-MM-dd[T ]HH:mm:ss[.zzz]". The time is taken as written, with no
+ * time zone conversion, so values only compare with each other.
+ *
+ * @param data Start of the text
+ * @param size Length of the text
+ * @param ms Receives milliseconds since 1970-01-01 00:00:00
+ * @return bool Whether the text starts with a timestamp
+ */
+bool parse_timestamp(const char *data, size_t size, int64_t &ms);
+
+/**
+ * @brief Which decrypted lines to keep
+ *
+ * A line is kept when its timestamp lies in [from, to] and, if a pattern is
+ * set, the pattern matches somewhere in it. When a time range is set, lines
+ * without a timestamp are dropped. Filtering happens right after each line
+ * is decrypted, so rejected lines are never copied to the output.
+ */
+struct filter {
+  int64_t from = std::numeric_limits<int64_t>::min();
+  int64_t to = std::numeric_limits<int64_t>::max();
+  std::shared_ptr<const re2::RE2> pattern;
+
+  bool by_time() const {
+    return from != std::numeric_limits<int64_t>::min() ||
+           to != std::numeric_limits<int64_t>::max();
+  }
+  bool empty() const { return !by_time() && !pattern; }
+  bool accept(const char *data, size_t size) const;
+};
+
+/**
+ * @brief Appends one decrypted line in the requested output format
+ *
+ * text writes the line as is, after "file: " if file is set. jsonl writes
+ * {"file":..., "time":..., "line":...} and a newline, with file omitted when
+ * empty and time, in ISO 8601, omitted when the line has no timestamp.
+ *
+ * @param out Receives the record
+ * @param file Name of the log the line came from, or empty
+ * @param line The decrypted line, without its newline
+ * @param size Length of the line
+ * @param format Output format
+ */
+void append_line(std::string &out, const std::string &file, const char *line,
+                 size_t size, utils::output_format format);
+
+/**
+ * @brief Decrypts the complete lines of a block of a log file
+ *
+ * Each line becomes a record as written by append_line().
+ *
+ * @param data Start of the block
+ * @param size Size of the block; a trailing partial line is decrypted too
+ * @param out Receives the decrypted lines
+ * @param keep Lines it rejects are dropped
+ * @param format Output format
+ * @throws Whatever decrypt_logs throws for a corrupt line, after out holds
+ * the lines before it
+ */
+void decrypt_lines(const char *data, size_t size, std::string &out,
+                   const filter &keep = {},
+                   utils::output_format format = utils::output_format::text);
+
+/**
+ * @brief Decrypts a whole log stream, preserving line order
+ *
+ * The stream is read in large blocks cut at the last newline. Blocks are
+ * decrypted on a pool of jobs workers and written to out in their original
+ * order, with at most a few blocks per worker in flight so memory stays
+ * bounded. The key schedule is precomputed, so workers need no per-thread
+ * cipher setup.
+ *
+ * @param in The encrypted log
+ * @param out Where the decrypted lines go
+ * @param jobs Number of workers; 1 decrypts on the calling thread
+ * @param keep Lines it rejects are dropped
+ * @param format Output format; records are formatted on the workers
+ * @param length Bytes to read from the current position; the default reads
+ * to the end. Must end on a line boundary.
+ */
+void decrypt_stream(std::istream &in, utils::output_buffer &out,
+                    unsigned jobs, const filter &keep = {},
+                    utils::output_format format = utils::output_format::text,
+                    uint64_t length = std::numeric_limits<uint64_t>::max());
+
+/**
+ * @brief Merges several log files into one time-ordered stream
+ *
+ * Each file is read in small blocks that are decrypted ahead on a shared
+ * pool while a min-heap keyed on the current line's timestamp picks the next
+ * line to write, so memory stays at a few blocks per file however large the
+ * inputs are. A file is only open while its next blocks are read, so the
+ * limit on open files does not bound how many can be merged. Each file must
+ * itself be in time order, as Packet Tracer's per-session logs are. A line
+ * without a timestamp takes the time of the line before it. Each line is
+ * labelled with its file name.
+ *
+ * @param paths The encrypted logs
+ * @param out Where the merged lines go
+ * @param jobs Number of workers; 1 decrypts on the calling thread
+ * @param keep Lines it rejects are dropped
+ * @param format Output format
+ */
+void merge(const std::vector<std::string> &paths, utils::output_buffer &out,
+           unsigned jobs, const filter &keep = {},
+           utils::output_format format = utils::output_format::text);
+
+/**
+ * @brief Follows growing log files and decrypts lines as they are appended
+ *
+ * path may be a single log file or a directory, in which case every *.log
+ * file in it is followed, including ones created later; lines are then
+ * labelled with the file name. Existing content is decrypted first, then
+ * only complete new lines are read from the remembered byte offset. A file
+ * that shrinks (truncation) is read again from the start. Each file is kept
+ * open, so when its path names a new inode (rotation), the old file is read
+ * to its end before the new one is read from the start.
+ *
+ * On Linux the wait uses inotify on the containing directory, so an idle
+ * follower uses no CPU; if its event queue overflows, every file is read
+ * and the directory scanned again. Elsewhere files are polled twice a
+ * second. A corrupt line is reported on stderr and skipped. Runs until
+ * interrupted.
+ *
+ * @param path The log file or directory
+ * @param out Where the decrypted lines go; flushed after every batch
+ * @param keep Lines it rejects are dropped
+ * @param format Output format
+ * @param verbose Report rotations and new files on stderr
+ */
+void follow(const std::string &path, utils::output_buffer &out,
+            const filter &keep, utils::output_format format, bool verbose);
+
+} // namespace logs
@@ -1,165 +1,782 @@
 #pragma once
 
 #include <cryptopp/base64.h>
-#include <cryptopp/cast.h>
-#include <cryptopp/eax.h>
 #include <cryptopp/filters.h>
-#include <cryptopp/twofish.h>
 #include <re2/re2.h>
 #include <zlib.h>
 
+#include "base64.hpp"
+#include "twofish_eax.hpp"
+#include "xml.hpp"
+
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <exception>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace pka2xml {
 
+/**
+ * @brief Thrown when inflating would exceed a configured memory cap
+ */
+class inflate_limit_error : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
+/**
+ * @brief Memory caps applied by uncompress()
+ *
+ * per_file bounds the output of a single document. per_process bounds the
+ * output buffers of all inflates running at the same time in this process,
+ * so concurrent jobs cannot add up to an OOM. Zero disables a cap; that is
+ * only for callers of the library, as --max-size and --max-memory reject it.
+ */
+struct inflate_limits {
+  unsigned long long per_file = 1ULL << 30;
+  unsigned long long per_process = 4ULL << 30;
+};
+
+/**
+ * @brief The process-wide inflate limits, adjustable at startup
+ */
+inline inflate_limits &limits() {
+  static inflate_limits l;
+  return l;
+}
+
+namespace detail {
+
+/**
+ * @brief Bytes currently held by in-progress inflate output buffers
+ */
+inline std::atomic<unsigned long long> &inflate_in_use() {
+  static std::atomic<unsigned long long> bytes{0};
+  return bytes;
+}
+
+/**
+ * @brief Charges output buffer growth against the per-process cap and gives
+ * it back when the inflate finishes
+ */
+class inflate_reservation {
+public:
+  ~inflate_reservation() { inflate_in_use() -= reserved; }
+
+  void grow(unsigned long long bytes) {
+    const unsigned long long cap = limits().per_process;
+    const unsigned long long now = inflate_in_use() += bytes;
+    if (cap != 0 && now > cap) {
+      inflate_in_use() -= bytes;
+      throw inflate_limit_error("inflate would exceed the per-process memory "
+                                "cap of " +
+                                std::to_string(cap) + " bytes");
+    }
+    reserved += bytes;
+  }
+
+private:
+  unsigned long long reserved = 0;
+};
+
+} // namespace detail
+
+/**
+ * @brief Largest document the 4-byte size header can describe
+ */
+constexpr uint64_t max_document_size = 0xffffffffULL;
+
+namespace detail {
+
+/**
+ * @brief Largest count zlib accepts in one avail_in/avail_out (a uInt)
+ */
+constexpr size_t zlib_chunk = std::numeric_limits<uInt>::max();
+
+} // namespace detail
+
+/**
+ * @brief Block boundaries of a compressed document
+ *
+ * Recorded by uncompress() so that an edit can later recompress only the
+ * blocks around it (see recompress_edit). Bit positions count from the start
+ * of the compress() output, size header included; deflate stores bits least
+ * significant first.
+ */
+struct deflate_index {
+  struct block {
+    uint64_t bit;    // first bit of the block header
+    uint64_t offset; // uncompressed offset of the block's first byte
+  };
+  std::vector<block> blocks;
+  uint64_t end = 0; // bit after the final block
+};
+
 /**
  * @brief Uncompresses a buffer using zlib
  *
  * The first four bytes of the input buffer must contain the uncompressed size
  * in big-endian format.
  *
+ * The claimed size is not trusted: the output starts small and doubles as
+ * inflate fills it, never beyond the claimed size, and every growth step is
+ * checked against limits(). A header that claims more than the per-file cap
+ * is rejected before anything is inflated, and a stream that produces more
+ * or less data than it claims is rejected as corrupt.
+ *
+ * Sizes are 64-bit throughout and zlib is fed in uInt-sized chunks, so the
+ * compressed input may be any size; the output is bounded by the header at
+ * max_document_size.
+ *
  * @param data Pointer to the compressed data
  * @param nbytes Size of the compressed data
+ * @param index If set, receives the deflate block boundaries; inflate then
+ * stops at each block, which costs a little speed
  * @return std::string The uncompressed data
  * @throws int If decompression fails
+ * @throws inflate_limit_error If a memory cap would be exceeded
  */
-inline std::string uncompress(const unsigned char *data, int nbytes) {
+inline std::string uncompress(const unsigned char *data, size_t nbytes,
+                              deflate_index *index = nullptr) {
   if (nbytes < 4) {
     throw Z_DATA_ERROR;
   }
 
-  const unsigned long len =
-      (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | (data[3]);
+  const uint64_t len = (static_cast<uint64_t>(data[0]) << 24) |
+                       (static_cast<uint64_t>(data[1]) << 16) |
+                       (static_cast<uint64_t>(data[2]) << 8) |
+                       static_cast<uint64_t>(data[3]);
 
-  std::vector<unsigned char> buf(len);
-  unsigned long actual_len = len;
+  const unsigned long long per_file = limits().per_file;
+  if (per_file != 0 && len > per_file) {
+    throw inflate_limit_error("document claims " + std::to_string(len) +
+                              " bytes, over the per-file cap of " +
+                              std::to_string(per_file) + " bytes");
+  }
 
-  const int res = ::uncompress(buf.data(), &actual_len, data + 4, nbytes - 4);
+  z_stream zs{};
+  if (inflateInit(&zs) != Z_OK) {
+    throw Z_MEM_ERROR;
+  }
+  std::unique_ptr<z_stream, int (*)(z_stream *)> guard(&zs, inflateEnd);
 
-  if (res != Z_OK) {
-    throw res;
+  const unsigned char *in = data + 4;
+  size_t in_left = nbytes - 4;
+  if (index) {
+    *index = {};
   }
 
-  if (actual_len != len) {
+  // Typical documents compress 10-30x; start from there rather than from
+  // the header
+  detail::inflate_reservation reservation;
+  std::string out;
+  size_t size = static_cast<size_t>(std::min<uint64_t>(
+      len, std::max<uint64_t>(64 * 1024, 16 * static_cast<uint64_t>(in_left))));
+  reservation.grow(size);
+  out.resize(size);
+
+  size_t produced = 0;
+  for (;;) {
+    if (zs.avail_in == 0 && in_left != 0) {
+      zs.next_in = const_cast<Bytef *>(in);
+      zs.avail_in = static_cast<uInt>(std::min(in_left, detail::zlib_chunk));
+      in += zs.avail_in;
+      in_left -= zs.avail_in;
+    }
+
+    const size_t room = std::min(size - produced, detail::zlib_chunk);
+    zs.next_out = reinterpret_cast<Bytef *>(&out[0]) + produced;
+    zs.avail_out = static_cast<uInt>(room);
+
+    const int res = inflate(&zs, index ? Z_BLOCK : Z_NO_FLUSH);
+    produced += room - zs.avail_out;
+
+    if (res == Z_STREAM_END) {
+      break;
+    }
+    if (index && (zs.data_type & 128)) {
+      // Stopped at a block boundary: before a block header, or after the
+      // final block
+      const uint64_t consumed =
+          static_cast<uint64_t>(in - data) - zs.avail_in;
+      const uint64_t bit = 8 * consumed - (zs.data_type & 7);
+      if (zs.data_type & 64) {
+        index->end = bit;
+      } else if (index->blocks.empty() || index->blocks.back().bit != bit) {
+        index->blocks.push_back({bit, produced});
+      }
+    }
+    if (res != Z_OK && !(res == Z_BUF_ERROR && zs.avail_out == 0)) {
+      throw res == Z_NEED_DICT ? Z_DATA_ERROR : res;
+    }
+    if (zs.avail_out != 0) {
+      if (zs.avail_in == 0 && in_left == 0) {
+        // Input exhausted before the end of the stream
+        throw Z_BUF_ERROR;
+      }
+      continue;
+    }
+    if (produced < size) {
+      continue;
+    }
+    if (size == len) {
+      if (index && (zs.data_type & 192) == 192) {
+        // Stopped after the final block; only the trailer is left to read
+        continue;
+      }
+      // More data than the header claims
+      throw Z_DATA_ERROR;
+    }
+
+    const size_t next =
+        static_cast<size_t>(std::min<uint64_t>(len, uint64_t(size) * 2));
+    reservation.grow(next - size);
+    out.resize(next);
+    size = next;
+  }
+
+  if (produced != len) {
     throw Z_DATA_ERROR;
   }
 
-  return std::string(reinterpret_cast<const char *>(buf.data()), len);
+  return out;
 }
 
 /**
- * @brief Compresses a buffer using zlib
+ * @brief Uncompresses a buffer in chunks, without holding the whole output
+ *
+ * Same format and checks as uncompress(), but the output goes through one
+ * reused buffer of chunk bytes and is handed to sink each time it fills and
+ * at the end. Only that buffer counts against limits().
+ *
+ * @param data Pointer to the compressed data
+ * @param nbytes Size of the compressed data
+ * @param sink Called as sink(const char *, size_t); returns false to stop
+ * @param chunk Size of the output buffer
+ * @return bool false if sink stopped before the end of the document
+ * @throws int If decompression fails
+ * @throws inflate_limit_error If a memory cap would be exceeded
+ */
+template <typename Sink>
+inline bool uncompress_chunks(const unsigned char *data, size_t nbytes,
+                              Sink &&sink, size_t chunk = 256 << 10) {
+  if (nbytes < 4) {
+    throw Z_DATA_ERROR;
+  }
+
+  const uint64_t len = (static_cast<uint64_t>(data[0]) << 24) |
+                       (static_cast<uint64_t>(data[1]) << 16) |
+                       (static_cast<uint64_t>(data[2]) << 8) |
+                       static_cast<uint64_t>(data[3]);
+
+  const unsigned long long per_file = limits().per_file;
+  if (per_file != 0 && len > per_file) {
+    throw inflate_limit_error("document claims " + std::to_string(len) +
+                              " bytes, over the per-file cap of " +
+                              std::to_string(per_file) + " bytes");
+  }
+
+  z_stream zs{};
+  if (inflateInit(&zs) != Z_OK) {
+    throw Z_MEM_ERROR;
+  }
+  std::unique_ptr<z_stream, int (*)(z_stream *)> guard(&zs, inflateEnd);
+
+  const unsigned char *in = data + 4;
+  size_t in_left = nbytes - 4;
+
+  chunk = std::min(chunk, detail::zlib_chunk);
+  detail::inflate_reservation reservation;
+  reservation.grow(chunk);
+  std::string out(chunk, '\0');
+
+  uint64_t produced = 0;
+  for (;;) {
+    if (zs.avail_in == 0 && in_left != 0) {
+      zs.next_in = const_cast<Bytef *>(in);
+      zs.avail_in = static_cast<uInt>(std::min(in_left, detail::zlib_chunk));
+      in += zs.avail_in;
+      in_left -= zs.avail_in;
+    }
+
+    zs.next_out = reinterpret_cast<Bytef *>(&out[0]);
+    zs.avail_out = static_cast<uInt>(chunk);
+
+    const int res = inflate(&zs, Z_NO_FLUSH);
+    const size_t got = chunk - zs.avail_out;
+    produced += got;
+    if (produced > len) {
+      // More data than the header claims
+      throw Z_DATA_ERROR;
+    }
+    if (res != Z_OK && res != Z_STREAM_END &&
+        !(res == Z_BUF_ERROR && zs.avail_out == 0)) {
+      throw res == Z_NEED_DICT ? Z_DATA_ERROR : res;
+    }
+    if (got != 0 && !sink(out.data(), got)) {
+      return false;
+    }
+    if (res == Z_STREAM_END) {
+      break;
+    }
+    if (zs.avail_out != 0 && zs.avail_in == 0 && in_left == 0) {
+      // Input exhausted before the end of the stream
+      throw Z_BUF_ERROR;
+    }
+  }
+
+  if (produced != len) {
+    throw Z_DATA_ERROR;
+  }
+  return true;
+}
+
+/**
+ * @brief A document given as consecutive pieces of other buffers
+ *
+ * Lets an edited document be compressed and encrypted straight from the
+ * unchanged parts of the original and the replacement text, without
+ * materializing the edited copy.
+ */
+using pieces = std::vector<std::string_view>;
+
+/**
+ * @brief Total length of a pieced document
+ */
+inline size_t total_size(const pieces &document) {
+  size_t size = 0;
+  for (const auto &piece : document) {
+    size += piece.size();
+  }
+  return size;
+}
+
+namespace detail {
+
+/**
+ * @brief Worst-case deflate output for nbytes of input
+ *
+ * Same bound as zlib's compressBound(), computed in 64 bits.
+ */
+inline size_t deflate_bound(size_t nbytes) {
+  return nbytes + (nbytes >> 12) + (nbytes >> 14) + (nbytes >> 25) + 13;
+}
+
+/**
+ * @brief Feeds a pieced document to deflate
+ *
+ * The output is written to buf from produced on, growing buf when it fills.
+ * flush applies after the last piece: Z_FINISH ends the stream, Z_SYNC_FLUSH
+ * ends the current block and aligns the output to a byte, and Z_NO_FLUSH
+ * leaves the stream open with any output deflate still holds kept in its
+ * state.
+ *
+ * @return size_t The end of the output in buf
+ * @throws int If compression fails
+ */
+inline size_t deflate_pieces(z_stream &zs, const pieces &document,
+                             std::string &buf, size_t produced, int flush) {
+  auto piece = document.begin();
+  const unsigned char *in = nullptr;
+  size_t in_left = 0;
+  for (;;) {
+    while (in_left == 0 && piece != document.end()) {
+      in = reinterpret_cast<const unsigned char *>(piece->data());
+      in_left = piece->size();
+      ++piece;
+    }
+    if (zs.avail_in == 0 && in_left != 0) {
+      zs.next_in = const_cast<Bytef *>(in);
+      zs.avail_in = static_cast<uInt>(std::min(in_left, zlib_chunk));
+      in += zs.avail_in;
+      in_left -= zs.avail_in;
+    }
+    if (produced == buf.size()) {
+      buf.resize(buf.size() + buf.size() / 2 + 64);
+    }
+
+    const size_t room = std::min(buf.size() - produced, zlib_chunk);
+    zs.next_out = reinterpret_cast<Bytef *>(&buf[0]) + produced;
+    zs.avail_out = static_cast<uInt>(room);
+
+    const bool last = in_left == 0 && piece == document.end();
+    const int res = deflate(&zs, last ? flush : Z_NO_FLUSH);
+    produced += room - zs.avail_out;
+    if (res == Z_STREAM_END) {
+      return produced;
+    }
+    if (res != Z_OK && res != Z_BUF_ERROR) {
+      throw res;
+    }
+    if (flush != Z_FINISH && last && zs.avail_in == 0 &&
+        (flush == Z_NO_FLUSH || zs.avail_out != 0)) {
+      return produced;
+    }
+  }
+}
+
+/**
+ * @brief Stores the uncompressed size in the first 4 bytes (big-endian)
+ */
+inline void put_size_header(std::string &buf, size_t nbytes) {
+  buf[0] = (nbytes & 0xff000000) >> 24;
+  buf[1] = (nbytes & 0x00ff0000) >> 16;
+  buf[2] = (nbytes & 0x0000ff00) >> 8;
+  buf[3] = (nbytes & 0x000000ff);
+}
+
+/**
+ * @brief Refuses documents the 32-bit size header cannot describe
+ */
+inline void check_document_size(size_t nbytes) {
+  if (nbytes > max_document_size) {
+    throw std::length_error(
+        "document of " + std::to_string(nbytes) +
+        " bytes does not fit the 32-bit size header of the file format");
+  }
+}
+
+} // namespace detail
+
+/**
+ * @brief Compresses a pieced document using zlib
  *
  * The first four bytes of the output buffer will contain the uncompressed size
  * in big-endian format.
  *
+ * The pieces are fed to deflate in order, each in uInt-sized chunks, so the
+ * result is the same as compressing their concatenation. The header only has
+ * 32 bits: documents larger than max_document_size cannot be represented in
+ * the format and are refused rather than written with a truncated size that
+ * no reader could check.
+ *
+ * @param document The uncompressed data
+ * @return std::string The compressed data
+ * @throws int If compression fails
+ * @throws std::length_error If the document exceeds max_document_size
+ */
+inline std::string compress(const pieces &document) {
+  const size_t nbytes = total_size(document);
+  detail::check_document_size(nbytes);
+
+  z_stream zs{};
+  if (deflateInit(&zs, Z_DEFAULT_COMPRESSION) != Z_OK) {
+    throw Z_MEM_ERROR;
+  }
+  std::unique_ptr<z_stream, int (*)(z_stream *)> guard(&zs, deflateEnd);
+
+  std::string buf(4 + detail::deflate_bound(nbytes), '\0');
+  buf.resize(detail::deflate_pieces(zs, document, buf, 4, Z_FINISH));
+  detail::put_size_header(buf, nbytes);
+
+  return buf;
+}
+
+/**
+ * @brief Compresses a buffer using zlib
+ *
  * @param data Pointer to the uncompressed data
  * @param nbytes Size of the uncompressed data
  * @return std::string The compressed data
  * @throws int If compression fails
+ * @throws std::length_error If nbytes exceeds max_document_size
  */
-inline std::string compress(const unsigned char *data, int nbytes) {
-  // Calculate maximum possible compressed size
-  unsigned long len = nbytes + nbytes / 100 + 13;
-  std::vector<unsigned char> buf(len + 4);
+inline std::string compress(const unsigned char *data, size_t nbytes) {
+  return compress(
+      pieces{std::string_view(reinterpret_cast<const char *>(data), nbytes)});
+}
 
-  // Compress the data
-  const int res = ::compress2(buf.data() + 4, &len, data, nbytes, -1);
-  if (res != Z_OK) {
-    throw res;
+/**
+ * @brief Compresses many documents that start with the same prefix
+ *
+ * The prefix is deflated once and the stream is left open. Each document
+ * then continues from a deflateCopy() of that state, so only its own rest is
+ * compressed. The output is a complete zlib stream, identical in format to
+ * what compress() produces for the whole document.
+ *
+ * compress() only reads the shared state, so it may be called from several
+ * threads at once.
+ */
+class prefix_compressor {
+public:
+  /**
+   * @param prefix The shared start of the documents; only read here
+   * @throws int If compression fails
+   */
+  explicit prefix_compressor(std::string_view prefix)
+      : prefix_size(prefix.size()) {
+    if (deflateInit(&base, Z_DEFAULT_COMPRESSION) != Z_OK) {
+      throw Z_MEM_ERROR;
+    }
+    try {
+      head.resize(4 + detail::deflate_bound(prefix_size));
+      head.resize(
+          detail::deflate_pieces(base, pieces{prefix}, head, 4, Z_NO_FLUSH));
+    } catch (...) {
+      deflateEnd(&base);
+      throw;
+    }
   }
 
-  // Resize buffer to actual compressed size + 4 bytes for length
-  buf.resize(len + 4);
+  ~prefix_compressor() { deflateEnd(&base); }
 
-  // Store original size in first 4 bytes (big-endian)
-  buf[0] = (nbytes & 0xff000000) >> 24;
-  buf[1] = (nbytes & 0x00ff0000) >> 16;
-  buf[2] = (nbytes & 0x0000ff00) >> 8;
-  buf[3] = (nbytes & 0x000000ff);
+  prefix_compressor(const prefix_compressor &) = delete;
+  prefix_compressor &operator=(const prefix_compressor &) = delete;
+
+  /**
+   * @brief Compresses the prefix followed by rest
+   *
+   * @param rest The rest of the document, as consecutive pieces
+   * @return std::string The compressed data, with its size header
+   * @throws int If compression fails
+   * @throws std::length_error If the document exceeds max_document_size
+   */
+  std::string compress(const pieces &rest) const {
+    const size_t nbytes = prefix_size + total_size(rest);
+    detail::check_document_size(nbytes);
 
-  return std::string(reinterpret_cast<const char *>(buf.data()), buf.size());
+    z_stream zs{};
+    if (deflateCopy(&zs, const_cast<z_stream *>(&base)) != Z_OK) {
+      throw Z_MEM_ERROR;
+    }
+    std::unique_ptr<z_stream, int (*)(z_stream *)> guard(&zs, deflateEnd);
+
+    // Room for what the copied state still holds as well as the rest
+    std::string buf = head;
+    buf.resize(head.size() + detail::deflate_bound(total_size(rest)) +
+               (64 << 10));
+    buf.resize(detail::deflate_pieces(zs, rest, buf, head.size(), Z_FINISH));
+    detail::put_size_header(buf, nbytes);
+
+    return buf;
+  }
+
+private:
+  z_stream base{};
+  std::string head; // size header slot and the prefix output so far
+  size_t prefix_size;
+};
+
+/**
+ * @brief Largest distance a deflate back-reference can reach
+ */
+constexpr size_t deflate_window = 32768;
+
+/**
+ * @brief Recompresses a document after one range of it was replaced
+ *
+ * Only the deflate blocks that can see the edit are compressed again: from
+ * the block holding the first changed byte up to the first block that starts
+ * a full window past the changed range, so none of its back-references reach
+ * into it. The blocks before are copied as they are. The blocks after are
+ * copied too, shifted to the bit where the new blocks end rather than
+ * decoded and matched again; their references stay valid because they only
+ * point at unchanged bytes at unchanged distances. The size header and the
+ * adler-32 trailer are rewritten for the new document.
+ *
+ * For a small edit of a large document this costs a few blocks of deflate
+ * instead of the whole document.
+ *
+ * @param compressed The compress() output for xml
+ * @param index Its block boundaries, from uncompress()
+ * @param xml The original document
+ * @param begin First byte of xml that is replaced
+ * @param end End of the replaced range in xml
+ * @param replacement What goes in its place
+ * @return std::string The compressed edited document, with its size header
+ * @throws int If compression fails
+ * @throws std::length_error If the edited document exceeds max_document_size
+ */
+inline std::string recompress_edit(const std::string &compressed,
+                                   const deflate_index &index,
+                                   std::string_view xml, size_t begin,
+                                   size_t end, std::string_view replacement) {
+  const size_t nbytes = xml.size() - (end - begin) + replacement.size();
+  detail::check_document_size(nbytes);
+  if (index.blocks.empty() || begin > end || end > xml.size() ||
+      index.end <= index.blocks.back().bit ||
+      index.end > 8 * uint64_t(compressed.size())) {
+    throw Z_DATA_ERROR;
+  }
+
+  // The block holding the edit, and the first one its changes cannot reach
+  auto first = std::upper_bound(
+      index.blocks.begin(), index.blocks.end(), begin,
+      [](size_t offset, const deflate_index::block &b) {
+        return offset < b.offset;
+      });
+  --first;
+  auto reuse = std::lower_bound(
+      first, index.blocks.end(), uint64_t(end) + deflate_window,
+      [](const deflate_index::block &b, uint64_t offset) {
+        return b.offset < offset;
+      });
+  const bool tail = reuse != index.blocks.end();
+  const size_t stop = tail ? static_cast<size_t>(reuse->offset) : xml.size();
+
+  z_stream zs{};
+  if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    throw Z_MEM_ERROR;
+  }
+  std::unique_ptr<z_stream, int (*)(z_stream *)> guard(&zs, deflateEnd);
+
+  // The new blocks may refer back into the unchanged window before them, and
+  // start at the bit where the copied blocks end
+  const size_t start = static_cast<size_t>(first->offset);
+  const size_t window = std::min(start, deflate_window);
+  if (window != 0 &&
+      deflateSetDictionary(
+          &zs, reinterpret_cast<const Bytef *>(xml.data() + start - window),
+          static_cast<uInt>(window)) != Z_OK) {
+    throw Z_STREAM_ERROR;
+  }
+  const size_t head = static_cast<size_t>(first->bit / 8);
+  const int head_bits = static_cast<int>(first->bit % 8);
+  if (head_bits != 0 &&
+      deflatePrime(&zs, head_bits,
+                   static_cast<unsigned char>(compressed[head]) &
+                       ((1 << head_bits) - 1)) != Z_OK) {
+    throw Z_STREAM_ERROR;
+  }
+
+  const pieces changed{xml.substr(start, begin - start), replacement,
+                       xml.substr(end, stop - end)};
+  std::string buf(compressed, 0, head);
+  buf.resize(head + detail::deflate_bound(total_size(changed)) + 64);
+  size_t produced = detail::deflate_pieces(zs, changed, buf, head,
+                                           tail ? Z_SYNC_FLUSH : Z_FINISH);
+
+  if (tail) {
+    // The rest of the blocks, moved from their bit offset to a byte boundary
+    const auto *old = reinterpret_cast<const unsigned char *>(compressed.data());
+    const size_t from = static_cast<size_t>(reuse->bit / 8);
+    const int shift = static_cast<int>(reuse->bit % 8);
+    const size_t to = static_cast<size_t>((index.end + 7) / 8);
+    const size_t count = static_cast<size_t>((index.end - reuse->bit + 7) / 8);
+    buf.resize(produced + count);
+    auto *out = reinterpret_cast<unsigned char *>(&buf[produced]);
+    if (shift == 0) {
+      std::memcpy(out, old + from, count);
+    } else {
+      for (size_t i = from; i < from + count; i++) {
+        const unsigned next = i + 1 < to ? old[i + 1] : 0;
+        *out++ = static_cast<unsigned char>((old[i] >> shift) |
+                                            (next << (8 - shift)));
+      }
+    }
+    produced += count;
+  }
+
+  // adler-32 of the whole new document, as the zlib trailer
+  uLong adler = adler32(0L, Z_NULL, 0);
+  for (const auto &piece : pieces{xml.substr(0, begin), replacement,
+                                  xml.substr(end)}) {
+    for (size_t i = 0; i < piece.size(); i += detail::zlib_chunk) {
+      adler = adler32(adler, reinterpret_cast<const Bytef *>(piece.data() + i),
+                      static_cast<uInt>(
+                          std::min(piece.size() - i, detail::zlib_chunk)));
+    }
+  }
+  buf.resize(produced + 4);
+  buf[produced] = static_cast<char>(adler >> 24);
+  buf[produced + 1] = static_cast<char>(adler >> 16);
+  buf[produced + 2] = static_cast<char>(adler >> 8);
+  buf[produced + 3] = static_cast<char>(adler);
+
+  detail::put_size_header(buf, nbytes);
+  return buf;
 }
 
 /**
- * @brief Generic decryption function for Packet Tracer files
+ * @brief Stages 1 to 3 of decryption, with a fixed, precomputed key schedule
  *
- * The decryption process consists of four stages:
- * 1. Deobfuscation: b[i] = a[l + ~i] ^ (l - i * l)
- * 2. Decryption: TwoFish/CAST256 in EAX mode
- * 3. Deobfuscation: b[i] = a[i] ^ (l - i)
- * 4. Decompression: zlib
+ * Leaves the document compressed, for callers that need the deflate stream
+ * itself (see recompress_edit).
  *
- * @tparam Algorithm The encryption algorithm to use (TwoFish or CAST256)
  * @param input The encrypted input data
- * @param key The encryption key
- * @param iv The initialization vector
- * @return std::string The decrypted data
+ * @param constants The precomputed EAX state for the key/iv pair
+ * @return std::string zlib data with its size header, as from compress()
  */
-template <typename Algorithm>
-inline std::string decrypt(const std::string &input,
-                           const std::array<unsigned char, 16> &key,
-                           const std::array<unsigned char, 16> &iv) {
-  typename CryptoPP::EAX<Algorithm>::Decryption d;
-  d.SetKeyWithIV(key.data(), key.size(), iv.data(), iv.size());
-
-  const int length = input.size();
+inline std::string decrypt_compressed(const std::string &input,
+                                      const eax::constants &constants) {
+  const size_t length = input.size();
   std::string processed(length, '\0');
-  std::string output;
 
   // Stage 1: Deobfuscation
-  for (int i = 0; i < length; i++) {
+  for (size_t i = 0; i < length; i++) {
     processed[i] = input[length + ~i] ^ (length - i * length);
   }
 
   // Stage 2: Decryption
-  CryptoPP::StringSource ss(processed, true,
-                            new CryptoPP::AuthenticatedDecryptionFilter(
-                                d, new CryptoPP::StringSink(output)));
+  std::string output(length < 16 ? 0 : length - 16, '\0');
+  eax::decrypt(constants,
+               reinterpret_cast<const unsigned char *>(processed.data()),
+               processed.size(), reinterpret_cast<unsigned char *>(&output[0]));
 
   // Stage 3: Deobfuscation
   for (size_t i = 0; i < output.size(); i++) {
     output[i] = output[i] ^ (output.size() - i);
   }
 
+  return output;
+}
+
+/**
+ * @brief Decryption with a fixed, precomputed key schedule
+ *
+ * The decryption process consists of four stages:
+ * 1. Deobfuscation: b[i] = a[l + ~i] ^ (l - i * l)
+ * 2. Decryption: Twofish in EAX mode, with the constants evaluated at
+ *    compile time, so there is no per-call key setup
+ * 3. Deobfuscation: b[i] = a[i] ^ (l - i)
+ * 4. Decompression: zlib
+ *
+ * @param input The encrypted input data
+ * @param constants The precomputed EAX state for the key/iv pair
+ * @return std::string The decrypted data
+ */
+inline std::string decrypt(const std::string &input,
+                           const eax::constants &constants) {
+  const std::string compressed = decrypt_compressed(input, constants);
+
   // Stage 4: Decompression
-  return uncompress(reinterpret_cast<const unsigned char *>(output.data()),
-                    output.size());
+  return uncompress(reinterpret_cast<const unsigned char *>(compressed.data()),
+                    compressed.size());
 }
 
 /**
- * @brief Simplified decryption function that only performs stages 1 and 2
+ * @brief Stages 1 and 2 only, with a fixed, precomputed key schedule
  *
- * @tparam Algorithm The encryption algorithm to use
  * @param input The encrypted input data
- * @param key The encryption key
- * @param iv The initialization vector
+ * @param constants The precomputed EAX state for the key/iv pair
  * @return std::string The partially decrypted data
  */
-template <typename Algorithm>
 inline std::string decrypt2(const std::string &input,
-                            const std::array<unsigned char, 16> &key,
-                            const std::array<unsigned char, 16> &iv) {
-  typename CryptoPP::EAX<Algorithm>::Decryption d;
-  d.SetKeyWithIV(key.data(), key.size(), iv.data(), iv.size());
-
-  const int length = input.size();
+                            const eax::constants &constants) {
+  const size_t length = input.size();
   std::string processed(length, '\0');
-  std::string output;
 
   // Stage 1: Deobfuscation
-  for (int i = 0; i < length; i++) {
+  for (size_t i = 0; i < length; i++) {
     processed[i] = input[length + ~i] ^ (length - i * length);
   }
 
   // Stage 2: Decryption
-  CryptoPP::StringSource ss(processed, true,
-                            new CryptoPP::AuthenticatedDecryptionFilter(
-                                d, new CryptoPP::StringSink(output)));
+  std::string output(length < 16 ? 0 : length - 16, '\0');
+  eax::decrypt(constants,
+               reinterpret_cast<const unsigned char *>(processed.data()),
+               processed.size(), reinterpret_cast<unsigned char *>(&output[0]));
 
   return output;
 }
@@ -167,63 +784,124 @@ inline std::string decrypt2(const std::string &input,
 /**
  * @brief Decrypts a Packet Tracer file
  *
- * Uses TwoFish encryption with key = {137}*16 and iv = {16}*16
+ * Uses TwoFish encryption with key = {137}*16 and iv = {16}*16; the key
+ * schedule and EAX constants are precomputed (see eax::pka).
  *
  * @param input The encrypted input data
  * @return std::string The decrypted data
  */
 inline std::string decrypt_pka(const std::string &input) {
-  static const std::array<unsigned char, 16> key{137, 137, 137, 137, 137, 137,
-                                                 137, 137, 137, 137, 137, 137,
-                                                 137, 137, 137, 137};
-  static const std::array<unsigned char, 16> iv{16, 16, 16, 16, 16, 16, 16, 16,
-                                                16, 16, 16, 16, 16, 16, 16, 16};
+  return decrypt(input, eax::pka);
+}
+
+/**
+ * @brief Decrypts several Packet Tracer files together
+ *
+ * Stages 1, 3 and 4 run per file, while stage 2 for the whole group goes
+ * through the multi-buffer EAX engine (see eax::decrypt_batch), so a group
+ * of small files costs little more than its largest member.
+ *
+ * @param inputs The encrypted files
+ * @param errors Receives, per input, the exception its decryption raised
+ * (null on success)
+ * @return std::vector<std::string> The decrypted data, empty where failed
+ */
+inline std::vector<std::string>
+decrypt_pka_batch(const std::vector<std::string> &inputs,
+                  std::vector<std::exception_ptr> &errors) {
+  const size_t count = inputs.size();
+  std::vector<std::string> processed(count), output(count), result(count);
+  std::vector<eax::job> jobs(count);
+  errors.assign(count, nullptr);
 
-  return decrypt<CryptoPP::Twofish>(input, key, iv);
+  for (size_t k = 0; k < count; k++) {
+    const std::string &input = inputs[k];
+    const size_t length = input.size();
+
+    // Stage 1: Deobfuscation
+    processed[k].resize(length);
+    for (size_t i = 0; i < length; i++) {
+      processed[k][i] = input[length + ~i] ^ (length - i * length);
+    }
+
+    output[k].resize(length < 16 ? 0 : length - 16);
+    jobs[k].in = reinterpret_cast<const unsigned char *>(processed[k].data());
+    jobs[k].length = processed[k].size();
+    jobs[k].out = reinterpret_cast<unsigned char *>(&output[k][0]);
+  }
+
+  // Stage 2: Decryption
+  eax::decrypt_batch(eax::pka, jobs.data(), count);
+
+  for (size_t k = 0; k < count; k++) {
+    try {
+      if (!jobs[k].ok) {
+        throw CryptoPP::HashVerificationFilter::HashVerificationFailed();
+      }
+
+      // Stage 3: Deobfuscation
+      std::string &out = output[k];
+      for (size_t i = 0; i < out.size(); i++) {
+        out[i] = out[i] ^ (out.size() - i);
+      }
+
+      // Stage 4: Decompression
+      result[k] = uncompress(reinterpret_cast<const unsigned char *>(out.data()),
+                             out.size());
+    } catch (...) {
+      errors[k] = std::current_exception();
+    }
+  }
+
+  return result;
 }
 
 /**
- * @brief Decrypts a Packet Tracer log file
+ * @brief Decrypts one line of a Packet Tracer log file
  *
  * The input must be base64 decoded before decryption.
- * Uses TwoFish encryption with key = {186}*16 and iv = {190}*16
+ * Uses TwoFish encryption with key = {186}*16 and iv = {190}*16; the key
+ * schedule and EAX constants are precomputed (see eax::logs).
  *
- * @param input The base64 encoded and encrypted input data
+ * @param data The base64 encoded and encrypted line
+ * @param size Length of the line
  * @return std::string The decrypted data
  */
-inline std::string decrypt_logs(const std::string &input) {
-  static const std::array<unsigned char, 16> key{186, 186, 186, 186, 186, 186,
-                                                 186, 186, 186, 186, 186, 186,
-                                                 186, 186, 186, 186};
-  static const std::array<unsigned char, 16> iv{190, 190, 190, 190, 190, 190,
-                                                190, 190, 190, 190, 190, 190,
-                                                190, 190, 190, 190};
+inline std::string decrypt_logs(const char *data, size_t size) {
+  // Decoded with the vectorized decoder into a per-thread buffer, so a long
+  // run of lines does not allocate for this step
+  thread_local std::string decoded;
+  const size_t capacity = base64::decoded_capacity(size);
+  if (decoded.size() < capacity) {
+    decoded.resize(capacity);
+  }
+  decoded.resize(base64::decode(
+      data, size, reinterpret_cast<unsigned char *>(&decoded[0])));
 
-  std::string decoded;
-  CryptoPP::StringSource ss(
-      input, true,
-      new CryptoPP::Base64Decoder(new CryptoPP::StringSink(decoded)));
+  return decrypt2(decoded, eax::logs);
+}
 
-  return decrypt2<CryptoPP::Twofish>(decoded, key, iv);
+/**
+ * @brief Decrypts a Packet Tracer log file
+ *
+ * @param input The base64 encoded and encrypted input data
+ * @return std::string The decrypted data
+ */
+inline std::string decrypt_logs(const std::string &input) {
+  return decrypt_logs(input.data(), input.size());
 }
 
 /**
  * @brief Decrypts a Packet Tracer nets file
  *
- * Uses TwoFish encryption with key = {186}*16 and iv = {190}*16
+ * Uses TwoFish encryption with key = {186}*16 and iv = {190}*16; the key
+ * schedule and EAX constants are precomputed (see eax::logs).
  *
  * @param input The encrypted input data
  * @return std::string The decrypted data
  */
 inline std::string decrypt_nets(const std::string &input) {
-  static const std::array<unsigned char, 16> key{186, 186, 186, 186, 186, 186,
-                                                 186, 186, 186, 186, 186, 186,
-                                                 186, 186, 186, 186};
-  static const std::array<unsigned char, 16> iv{190, 190, 190, 190, 190, 190,
-                                                190, 190, 190, 190, 190, 190,
-                                                190, 190, 190, 190};
-
-  return decrypt2<CryptoPP::Twofish>(input, key, iv);
+  return decrypt2(input, eax::logs);
 }
 
 /**
@@ -245,51 +923,32 @@ inline std::string decrypt_old(std::string input) {
 }
 
 /**
- * @brief Encrypts data for Packet Tracer files
+ * @brief Stages 2 to 4 of encryption, for data that is already compressed
  *
- * The encryption process consists of four stages:
- * 1. Compression: zlib
- * 2. Obfuscation: b[i] = a[i] ^ (l - i)
- * 3. Encryption: TwoFish/CAST256 in EAX mode
- * 4. Obfuscation: b[i] = a[l + ~i] ^ (l - i * l)
- *
- * @tparam Algorithm The encryption algorithm to use
- * @param input The plaintext input data
- * @param key The encryption key
- * @param iv The initialization vector
+ * @param compressed zlib output with its size header, as from compress() or
+ * prefix_compressor
+ * @param constants The precomputed EAX state for the key/iv pair
  * @return std::string The encrypted data
  */
-template <typename Algorithm>
-inline std::string encrypt(const std::string &input,
-                           const std::array<unsigned char, 16> &key,
-                           const std::array<unsigned char, 16> &iv) {
-  typename CryptoPP::EAX<Algorithm>::Encryption e;
-  e.SetKeyWithIV(key.data(), key.size(), iv.data(), iv.size());
+inline std::string encrypt_compressed(std::string compressed,
+                                      const eax::constants &constants) {
+  size_t compressed_size = compressed.size();
 
-  // Stage 1: Compression
-  std::string compressed = compress(
-      reinterpret_cast<const unsigned char *>(input.data()), input.size());
-  size_t compressed_size = compressed.size(); // Use size_t
-
-  // Stage 2: Obfuscation (Inverse of Decrypt Stage 3)
+  // Stage 2: Obfuscation
   for (size_t i = 0; i < compressed_size; i++) {
-    compressed[i] = compressed[i] ^ (compressed_size - i); // Correct XOR
+    compressed[i] = compressed[i] ^ (compressed_size - i);
   }
 
   // Stage 3: Encryption
-  std::string encrypted;
-  CryptoPP::StringSource ss(compressed, true,
-                            new CryptoPP::AuthenticatedEncryptionFilter(
-                                e, new CryptoPP::StringSink(encrypted)));
-  size_t encrypted_size = encrypted.size(); // Use size_t
+  std::string encrypted(compressed_size + 16, '\0');
+  eax::encrypt(constants,
+               reinterpret_cast<const unsigned char *>(compressed.data()),
+               compressed_size, reinterpret_cast<unsigned char *>(&encrypted[0]));
+  size_t encrypted_size = encrypted.size();
 
-  // Stage 4: Obfuscation (Inverse of Decrypt Stage 1)
+  // Stage 4: Obfuscation
   std::string output(encrypted_size, '\0');
   for (size_t i = 0; i < encrypted_size; i++) {
-    // Apply the inverse XOR and index mapping from Decrypt Stage 1
-    // Decrypt Stage 1: processed[i] = input[length + ~i] ^ (length - i *
-    // length); Encrypt Stage 4: output[length + ~i] = encrypted[i] ^ (length -
-    // i * length);
     output[encrypted_size + ~i] =
         encrypted[i] ^ (encrypted_size - i * encrypted_size);
   }
@@ -297,41 +956,132 @@ inline std::string encrypt(const std::string &input,
   return output;
 }
 
+/**
+ * @brief Encryption with a fixed, precomputed key schedule
+ *
+ * The encryption process consists of four stages:
+ * 1. Compression: zlib
+ * 2. Obfuscation: b[i] = a[i] ^ (l - i)
+ * 3. Encryption: Twofish in EAX mode, set up at compile time
+ * 4. Obfuscation: b[i] = a[l + ~i] ^ (l - i * l)
+ *
+ * @param input The plaintext input data, as consecutive pieces
+ * @param constants The precomputed EAX state for the key/iv pair
+ * @return std::string The encrypted data
+ */
+inline std::string encrypt(const pieces &input,
+                           const eax::constants &constants) {
+  // Stage 1: Compression
+  return encrypt_compressed(compress(input), constants);
+}
+
 /**
  * @brief Encrypts data for Packet Tracer files
  *
- * Uses TwoFish encryption with key = {137}*16 and iv = {16}*16
+ * Uses TwoFish encryption with key = {137}*16 and iv = {16}*16; the key
+ * schedule and EAX constants are precomputed (see eax::pka).
  *
  * @param input The plaintext input data
  * @return std::string The encrypted data
  */
 inline std::string encrypt_pka(const std::string &input) {
-  static const std::array<unsigned char, 16> key{137, 137, 137, 137, 137, 137,
-                                                 137, 137, 137, 137, 137, 137,
-                                                 137, 137, 137, 137};
-  static const std::array<unsigned char, 16> iv{16, 16, 16, 16, 16, 16, 16, 16,
-                                                16, 16, 16, 16, 16, 16, 16, 16};
+  return encrypt(pieces{input}, eax::pka);
+}
 
-  return encrypt<CryptoPP::Twofish>(input, key, iv);
+/**
+ * @brief Encrypts a pieced document for Packet Tracer files
+ *
+ * @param input The plaintext input data, as consecutive pieces
+ * @return std::string The encrypted data
+ */
+inline std::string encrypt_pka(const pieces &input) {
+  return encrypt(input, eax::pka);
+}
+
+/**
+ * @brief Encrypts several documents for Packet Tracer files together
+ *
+ * The batch counterpart of encrypt_pka: stage 3 for the whole group goes
+ * through the multi-buffer EAX engine (see eax::encrypt_batch).
+ *
+ * @param inputs The plaintext documents, each as consecutive pieces, such
+ * as edit_session::view()
+ * @param errors Receives, per input, the exception its encryption raised
+ * (null on success)
+ * @return std::vector<std::string> The encrypted data, empty where failed
+ */
+inline std::vector<std::string>
+encrypt_pka_batch(const std::vector<pieces> &inputs,
+                  std::vector<std::exception_ptr> &errors) {
+  const size_t count = inputs.size();
+  std::vector<std::string> compressed(count), encrypted(count), result(count);
+  std::vector<eax::job> jobs;
+  std::vector<size_t> index;
+  errors.assign(count, nullptr);
+
+  for (size_t k = 0; k < count; k++) {
+    try {
+      // Stage 1: Compression
+      compressed[k] = compress(inputs[k]);
+    } catch (...) {
+      errors[k] = std::current_exception();
+      continue;
+    }
+
+    // Stage 2: Obfuscation
+    std::string &c = compressed[k];
+    for (size_t i = 0; i < c.size(); i++) {
+      c[i] = c[i] ^ (c.size() - i);
+    }
+
+    encrypted[k].resize(c.size() + 16);
+    eax::job j;
+    j.in = reinterpret_cast<const unsigned char *>(c.data());
+    j.length = c.size();
+    j.out = reinterpret_cast<unsigned char *>(&encrypted[k][0]);
+    jobs.push_back(j);
+    index.push_back(k);
+  }
+
+  // Stage 3: Encryption
+  eax::encrypt_batch(eax::pka, jobs.data(), jobs.size());
+
+  // Stage 4: Obfuscation
+  for (size_t k : index) {
+    const std::string &e = encrypted[k];
+    const size_t encrypted_size = e.size();
+    result[k].resize(encrypted_size);
+    for (size_t i = 0; i < encrypted_size; i++) {
+      result[k][encrypted_size + ~i] =
+          e[i] ^ (encrypted_size - i * encrypted_size);
+    }
+  }
+
+  return result;
+}
+
+inline std::vector<std::string>
+encrypt_pka_batch(const std::vector<std::string> &inputs,
+                  std::vector<std::exception_ptr> &errors) {
+  std::vector<pieces> documents;
+  documents.reserve(inputs.size());
+  for (const auto &input : inputs) {
+    documents.push_back(pieces{input});
+  }
+  return encrypt_pka_batch(documents, errors);
 }
 
 /**
  * @brief Encrypts data for Packet Tracer nets files
  *
- * Uses TwoFish encryption with key = {186}*16 and iv = {190}*16
+ * Uses TwoFish encryption with key = {186}*16 and iv = {190}*16; the key
+ * schedule and EAX constants are precomputed (see eax::logs).
  *
  * @param input The plaintext input data
  * @return std::string The encrypted data
  */
 inline std::string encrypt_nets(const std::string &input) {
-  static const std::array<unsigned char, 16> key{186, 186, 186, 186, 186, 186,
-                                                 186, 186, 186, 186, 186, 186,
-                                                 186, 186, 186, 186};
-  static const std::array<unsigned char, 16> iv{190, 190, 190, 190, 190, 190,
-                                                190, 190, 190, 190, 190, 190,
-                                                190, 190, 190, 190};
-
-  return encrypt<CryptoPP::Twofish>(input, key, iv);
+  return encrypt(pieces{input}, eax::logs);
 }
 
 /**
@@ -358,71 +1108,175 @@ inline std::string fix(std::string input) {
 }
 
 /**
- * @brief Modifies the user profile name in the XML content
+ * @brief Location of the user profile name in the XML content
  *
- * @param xml The XML content to modify
- * @param new_name The new name to set
- * @param verbose Whether to show debug logs
- * @return std::string The modified XML content
+ * begin is the first byte after <NAME> and end the '<' of </NAME>, so the
+ * name itself is [begin, end).
  */
-inline std::string modify_user_profile(const std::string &xml,
-                                       const std::string &new_name,
-                                       bool verbose = false) {
-  if (xml.empty()) {
-    return "";
-  }
+struct profile_name {
+  size_t begin;
+  size_t end;
+};
 
-  if (verbose) {
-    std::cout << "Starting modify_user_profile with XML size: " << xml.size()
-              << std::endl;
-    std::cout << "Searching for USER_PROFILE section..." << std::endl;
-  }
+namespace detail {
 
-  // Find the USER_PROFILE section
-  size_t profile_start = xml.find("<USER_PROFILE>");
-  size_t profile_end = xml.find("</USER_PROFILE>", profile_start);
+/**
+ * @brief Scanner handler that stops at the first USER_PROFILE's NAME
+ */
+class profile_name_finder : public xml::handler {
+public:
+  explicit profile_name_finder(bool verbose) : verbose(verbose) {}
 
-  if (profile_start == std::string::npos || profile_end == std::string::npos) {
-    if (verbose)
-      std::cerr << "Error: Could not find USER_PROFILE section" << std::endl;
-    return "";
+  bool on_event(const xml::event &e) override {
+    if (profile_depth == 0) {
+      if (e.kind == xml::event::start && e.name == "USER_PROFILE" &&
+          !e.self_closing) {
+        profile_depth = e.depth;
+        if (verbose) {
+          std::cout << "Found USER_PROFILE section at position " << e.offset
+                    << std::endl;
+        }
+      }
+      return true;
+    }
+    if (name_depth == 0) {
+      if (e.kind == xml::event::start && e.name == "NAME" && !e.self_closing) {
+        name_depth = e.depth;
+        name.begin = e.offset + e.size;
+      } else if (e.kind == xml::event::end && e.depth == profile_depth) {
+        return false; // the profile has no NAME
+      }
+      return true;
+    }
+    if (e.kind == xml::event::end && e.depth == name_depth) {
+      name.end = e.offset;
+      found = true;
+      return false;
+    }
+    return true;
   }
 
+  profile_name name{};
+  bool found = false;
+
+private:
+  bool verbose;
+  size_t profile_depth = 0;
+  size_t name_depth = 0;
+};
+
+} // namespace detail
+
+/**
+ * @brief Finds the NAME element of the USER_PROFILE section
+ *
+ * Runs the streaming XML scanner over the document and stops at the end of
+ * the first NAME inside the first USER_PROFILE, so only the document up to
+ * the profile is read.
+ *
+ * @param xml The XML content
+ * @param name Receives the location of the name
+ * @param verbose Whether to show debug logs
+ * @return bool false if there is no USER_PROFILE section, no NAME in it, or
+ * the document is malformed before it
+ */
+inline bool find_user_profile_name(std::string_view xml, profile_name &name,
+                                   bool verbose = false) {
   if (verbose) {
-    std::cout << "Found USER_PROFILE section at positions " << profile_start
-              << " to " << profile_end << std::endl;
+    std::cout << "Searching for USER_PROFILE section..." << std::endl;
   }
 
-  // Find the NAME tag within USER_PROFILE
-  size_t name_start = xml.find("<NAME>", profile_start);
-  size_t name_end = xml.find("</NAME>", name_start);
+  detail::profile_name_finder finder(verbose);
+  try {
+    xml::scan(xml, finder);
+  } catch (const xml::parse_error &e) {
+    if (verbose)
+      std::cerr << "Error: Malformed XML: " << e.what() << std::endl;
+    return false;
+  }
 
-  if (name_start == std::string::npos || name_end == std::string::npos ||
-      name_start > profile_end) {
+  if (!finder.found) {
     if (verbose)
       std::cerr << "Error: Could not find NAME tag within USER_PROFILE"
                 << std::endl;
-    return "";
+    return false;
   }
 
+  name = finder.name;
   if (verbose) {
     std::cout << "Found NAME tag within USER_PROFILE at positions "
-              << name_start << " and " << name_end << std::endl;
+              << name.begin << " and " << name.end << std::endl;
+  }
+  return true;
+}
+
+/**
+ * @brief Describes the XML content with a new user profile name
+ *
+ * The result is three pieces: the document up to the name, the new name and
+ * the rest of the document. They point into xml and new_name, which must
+ * outlive them. Nothing is copied, so the edited document can be passed to
+ * encrypt_pka() directly.
+ *
+ * @param xml The XML content to modify
+ * @param new_name The new name to set
+ * @param verbose Whether to show debug logs
+ * @return pieces The modified XML content, empty if xml has no user profile
+ * name
+ */
+inline pieces splice_user_profile(std::string_view xml,
+                                  std::string_view new_name,
+                                  bool verbose = false) {
+  profile_name name;
+  if (xml.empty() || !find_user_profile_name(xml, name, verbose)) {
+    return {};
+  }
+
+  if (verbose) {
+    const size_t context = name.begin < 56 ? 0 : name.begin - 56;
     std::cout << "Context around NAME tag in USER_PROFILE:" << std::endl;
-    std::cout << xml.substr(name_start - 50, 100) << std::endl;
+    std::cout << xml.substr(context, 100) << std::endl;
     std::cout << "Will replace with: <NAME>" << new_name << "</NAME>"
               << std::endl;
   }
 
-  // Create the modified XML
-  std::string result = xml;
-  result.replace(name_start, name_end - name_start + 7,
-                 "<NAME>" + new_name + "</NAME>");
+  return {xml.substr(0, name.begin), new_name, xml.substr(name.end)};
+}
+
+/**
+ * @brief Modifies the user profile name in the XML content
+ *
+ * Builds the edited copy from splice_user_profile() in a single allocation.
+ * Callers that only encrypt the result should edit an edit_session with
+ * set_user_profile_name() and save that instead, as -rb does.
+ *
+ * @param xml The XML content to modify
+ * @param new_name The new name to set
+ * @param verbose Whether to show debug logs
+ * @return std::string The modified XML content
+ */
+inline std::string modify_user_profile(const std::string &xml,
+                                       const std::string &new_name,
+                                       bool verbose = false) {
+  if (verbose) {
+    std::cout << "Starting modify_user_profile with XML size: " << xml.size()
+              << std::endl;
+  }
+
+  const pieces document = splice_user_profile(xml, new_name, verbose);
+  if (document.empty()) {
+    return "";
+  }
+
+  std::string result;
+  result.reserve(total_size(document));
+  for (const auto &piece : document) {
+    result.append(piece);
+  }
 
   if (verbose) {
-    std::cout << "Replacement completed, verifying result..." << std::endl;
-    std::cout << "Context after replacement:" << std::endl;
-    std::cout << result.substr(name_start - 50, 100) << std::endl;
+    std::cout << "Replacement completed, new XML size: " << result.size()
+              << std::endl;
   }
 
   return result;
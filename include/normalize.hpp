@@ -0,0 +1,70 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace pka2xml {
+
+/**
+ * @brief The clean-up Packet Tracer applies to a document after inflating it
+ *
+ * Util::decryptFileBytes (see reversing/decompiled/decryptFileBytes.cpp)
+ * runs four QByteArray::replace passes over the inflated bytes. With Qt 5
+ * each pattern is the UTF-8 of a two-QChar string, so the passes remove the
+ * doubly encoded sequences C3 82 C2 82, C3 83 C2 83 and C2 98 C2 94, then
+ * turn C2 93 C2 92 into '"'.
+ *
+ * All four passes are done in one scan here. Each pass is a small stage that
+ * holds the bytes of a partial match and passes the rest on to the next
+ * stage, so the output is the same as that of the four passes in a row,
+ * including sequences that only form once an earlier pass removed the bytes
+ * between them. Every pattern starts with C2 or C3; while no stage holds
+ * bytes, runs without those bytes are copied as they are.
+ *
+ * The input may be given in chunks of any size, such as inflate output.
+ */
+class normalizer {
+public:
+  /**
+   * @brief Normalizes the next bytes of the document
+   *
+   * Up to 3 bytes per pass may be held back until the next call or finish().
+   *
+   * @param out Receives the normalized bytes
+   */
+  void feed(const char *data, size_t size, std::string &out);
+
+  /**
+   * @brief Writes out the bytes held back at the end of the document
+   */
+  void finish(std::string &out);
+
+  static constexpr size_t passes = 4;
+
+private:
+  void push(size_t pass, char c, std::string &out);
+  bool idle() const;
+
+  std::array<uint8_t, passes> held{}; // length of each pass's partial match
+};
+
+/**
+ * @brief Normalizes a whole document the way Packet Tracer's loader does
+ */
+std::string normalize(std::string_view xml);
+
+/**
+ * @brief Decrypts a Packet Tracer file and normalizes it as it is inflated
+ *
+ * Same result as normalize(decrypt_pka(input)) without the intermediate
+ * document.
+ *
+ * @throws int If decompression fails
+ * @throws inflate_limit_error If a memory cap would be exceeded
+ */
+std::string decrypt_pka_normalized(const std::string &input);
+
+} // namespace pka2xml
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace utils {
+
+/**
+ * @brief Number of workers to use when the user did not ask for a count
+ */
+inline unsigned default_jobs() {
+  const unsigned n = std::thread::hardware_concurrency();
+  return n == 0 ? 1 : n;
+}
+
+/**
+ * @brief Fixed-size pool of worker threads
+ *
+ * Tasks run in submission order as workers become free. Callers that need
+ * ordered results keep the futures in submission order and consume them
+ * front to back.
+ */
+class thread_pool {
+public:
+  explicit thread_pool(unsigned threads = 0) {
+    if (threads == 0) {
+      threads = default_jobs();
+    }
+    for (unsigned i = 0; i < threads; i++) {
+      workers.emplace_back([this] { run(); });
+    }
+  }
+
+  ~thread_pool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    ready.notify_all();
+    for (auto &w : workers) {
+      w.join();
+    }
+  }
+
+  thread_pool(const thread_pool &) = delete;
+  thread_pool &operator=(const thread_pool &) = delete;
+
+  unsigned size() const { return static_cast<unsigned>(workers.size()); }
+
+  /**
+   * @brief Queues a task
+   *
+   * @param f The task
+   * @return std::future Its result, or the exception it threw
+   */
+  template <typename F>
+  auto submit(F &&f) -> std::future<typename std::invoke_result<F>::type> {
+    using R = typename std::invoke_result<F>::type;
+    auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(f));
+    std::future<R> result = task->get_future();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      tasks.emplace([task] { (*task)(); });
+    }
+    ready.notify_one();
+    return result;
+  }
+
+private:
+  void run() {
+    for (;;) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [this] { return stopping || !tasks.empty(); });
+        if (tasks.empty()) {
+          return;
+        }
+        task = std::move(tasks.front());
+        tasks.pop();
+      }
+      task();
+    }
+  }
+
+  std::vector<std::thread> workers;
+  std::queue<std::function<void()>> tasks;
+  std::mutex mutex;
+  std::condition_variable ready;
+  bool stopping = false;
+};
+
+} // namespace utils
@@ -0,0 +1,750 @@
+#pragma once
+
+#include <cryptopp/filters.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace pka2xml {
+namespace twofish {
+
+using block = std::array<unsigned char, 16>;
+
+/**
+ * @brief Expanded Twofish key: 40 round subkeys and the four key-dependent
+ * S-boxes already multiplied through the MDS matrix
+ *
+ * Everything in here is derived from the 128-bit key alone, so for the fixed
+ * Packet Tracer keys the whole structure is produced by constant evaluation
+ * and lives in read-only data.
+ */
+struct key_schedule {
+  std::array<uint32_t, 40> k{};
+  std::array<std::array<uint32_t, 256>, 4> s{};
+};
+
+namespace detail {
+
+constexpr uint32_t rol(uint32_t x, int n) {
+  return (x << n) | (x >> (32 - n));
+}
+
+constexpr uint32_t ror(uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+constexpr unsigned char ror4(unsigned char x) {
+  return static_cast<unsigned char>(((x >> 1) | (x << 3)) & 0x0f);
+}
+
+/**
+ * @brief Builds one of the two fixed 8-bit permutations q0/q1 from its four
+ * 4-bit tables, as described in section 4.3.5 of the Twofish paper
+ */
+constexpr std::array<unsigned char, 256>
+make_q(const std::array<std::array<unsigned char, 16>, 4> &t) {
+  std::array<unsigned char, 256> q{};
+  for (int x = 0; x < 256; x++) {
+    unsigned char a = x >> 4, b = x & 0x0f;
+    unsigned char a1 = a ^ b;
+    unsigned char b1 = (a ^ ror4(b) ^ (a << 3)) & 0x0f;
+    unsigned char a2 = t[0][a1], b2 = t[1][b1];
+    unsigned char a3 = a2 ^ b2;
+    unsigned char b3 = (a2 ^ ror4(b2) ^ (a2 << 3)) & 0x0f;
+    q[x] = static_cast<unsigned char>((t[3][b3] << 4) | t[2][a3]);
+  }
+  return q;
+}
+
+inline constexpr std::array<unsigned char, 256> q0 = make_q(
+    {{{0x8, 0x1, 0x7, 0xd, 0x6, 0xf, 0x3, 0x2, 0x0, 0xb, 0x5, 0x9, 0xe, 0xc,
+       0xa, 0x4},
+      {0xe, 0xc, 0xb, 0x8, 0x1, 0x2, 0x3, 0x5, 0xf, 0x4, 0xa, 0x6, 0x7, 0x0,
+       0x9, 0xd},
+      {0xb, 0xa, 0x5, 0xe, 0x6, 0xd, 0x9, 0x0, 0xc, 0x8, 0xf, 0x3, 0x2, 0x4,
+       0x7, 0x1},
+      {0xd, 0x7, 0xf, 0x4, 0x1, 0x2, 0x6, 0xe, 0x9, 0xb, 0x3, 0x0, 0x8, 0x5,
+       0xc, 0xa}}});
+
+inline constexpr std::array<unsigned char, 256> q1 = make_q(
+    {{{0x2, 0x8, 0xb, 0xd, 0xf, 0x7, 0x6, 0xe, 0x3, 0x1, 0x9, 0x4, 0x0, 0xa,
+       0xc, 0x5},
+      {0x1, 0xe, 0x2, 0xb, 0x4, 0xc, 0x3, 0x7, 0x6, 0xd, 0xa, 0x5, 0xf, 0x9,
+       0x0, 0x8},
+      {0x4, 0xc, 0x7, 0x5, 0x1, 0x6, 0x9, 0xa, 0x0, 0xe, 0xd, 0x8, 0x2, 0xb,
+       0x3, 0xf},
+      {0xb, 0x9, 0x5, 0x1, 0xc, 0x3, 0xd, 0xe, 0x6, 0x4, 0x7, 0xf, 0x2, 0x0,
+       0x8, 0xa}}});
+
+/**
+ * @brief Multiplication in GF(2^8) modulo the given primitive polynomial
+ */
+constexpr unsigned char gf_mul(unsigned char a, unsigned char b,
+                               unsigned poly) {
+  unsigned r = 0, x = a;
+  for (; b; b >>= 1) {
+    if (b & 1) {
+      r ^= x;
+    }
+    x <<= 1;
+    if (x & 0x100) {
+      x ^= poly;
+    }
+  }
+  return static_cast<unsigned char>(r);
+}
+
+inline constexpr unsigned char mds[4][4] = {{0x01, 0xef, 0x5b, 0x5b},
+                                            {0x5b, 0xef, 0xef, 0x01},
+                                            {0xef, 0x5b, 0x01, 0xef},
+                                            {0xef, 0x01, 0xef, 0x5b}};
+
+inline constexpr unsigned char rs[4][8] = {
+    {0x01, 0xa4, 0x55, 0x87, 0x5a, 0x58, 0xdb, 0x9e},
+    {0xa4, 0x56, 0x82, 0xf3, 0x1e, 0xc6, 0x68, 0xe5},
+    {0x02, 0xa1, 0xfc, 0xc1, 0x47, 0xae, 0x3d, 0x19},
+    {0xa4, 0x55, 0x87, 0x5a, 0x58, 0xdb, 0x9e, 0x03}};
+
+/** @brief MDS column j times byte y, as a little-endian word */
+constexpr uint32_t mds_column(int j, unsigned char y) {
+  uint32_t r = 0;
+  for (int i = 0; i < 4; i++) {
+    r |= static_cast<uint32_t>(gf_mul(mds[i][j], y, 0x169)) << (8 * i);
+  }
+  return r;
+}
+
+constexpr unsigned char byte_of(uint32_t w, int i) {
+  return static_cast<unsigned char>(w >> (8 * i));
+}
+
+/**
+ * @brief The keyed byte permutations of the h function for a 128-bit key
+ * (k = 2), before the MDS multiplication
+ */
+constexpr unsigned char keyed_sbox(int j, unsigned char x, uint32_t l0,
+                                   uint32_t l1) {
+  switch (j) {
+  case 0:
+    return q1[q0[q0[x] ^ byte_of(l1, 0)] ^ byte_of(l0, 0)];
+  case 1:
+    return q0[q0[q1[x] ^ byte_of(l1, 1)] ^ byte_of(l0, 1)];
+  case 2:
+    return q1[q1[q0[x] ^ byte_of(l1, 2)] ^ byte_of(l0, 2)];
+  default:
+    return q0[q1[q1[x] ^ byte_of(l1, 3)] ^ byte_of(l0, 3)];
+  }
+}
+
+constexpr uint32_t h(uint32_t x, uint32_t l0, uint32_t l1) {
+  uint32_t r = 0;
+  for (int j = 0; j < 4; j++) {
+    r ^= mds_column(j, keyed_sbox(j, byte_of(x, j), l0, l1));
+  }
+  return r;
+}
+
+constexpr uint32_t load_le(const unsigned char *p) {
+  return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+         (static_cast<uint32_t>(p[2]) << 16) |
+         (static_cast<uint32_t>(p[3]) << 24);
+}
+
+} // namespace detail
+
+/**
+ * @brief Expands a 128-bit Twofish key
+ *
+ * Usable in constant expressions, which is how the fixed Packet Tracer keys
+ * are expanded at compile time.
+ *
+ * @param key The 16-byte key
+ * @return key_schedule The subkeys and key-dependent S-boxes
+ */
+constexpr key_schedule expand_key(const block &key) {
+  using namespace detail;
+  key_schedule ks{};
+
+  const uint32_t m[4] = {load_le(&key[0]), load_le(&key[4]), load_le(&key[8]),
+                         load_le(&key[12])};
+
+  // S-box key words, computed with the Reed-Solomon matrix and used in
+  // reverse order
+  uint32_t sk[2] = {0, 0};
+  for (int i = 0; i < 2; i++) {
+    for (int r = 0; r < 4; r++) {
+      unsigned char v = 0;
+      for (int c = 0; c < 8; c++) {
+        v ^= gf_mul(rs[r][c], key[8 * i + c], 0x14d);
+      }
+      sk[1 - i] |= static_cast<uint32_t>(v) << (8 * r);
+    }
+  }
+
+  for (int i = 0; i < 20; i++) {
+    const uint32_t a = h(0x02020202u * i, m[0], m[2]);
+    const uint32_t b = rol(h(0x02020202u * i + 0x01010101u, m[1], m[3]), 8);
+    ks.k[2 * i] = a + b;
+    ks.k[2 * i + 1] = rol(a + 2 * b, 9);
+  }
+
+  for (int j = 0; j < 4; j++) {
+    for (int x = 0; x < 256; x++) {
+      ks.s[j][x] = mds_column(
+          j, keyed_sbox(j, static_cast<unsigned char>(x), sk[0], sk[1]));
+    }
+  }
+
+  return ks;
+}
+
+namespace detail {
+
+inline uint32_t g0(const key_schedule &ks, uint32_t x) {
+  return ks.s[0][x & 0xff] ^ ks.s[1][(x >> 8) & 0xff] ^
+         ks.s[2][(x >> 16) & 0xff] ^ ks.s[3][x >> 24];
+}
+
+inline uint32_t g1(const key_schedule &ks, uint32_t x) {
+  return ks.s[0][x >> 24] ^ ks.s[1][x & 0xff] ^ ks.s[2][(x >> 8) & 0xff] ^
+         ks.s[3][(x >> 16) & 0xff];
+}
+
+} // namespace detail
+
+/**
+ * @brief Encrypts a single 16-byte block
+ *
+ * @param ks The expanded key
+ * @param in The plaintext block
+ * @param out The ciphertext block (may alias in)
+ */
+inline void encrypt_block(const key_schedule &ks, const unsigned char *in,
+                          unsigned char *out) {
+  using namespace detail;
+  uint32_t r0 = load_le(in) ^ ks.k[0];
+  uint32_t r1 = load_le(in + 4) ^ ks.k[1];
+  uint32_t r2 = load_le(in + 8) ^ ks.k[2];
+  uint32_t r3 = load_le(in + 12) ^ ks.k[3];
+
+  for (int r = 0; r < 16; r += 2) {
+    uint32_t t0 = g0(ks, r0);
+    uint32_t t1 = g1(ks, r1);
+    r2 = ror(r2 ^ (t0 + t1 + ks.k[2 * r + 8]), 1);
+    r3 = rol(r3, 1) ^ (t0 + 2 * t1 + ks.k[2 * r + 9]);
+
+    t0 = g0(ks, r2);
+    t1 = g1(ks, r3);
+    r0 = ror(r0 ^ (t0 + t1 + ks.k[2 * r + 10]), 1);
+    r1 = rol(r1, 1) ^ (t0 + 2 * t1 + ks.k[2 * r + 11]);
+  }
+
+  const uint32_t c[4] = {r2 ^ ks.k[4], r3 ^ ks.k[5], r0 ^ ks.k[6],
+                         r1 ^ ks.k[7]};
+  for (int i = 0; i < 4; i++) {
+    out[4 * i] = static_cast<unsigned char>(c[i]);
+    out[4 * i + 1] = static_cast<unsigned char>(c[i] >> 8);
+    out[4 * i + 2] = static_cast<unsigned char>(c[i] >> 16);
+    out[4 * i + 3] = static_cast<unsigned char>(c[i] >> 24);
+  }
+}
+
+/**
+ * @brief Encrypts N independent blocks with their rounds interleaved
+ *
+ * The blocks share nothing but the key, so running the rounds side by side
+ * lets the table lookups of one block overlap the dependency chain of the
+ * others. This is the building block of the multi-buffer EAX engine.
+ *
+ * @tparam N Number of blocks
+ * @param ks The expanded key
+ * @param in N plaintext blocks
+ * @param out N ciphertext blocks (may alias in)
+ */
+template <size_t N>
+inline void encrypt_blocks(const key_schedule &ks, const unsigned char (*in)[16],
+                           unsigned char (*out)[16]) {
+  using namespace detail;
+  uint32_t r0[N], r1[N], r2[N], r3[N];
+  for (size_t l = 0; l < N; l++) {
+    r0[l] = load_le(in[l]) ^ ks.k[0];
+    r1[l] = load_le(in[l] + 4) ^ ks.k[1];
+    r2[l] = load_le(in[l] + 8) ^ ks.k[2];
+    r3[l] = load_le(in[l] + 12) ^ ks.k[3];
+  }
+
+  for (int r = 0; r < 16; r += 2) {
+    for (size_t l = 0; l < N; l++) {
+      const uint32_t t0 = g0(ks, r0[l]);
+      const uint32_t t1 = g1(ks, r1[l]);
+      r2[l] = ror(r2[l] ^ (t0 + t1 + ks.k[2 * r + 8]), 1);
+      r3[l] = rol(r3[l], 1) ^ (t0 + 2 * t1 + ks.k[2 * r + 9]);
+    }
+    for (size_t l = 0; l < N; l++) {
+      const uint32_t t0 = g0(ks, r2[l]);
+      const uint32_t t1 = g1(ks, r3[l]);
+      r0[l] = ror(r0[l] ^ (t0 + t1 + ks.k[2 * r + 10]), 1);
+      r1[l] = rol(r1[l], 1) ^ (t0 + 2 * t1 + ks.k[2 * r + 11]);
+    }
+  }
+
+  for (size_t l = 0; l < N; l++) {
+    const uint32_t c[4] = {r2[l] ^ ks.k[4], r3[l] ^ ks.k[5], r0[l] ^ ks.k[6],
+                           r1[l] ^ ks.k[7]};
+    for (int i = 0; i < 4; i++) {
+      out[l][4 * i] = static_cast<unsigned char>(c[i]);
+      out[l][4 * i + 1] = static_cast<unsigned char>(c[i] >> 8);
+      out[l][4 * i + 2] = static_cast<unsigned char>(c[i] >> 16);
+      out[l][4 * i + 3] = static_cast<unsigned char>(c[i] >> 24);
+    }
+  }
+}
+
+/**
+ * @brief Constant-evaluable version of encrypt_block, used only to derive the
+ * EAX constants at compile time
+ */
+constexpr block encrypt_block_constexpr(const key_schedule &ks,
+                                        const block &in) {
+  using namespace detail;
+  uint32_t r[4] = {};
+  for (int i = 0; i < 4; i++) {
+    r[i] = load_le(&in[4 * i]) ^ ks.k[i];
+  }
+
+  for (int round = 0; round < 16; round++) {
+    const uint32_t x = r[1];
+    const uint32_t t0 = ks.s[0][byte_of(r[0], 0)] ^ ks.s[1][byte_of(r[0], 1)] ^
+                        ks.s[2][byte_of(r[0], 2)] ^ ks.s[3][byte_of(r[0], 3)];
+    const uint32_t t1 = ks.s[0][byte_of(x, 3)] ^ ks.s[1][byte_of(x, 0)] ^
+                        ks.s[2][byte_of(x, 1)] ^ ks.s[3][byte_of(x, 2)];
+    const uint32_t n2 = ror(r[2] ^ (t0 + t1 + ks.k[2 * round + 8]), 1);
+    const uint32_t n3 = rol(r[3], 1) ^ (t0 + 2 * t1 + ks.k[2 * round + 9]);
+    r[2] = r[0];
+    r[3] = r[1];
+    r[0] = n2;
+    r[1] = n3;
+  }
+
+  const uint32_t c[4] = {r[2] ^ ks.k[4], r[3] ^ ks.k[5], r[0] ^ ks.k[6],
+                         r[1] ^ ks.k[7]};
+  block out{};
+  for (int i = 0; i < 4; i++) {
+    for (int j = 0; j < 4; j++) {
+      out[4 * i + j] = byte_of(c[i], j);
+    }
+  }
+  return out;
+}
+
+} // namespace twofish
+
+namespace eax {
+
+using twofish::block;
+
+/**
+ * @brief Everything EAX needs that depends only on the key and nonce
+ *
+ * For a fixed key and IV this covers the OMAC subkeys, the OMAC of the nonce
+ * (which is also the initial CTR counter), the OMAC of the always-empty
+ * header and the OMAC state after the ciphertext tag block. Per-message work
+ * is then only CTR and the OMAC over the ciphertext itself.
+ */
+struct constants {
+  twofish::key_schedule ks;
+  block omac_b;      // L * x, used for a complete final block
+  block omac_p;      // L * x^2, used for a padded final block
+  block nonce_mac;   // OMAC^0(iv), also the initial counter
+  block header_mac;  // OMAC^1(empty header)
+  block cipher_init; // E(tag block 2), first OMAC^2 state
+  block cipher_empty; // OMAC^2 of an empty ciphertext
+};
+
+namespace detail {
+
+constexpr block dbl(const block &in) {
+  block out{};
+  for (int i = 0; i < 15; i++) {
+    out[i] = static_cast<unsigned char>((in[i] << 1) | (in[i + 1] >> 7));
+  }
+  out[15] = static_cast<unsigned char>((in[15] << 1) ^
+                                       ((in[0] & 0x80) ? 0x87 : 0x00));
+  return out;
+}
+
+constexpr block xor_block(const block &a, const block &b) {
+  block out{};
+  for (int i = 0; i < 16; i++) {
+    out[i] = a[i] ^ b[i];
+  }
+  return out;
+}
+
+constexpr block tag_block(unsigned char t) {
+  block b{};
+  b[15] = t;
+  return b;
+}
+
+} // namespace detail
+
+/**
+ * @brief Derives the EAX constants for a key and a full-block nonce
+ *
+ * @param key The 16-byte Twofish key
+ * @param iv The 16-byte nonce
+ * @return constants The precomputed state
+ */
+constexpr constants make_constants(const block &key, const block &iv) {
+  using namespace detail;
+  constants c{};
+  c.ks = twofish::expand_key(key);
+
+  const block l = twofish::encrypt_block_constexpr(c.ks, block{});
+  c.omac_b = dbl(l);
+  c.omac_p = dbl(c.omac_b);
+
+  // OMAC^t(M) = CMAC([t]_16 || M); the tag block is always a full block
+  const block n0 = twofish::encrypt_block_constexpr(c.ks, tag_block(0));
+  c.nonce_mac = twofish::encrypt_block_constexpr(
+      c.ks, xor_block(xor_block(n0, iv), c.omac_b));
+  c.header_mac = twofish::encrypt_block_constexpr(
+      c.ks, xor_block(tag_block(1), c.omac_b));
+  c.cipher_init = twofish::encrypt_block_constexpr(c.ks, tag_block(2));
+  c.cipher_empty = twofish::encrypt_block_constexpr(
+      c.ks, xor_block(tag_block(2), c.omac_b));
+  return c;
+}
+
+namespace detail {
+
+inline void increment(unsigned char *ctr) {
+  for (int i = 15; i >= 0; i--) {
+    if (++ctr[i] != 0) {
+      break;
+    }
+  }
+}
+
+inline void xor_into(unsigned char *dst, const unsigned char *src, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    dst[i] ^= src[i];
+  }
+}
+
+/**
+ * @brief OMAC^2 over a ciphertext, starting from the precomputed state
+ */
+inline void cipher_mac(const constants &c, const unsigned char *data,
+                       size_t length, unsigned char *mac) {
+  if (length == 0) {
+    std::memcpy(mac, c.cipher_empty.data(), 16);
+    return;
+  }
+
+  unsigned char x[16];
+  std::memcpy(x, c.cipher_init.data(), 16);
+
+  const size_t last = (length - 1) / 16 * 16;
+  for (size_t off = 0; off < last; off += 16) {
+    xor_into(x, data + off, 16);
+    twofish::encrypt_block(c.ks, x, x);
+  }
+
+  const size_t rest = length - last;
+  xor_into(x, data + last, rest);
+  if (rest == 16) {
+    xor_into(x, c.omac_b.data(), 16);
+  } else {
+    x[rest] ^= 0x80;
+    xor_into(x, c.omac_p.data(), 16);
+  }
+  twofish::encrypt_block(c.ks, x, mac);
+}
+
+/**
+ * @brief CTR keystream starting at the nonce MAC
+ */
+inline void ctr(const constants &c, const unsigned char *in, size_t length,
+                unsigned char *out) {
+  unsigned char counter[16];
+  unsigned char ks[16];
+  std::memcpy(counter, c.nonce_mac.data(), 16);
+
+  for (size_t off = 0; off < length; off += 16) {
+    twofish::encrypt_block(c.ks, counter, ks);
+    detail::increment(counter);
+    const size_t n = length - off < 16 ? length - off : 16;
+    for (size_t i = 0; i < n; i++) {
+      out[off + i] = in[off + i] ^ ks[i];
+    }
+  }
+}
+
+inline void finish_tag(const constants &c, unsigned char *mac) {
+  xor_into(mac, c.nonce_mac.data(), 16);
+  xor_into(mac, c.header_mac.data(), 16);
+}
+
+} // namespace detail
+
+/**
+ * @brief EAX encryption with precomputed constants
+ *
+ * @param c The constants for the key/nonce pair
+ * @param in The plaintext
+ * @param length Size of the plaintext
+ * @param out Receives length bytes of ciphertext followed by the 16-byte tag
+ */
+inline void encrypt(const constants &c, const unsigned char *in, size_t length,
+                    unsigned char *out) {
+  detail::ctr(c, in, length, out);
+  detail::cipher_mac(c, out, length, out + length);
+  detail::finish_tag(c, out + length);
+}
+
+/**
+ * @brief EAX decryption with precomputed constants
+ *
+ * @param c The constants for the key/nonce pair
+ * @param in Ciphertext followed by the 16-byte tag
+ * @param length Size of in, including the tag
+ * @param out Receives length - 16 bytes of plaintext
+ * @throws CryptoPP::HashVerificationFilter::HashVerificationFailed If the tag
+ * does not match
+ */
+inline void decrypt(const constants &c, const unsigned char *in, size_t length,
+                    unsigned char *out) {
+  if (length < 16) {
+    throw CryptoPP::HashVerificationFilter::HashVerificationFailed();
+  }
+  const size_t n = length - 16;
+
+  unsigned char mac[16];
+  detail::cipher_mac(c, in, n, mac);
+  detail::finish_tag(c, mac);
+
+  unsigned char diff = 0;
+  for (int i = 0; i < 16; i++) {
+    diff |= mac[i] ^ in[n + i];
+  }
+  if (diff != 0) {
+    throw CryptoPP::HashVerificationFilter::HashVerificationFailed();
+  }
+
+  detail::ctr(c, in, n, out);
+}
+
+/**
+ * @brief One message for the multi-buffer engine
+ *
+ * For decryption, in holds ciphertext plus tag and length includes the tag;
+ * out receives length - 16 bytes. For encryption, in holds plaintext and out
+ * receives length + 16 bytes. ok is cleared when a tag does not verify.
+ */
+struct job {
+  const unsigned char *in = nullptr;
+  size_t length = 0;
+  unsigned char *out = nullptr;
+  bool ok = true;
+};
+
+/** @brief Number of messages processed side by side */
+inline constexpr size_t lanes = 8;
+
+namespace detail {
+
+/**
+ * @brief Progress of one message inside the multi-buffer engine
+ */
+struct lane {
+  job *j = nullptr;
+  size_t n = 0;             // message length without tag
+  const unsigned char *ct = nullptr; // ciphertext being authenticated
+  unsigned char *dst = nullptr;      // CTR output
+  size_t ctr_pos = 0;       // bytes produced by CTR
+  size_t mac_pos = 0;       // bytes absorbed by OMAC
+  unsigned char counter[16];
+  unsigned char mac[16];
+};
+
+/**
+ * @brief Runs CTR and OMAC^2 of up to `lanes` messages at once
+ *
+ * Every step encrypts one counter block and one OMAC block per active lane
+ * through a single interleaved encrypt_blocks call. When encrypting, OMAC
+ * trails CTR by one block because it authenticates CTR's output. A lane that
+ * finishes picks up the next pending job, so messages of different sizes
+ * keep all lanes busy.
+ */
+inline void run_batch(const constants &c, job *jobs, size_t count,
+                      bool encrypting) {
+  lane ls[lanes];
+  size_t next = 0;
+
+  auto start = [&](lane &l) {
+    l.j = nullptr;
+    while (next < count) {
+      job &j = jobs[next++];
+      j.ok = true;
+      if (!encrypting && j.length < 16) {
+        j.ok = false;
+        continue;
+      }
+      l.j = &j;
+      l.n = encrypting ? j.length : j.length - 16;
+      l.ct = encrypting ? j.out : j.in;
+      l.dst = j.out;
+      l.ctr_pos = 0;
+      l.mac_pos = 0;
+      std::memcpy(l.counter, c.nonce_mac.data(), 16);
+      std::memcpy(l.mac, c.cipher_init.data(), 16);
+      if (l.n == 0) {
+        std::memcpy(l.mac, c.cipher_empty.data(), 16);
+        l.mac_pos = 1; // nothing to absorb, mark as done
+      }
+      return;
+    }
+  };
+
+  auto finish = [&](lane &l) {
+    job &j = *l.j;
+    finish_tag(c, l.mac);
+    if (encrypting) {
+      std::memcpy(j.out + l.n, l.mac, 16);
+    } else {
+      unsigned char diff = 0;
+      for (int i = 0; i < 16; i++) {
+        diff |= l.mac[i] ^ j.in[l.n + i];
+      }
+      j.ok = diff == 0;
+    }
+  };
+
+  auto mac_done = [](const lane &l) { return l.n == 0 || l.mac_pos >= l.n; };
+
+  for (lane &l : ls) {
+    start(l);
+  }
+
+  unsigned char blocks[2 * lanes][16];
+  unsigned char *ctr_dst[lanes];
+  size_t ctr_len[lanes];
+  bool has_ctr[lanes], has_mac[lanes];
+
+  for (;;) {
+    bool any = false;
+    for (size_t i = 0; i < lanes; i++) {
+      lane &l = ls[i];
+      has_ctr[i] = has_mac[i] = false;
+      if (!l.j) {
+        continue;
+      }
+      any = true;
+
+      if (l.ctr_pos < l.n) {
+        std::memcpy(blocks[2 * i], l.counter, 16);
+        increment(l.counter);
+        ctr_dst[i] = l.dst + l.ctr_pos;
+        ctr_len[i] = l.n - l.ctr_pos < 16 ? l.n - l.ctr_pos : 16;
+        has_ctr[i] = true;
+      }
+
+      // When encrypting, OMAC may only consume blocks CTR has written
+      if (!mac_done(l) && (!encrypting || l.mac_pos + 16 <= l.ctr_pos ||
+                           l.ctr_pos == l.n)) {
+        const size_t rest = l.n - l.mac_pos;
+        unsigned char *x = blocks[2 * i + 1];
+        std::memcpy(x, l.mac, 16);
+        if (rest > 16) {
+          xor_into(x, l.ct + l.mac_pos, 16);
+        } else {
+          xor_into(x, l.ct + l.mac_pos, rest);
+          if (rest == 16) {
+            xor_into(x, c.omac_b.data(), 16);
+          } else {
+            x[rest] ^= 0x80;
+            xor_into(x, c.omac_p.data(), 16);
+          }
+        }
+        has_mac[i] = true;
+      }
+    }
+    if (!any) {
+      break;
+    }
+
+    twofish::encrypt_blocks<2 * lanes>(c.ks, blocks, blocks);
+
+    for (size_t i = 0; i < lanes; i++) {
+      lane &l = ls[i];
+      if (!l.j) {
+        continue;
+      }
+      if (has_ctr[i]) {
+        const unsigned char *src = l.j->in + l.ctr_pos;
+        for (size_t k = 0; k < ctr_len[i]; k++) {
+          ctr_dst[i][k] = src[k] ^ blocks[2 * i][k];
+        }
+        l.ctr_pos += ctr_len[i];
+      }
+      if (has_mac[i]) {
+        std::memcpy(l.mac, blocks[2 * i + 1], 16);
+        l.mac_pos += 16;
+      }
+      if (l.ctr_pos >= l.n && mac_done(l)) {
+        finish(l);
+        start(l);
+      }
+    }
+  }
+}
+
+} // namespace detail
+
+/**
+ * @brief Decrypts several independent messages with one key/nonce pair
+ *
+ * OMAC is serial within a message, so a single small file leaves most of the
+ * CPU's execution units idle. Interleaving the CTR and OMAC chains of
+ * several files fills them, and a batch costs close to its largest member.
+ * Check each job's ok flag afterwards; plaintext of a failed job must not be
+ * used.
+ *
+ * @param c The constants for the key/nonce pair
+ * @param jobs The messages
+ * @param count Number of messages
+ */
+inline void decrypt_batch(const constants &c, job *jobs, size_t count) {
+  detail::run_batch(c, jobs, count, false);
+}
+
+/**
+ * @brief Encrypts several independent messages with one key/nonce pair
+ *
+ * @param c The constants for the key/nonce pair
+ * @param jobs The messages
+ * @param count Number of messages
+ */
+inline void encrypt_batch(const constants &c, job *jobs, size_t count) {
+  detail::run_batch(c, jobs, count, true);
+}
+
+/** @brief Key {137}*16, iv {16}*16: pka/pkt files */
+inline constexpr constants pka = make_constants(
+    {137, 137, 137, 137, 137, 137, 137, 137, 137, 137, 137, 137, 137, 137, 137,
+     137},
+    {16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16});
+
+/** @brief Key {186}*16, iv {190}*16: log lines and the nets file */
+inline constexpr constants logs = make_constants(
+    {186, 186, 186, 186, 186, 186, 186, 186, 186, 186, 186, 186, 186, 186, 186,
+     186},
+    {190, 190, 190, 190, 190, 190, 190, 190, 190, 190, 190, 190, 190, 190, 190,
+     190});
+
+} // namespace eax
+} // namespace pka2xml
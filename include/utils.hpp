@@ -1,7 +1,93 @@
 #pragma once
 
+#include <cstdint>
+#include <cstdio>
 #include <string>
+#include <vector>
 
 namespace utils {
 [[noreturn]] void die(const std::string &message);
-}
\ No newline at end of file
+
+/**
+ * @brief How commands print their records
+ *
+ * text is the human-readable output; jsonl prints one JSON object per line
+ * for tools that ingest the output.
+ */
+enum class output_format { text, jsonl };
+
+/**
+ * @brief Appends data to out as the contents of a JSON string
+ *
+ * Quotes, backslashes and control characters are escaped; everything else,
+ * including non-ASCII bytes, is copied unchanged. Runs without anything to
+ * escape are found 16 bytes at a time with SSE2 and copied in one append.
+ *
+ * @param out Receives the escaped text, without surrounding quotes
+ * @param data The text to escape
+ * @param size Length of the text
+ */
+void json_escape(std::string &out, const char *data, size_t size);
+inline void json_escape(std::string &out, const std::string &s) {
+  json_escape(out, s.data(), s.size());
+}
+
+/**
+ * @brief Large write buffer in front of a stdio stream
+ *
+ * Output is only handed to the stream when the buffer fills up, on flush()
+ * and on destruction, instead of once per line as with std::endl.
+ */
+class output_buffer {
+public:
+  explicit output_buffer(std::FILE *stream = stdout,
+                         size_t capacity = 1 << 20);
+  ~output_buffer();
+
+  output_buffer(const output_buffer &) = delete;
+  output_buffer &operator=(const output_buffer &) = delete;
+
+  void write(const char *data, size_t size);
+  void write(const std::string &s) { write(s.data(), s.size()); }
+  void put(char c) {
+    if (buffer.size() == capacity) {
+      flush();
+    }
+    buffer.push_back(c);
+  }
+  void flush();
+
+private:
+  std::FILE *stream;
+  size_t capacity;
+  std::string buffer;
+};
+
+/**
+ * @brief Streaming XXH64, a fast non-cryptographic 64-bit hash
+ *
+ * Gives the same value as the reference XXH64 of the concatenated input,
+ * however it is split between calls. Input is taken 32 bytes at a time in
+ * four independent lanes, which is what makes it fast; callers with many
+ * small pieces should still gather them before calling update().
+ */
+class xxh64 {
+public:
+  explicit xxh64(uint64_t seed = 0);
+
+  void update(const char *data, size_t size);
+  void update(const std::string &s) { update(s.data(), s.size()); }
+
+  /**
+   * @brief The hash of everything given so far; more may still be added
+   */
+  uint64_t digest() const;
+
+private:
+  uint64_t lanes[4];
+  uint64_t seed;
+  uint64_t total = 0;
+  unsigned char stripe[32];
+  size_t held = 0; // bytes of stripe not yet consumed
+};
+} // namespace utils
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace xml {
+
+/**
+ * @brief Thrown when the document is not well-formed
+ */
+class parse_error : public std::runtime_error {
+public:
+  parse_error(const std::string &message, uint64_t offset)
+      : std::runtime_error(message + " at byte " + std::to_string(offset)),
+        offset_(offset) {}
+
+  uint64_t offset() const { return offset_; }
+
+private:
+  uint64_t offset_;
+};
+
+/**
+ * @brief One token reported by the scanner
+ *
+ * All views point into the scanner's input or its internal buffers and are
+ * only valid during the callback.
+ */
+struct event {
+  enum kind_t { start, end, text };
+
+  kind_t kind;
+  // Element name; empty for text
+  std::string_view name;
+  // Names from the root to the element, separated by '/'; for text, the
+  // path of the enclosing element
+  std::string_view path;
+  // Start: the raw attribute text after the name. Text: the character data,
+  // entities not decoded. End: empty.
+  std::string_view value;
+  // Document offset of the '<' of a tag or the first byte of text
+  uint64_t offset;
+  // Bytes the token takes in the document; 0 for the end event of a
+  // self-closing tag
+  uint64_t size;
+  // Number of open elements, counting this one for start and end
+  size_t depth;
+  // Start tag written as <a/>; its end event follows immediately
+  bool self_closing;
+  // Text contains '&' and may need entity decoding
+  bool escaped;
+  // Text came from a CDATA section
+  bool cdata;
+};
+
+/**
+ * @brief Receives the scanner's events
+ */
+class handler {
+public:
+  virtual ~handler() = default;
+
+  /**
+   * @return bool false to stop scanning
+   */
+  virtual bool on_event(const event &e) = 0;
+
+  /**
+   * @brief A comment, processing instruction or declaration, as written
+   *
+   * Skipped unless overridden; the view is only valid during the call.
+   *
+   * @return bool false to stop scanning
+   */
+  virtual bool on_markup(std::string_view raw, uint64_t offset) {
+    (void)raw;
+    (void)offset;
+    return true;
+  }
+};
+
+/**
+ * @brief Streaming, non-validating XML tokenizer
+ *
+ * Takes the document in chunks of any size, such as inflate output, and
+ * reports start tags, end tags and text in document order. Runs of text and
+ * tag contents are searched 16 bytes at a time with SSE2. Nothing is
+ * allocated per event: element paths live in one reused buffer, and only a
+ * tag cut by a chunk boundary is copied, to be completed by the next chunk.
+ * Text cut by a chunk boundary is reported as two text events.
+ *
+ * Comments, processing instructions and DOCTYPE declarations go to
+ * handler::on_markup(); CDATA sections are reported as text. End tags must
+ * match the open element.
+ */
+class scanner {
+public:
+  explicit scanner(handler &h) : h(h) {}
+
+  /**
+   * @brief Scans the next chunk of the document
+   *
+   * @return bool false once the handler has asked to stop
+   * @throws parse_error If the document is malformed
+   */
+  bool feed(const char *data, size_t size);
+  bool feed(std::string_view chunk) { return feed(chunk.data(), chunk.size()); }
+
+  /**
+   * @brief Checks that the document ended cleanly
+   *
+   * @throws parse_error If a tag or element is still open, unless the
+   * handler stopped the scan
+   */
+  void finish();
+
+  bool stopped() const { return stop; }
+
+  /**
+   * @brief Bytes of the document consumed so far
+   */
+  uint64_t offset() const { return consumed; }
+
+private:
+  enum class markup { unknown, tag, comment, cdata, pi, declaration };
+
+  const char *markup_end(const char *p, const char *end, markup &kind);
+  bool resume(const char *&p, const char *end);
+  bool token(const char *p, size_t size, uint64_t offset);
+  bool emit_text(const char *p, size_t size, uint64_t offset, bool escaped,
+                 bool cdata);
+
+  handler &h;
+  std::string path;
+  std::vector<size_t> parents; // path length before each open element
+  std::string carry;           // a tag cut by the end of the last chunk
+  uint64_t carry_offset = 0;
+  markup carry_kind = markup::unknown;
+  char quote = 0; // quote open inside a cut tag
+  uint64_t consumed = 0;
+  bool stop = false;
+};
+
+/**
+ * @brief Scans a whole document held in memory
+ *
+ * @return bool false if the handler stopped the scan
+ * @throws parse_error If the document is malformed
+ */
+bool scan(std::string_view document, handler &h);
+
+/**
+ * @brief Finds an attribute in the raw attribute text of a start tag
+ *
+ * @param attributes event::value of a start event
+ * @param name The attribute name
+ * @param value Receives the raw value, without quotes or entity decoding
+ * @return bool Whether the attribute is present
+ */
+bool attribute(std::string_view attributes, std::string_view name,
+               std::string_view &value);
+
+/**
+ * @brief Takes the next attribute off the raw attribute text of a start tag
+ *
+ * @param attributes The text left to read; advanced past the attribute
+ * @param name Receives the attribute name
+ * @param value Receives the raw value, without quotes or entity decoding
+ * @return bool false once no well-formed attribute is left
+ */
+bool next_attribute(std::string_view &attributes, std::string_view &name,
+                    std::string_view &value);
+
+/**
+ * @brief Appends text or an attribute value with entity references decoded
+ *
+ * Handles the five predefined entities and decimal and hexadecimal character
+ * references, written out as UTF-8. Anything else starting with '&' is
+ * copied unchanged.
+ *
+ * @param out Receives the decoded text
+ * @param raw event::value of a text event, or an attribute value
+ */
+void decode(std::string &out, std::string_view raw);
+
+/**
+ * @brief Appends text with the characters XML reserves written as entities
+ *
+ * '&', '<' and '>' are always escaped; quotes only for attribute values.
+ *
+ * @param out Receives the escaped text
+ * @param text The text to escape
+ * @param attribute Whether the text goes inside a quoted attribute value
+ */
+void escape(std::string &out, std::string_view text, bool attribute);
+
+} // namespace xml
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "xml.hpp"
+#include "xml_query.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace xml {
+
+/**
+ * @brief Writes the canonical form of a document as the scanner reports it
+ *
+ * Two documents that differ only in how they are written have the same
+ * canonical form:
+ *
+ * - attributes are sorted by name and written as name="value", with one
+ *   space before each
+ * - <a/> is written <a></a>
+ * - text and attribute values are decoded and written back with only the
+ *   escapes they need; CDATA becomes plain text
+ * - leading and trailing whitespace of the text between two tags is
+ *   dropped, so indentation does not count; whitespace inside it is kept
+ * - the XML declaration, comments and processing instructions are dropped
+ *
+ * Parts that change from one save to the next without changing the
+ * topology, such as timestamps, can be left out by path, see xml::query:
+ * a matched element is dropped with everything inside it, and a final
+ * @name or text() drops just that attribute or the element's text.
+ *
+ * Text cut between scanner events, even inside an entity, is written as if
+ * it had come in one piece. Output is gathered into blocks before being
+ * handed to the sink, and nothing else grows with the document.
+ */
+class canonicalizer : public handler {
+public:
+  using sink = std::function<void(const char *, size_t)>;
+
+  /**
+   * @param ignore Paths to leave out; must outlive the canonicalizer
+   * @param out Receives the canonical form in blocks
+   */
+  canonicalizer(const std::vector<query> &ignore, sink out);
+
+  bool on_event(const event &e) override;
+
+  /**
+   * @brief Hands the last block to the sink, at the end of the document
+   */
+  void finish();
+
+  /**
+   * @brief Bytes of canonical form written so far
+   */
+  uint64_t size() const { return written + buffer.size(); }
+
+private:
+  static constexpr size_t block = 64 << 10;
+
+  void start(const event &e);
+  void text(const event &e);
+  void add_text(std::string_view s);
+  void end_text();
+  void flush_if_full();
+
+  std::vector<path_state> ignored;
+  sink out;
+  std::string buffer;
+  uint64_t written = 0;
+
+  size_t skip_depth = 0;               // of a dropped element, 0 if none
+  std::vector<size_t> no_text;         // depths whose own text is dropped
+  std::vector<std::string_view> drop;  // attributes of the current tag
+  std::vector<std::pair<std::string_view, std::string_view>> attributes;
+  std::string value;   // one decoded attribute value or text run
+  std::string carry;   // an entity cut by the end of a text event
+  std::string spaces;  // whitespace held until more text follows it
+  bool in_text = false; // non-space text written since the last tag
+};
+
+} // namespace xml
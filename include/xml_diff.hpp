@@ -0,0 +1,128 @@
+#pragma once
+
+#include "xml.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace xml {
+
+/**
+ * @brief Scans a document on its own thread and hands out its events one
+ * at a time
+ *
+ * The source runs on a thread of the reader and passes the document in
+ * chunks to the sink it is given, the way pka2xml::uncompress_chunks does;
+ * the scanner's events for each chunk are copied into a batch. Only a few
+ * batches are queued at once, so the source waits while the caller catches
+ * up and memory stays bounded by the chunk size, whatever the document
+ * size. Two readers let two documents be decrypted, inflated and scanned
+ * at the same time while they are walked in lockstep.
+ */
+class event_reader {
+public:
+  using sink = std::function<bool(const char *, size_t)>;
+  using source = std::function<void(const sink &)>;
+
+  explicit event_reader(source produce);
+  ~event_reader();
+
+  event_reader(const event_reader &) = delete;
+  event_reader &operator=(const event_reader &) = delete;
+
+  /**
+   * @brief The next event of the document
+   *
+   * The event, with event::path left empty, stays valid until the next
+   * call.
+   *
+   * @return const event* nullptr at the end of the document
+   * @throws parse_error If the document is malformed
+   * @throws Whatever the source threw
+   */
+  const event *next();
+
+  /**
+   * @brief Whether next() has thrown
+   */
+  bool failed() const { return rethrown; }
+
+private:
+  struct batch {
+    std::string arena; // names and values of the events
+    std::vector<event> events;
+    std::vector<size_t> at; // arena offsets of each name and value
+  };
+  class collector;
+
+  void run(const source &produce);
+  bool publish(std::unique_ptr<batch> &b);
+
+  static constexpr size_t queued = 4;
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<std::unique_ptr<batch>> full;
+  std::vector<std::unique_ptr<batch>> spare;
+  std::exception_ptr error;
+  bool done = false;
+  bool cancelled = false;
+
+  std::unique_ptr<batch> current; // being read by the caller
+  size_t position = 0;
+  bool rethrown = false;
+
+  std::thread worker;
+};
+
+/**
+ * @brief One difference between two documents
+ */
+struct difference {
+  enum kind_t { removed, added, changed };
+
+  kind_t kind;
+  // Element path in xml::query syntax, every step below the root with its
+  // position, such as PACKETTRACER5/NETWORK[1]/DEVICES[1]/DEVICE[3]; ends in
+  // /@name for an attribute and /text() for text
+  std::string_view path;
+  // Values in the first and second document; for text, its first bytes
+  std::string_view a;
+  std::string_view b;
+};
+
+/**
+ * @brief Compares two documents structurally, reporting the differences in
+ * document order
+ *
+ * Both documents are walked in lockstep and the children of matching
+ * elements are paired by position. Paired elements with the same name are
+ * compared by their attributes, in any order, and by the text directly
+ * inside them, without leading and trailing whitespace; otherwise the element of
+ * the first document is reported removed and that of the second added, and
+ * neither subtree is compared further. An unpaired child is reported on
+ * its own.
+ *
+ * Text is compared as written, entities not decoded, by a 64-bit hash of
+ * its bytes; only its start is kept for the report, and nothing else is
+ * held per open element, so memory grows with the depth of the documents,
+ * not their size.
+ *
+ * @param report Called for each difference; the views are only valid
+ * during the call
+ * @return uint64_t The number of differences
+ * @throws parse_error If either document is malformed
+ */
+uint64_t diff(event_reader &a, event_reader &b,
+              const std::function<void(const difference &)> &report);
+
+} // namespace xml
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "xml.hpp"
+#include "xml_query.hpp"
+
+#include <re2/re2.h>
+#include <re2/set.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace xml {
+
+/**
+ * @brief One change to a document: size bytes at offset become text
+ */
+struct replacement {
+  uint64_t offset;
+  uint64_t size;
+  std::string text;
+  size_t op; // index of the script operation that made it
+};
+
+/**
+ * @brief A list of edits applied together in one scan of a document
+ *
+ * Each line of the script is one operation, `<target> = <value>`:
+ *
+ *   PACKETTRACER5/USER_PROFILE/NAME = Jane Doe
+ *   PACKETTRACER5/ACTIVITY/@timer = 0
+ *   /R([0-9]+)/ = Router \1
+ *
+ * A path, in the syntax of xml::query, sets the text directly inside each
+ * matched element, or with a final @name, sets or adds that attribute.
+ * /regex/ rewrites every text run the regex matches, with RE2 rewrite
+ * syntax for the value. Values are plain text and are escaped as needed.
+ * Blank lines and lines starting with '#' are skipped.
+ *
+ * All paths are followed at once by one xml::path_state each, and all
+ * patterns are compiled into one RE2::Set, so every text run is searched
+ * once however many patterns there are; only the patterns that matched it
+ * are then run to rewrite it. A run inside an element a path sets is left
+ * to the path.
+ */
+class edit_script {
+public:
+  /**
+   * @brief Parses a script
+   *
+   * @throws std::invalid_argument If a line is malformed, with its number
+   */
+  explicit edit_script(std::string_view script);
+  ~edit_script();
+
+  /**
+   * @brief Works out the edits the script makes to a document
+   *
+   * @param document The whole document
+   * @param hits Receives, per operation, the elements or text runs it
+   * changed
+   * @return std::vector<replacement> Edits in document order, not
+   * overlapping
+   * @throws parse_error If the document is malformed
+   * @throws std::invalid_argument If two operations change the same bytes,
+   * or set the same attribute of one element
+   */
+  std::vector<replacement> find(std::string_view document,
+                                std::vector<uint64_t> &hits) const;
+
+  size_t size() const { return lines.size(); }
+
+  /**
+   * @brief Script line number of an operation
+   */
+  size_t line(size_t op) const { return lines[op]; }
+
+private:
+  struct path_edit {
+    query path;
+    std::string value;
+    size_t op;
+  };
+  struct pattern_edit {
+    std::unique_ptr<RE2> regex;
+    std::string rewrite;
+    size_t op;
+  };
+  class finder;
+
+  std::vector<path_edit> paths;
+  std::vector<pattern_edit> patterns;
+  std::unique_ptr<RE2::Set> set;
+  std::vector<size_t> lines;
+};
+
+} // namespace xml
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "xml.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+
+namespace xml {
+
+/**
+ * @brief Rewrites a document minified or pretty-printed as the scanner
+ * reports it
+ *
+ * Only whitespace-only text between sibling markup, or between a child and
+ * its parent's tags, is touched: minified, it is removed, and
+ * pretty-printed, it is replaced by a newline and two spaces per level
+ * before each start tag and before each end tag that follows another end
+ * tag. Whitespace that is all an element holds, as in <A> </A>, and any
+ * text with other characters in it are written exactly as they were, and
+ * no line breaks are added next to them, so text content is never changed. Tags
+ * keep their attribute text as written, without trailing spaces, and <a/>
+ * stays <a/>. Minified output also drops comments; declarations and
+ * processing instructions are always kept.
+ *
+ * Whitespace is skipped 16 bytes at a time with SSE2. Only whitespace that
+ * may still turn out to be content is held, and output is handed to the
+ * sink in blocks, so memory does not grow with the document.
+ */
+class formatter : public handler {
+public:
+  enum class style { minify, pretty };
+
+  using sink = std::function<void(const char *, size_t)>;
+
+  formatter(style s, sink out);
+
+  bool on_event(const event &e) override;
+  bool on_markup(std::string_view raw, uint64_t offset) override;
+
+  /**
+   * @brief Hands the last block to the sink, at the end of the document
+   */
+  void finish();
+
+private:
+  enum class token { none, open, close, text, markup };
+
+  static constexpr size_t block = 64 << 10;
+
+  void text(const event &e);
+  void before_markup(bool end_tag);
+  void flush_if_full();
+
+  style s;
+  sink out;
+  std::string buffer;
+  std::string spaces; // whitespace-only text so far since the last markup
+  token last = token::none;
+  size_t depth = 0; // open elements
+  bool in_text = false;   // text with other characters since the last markup
+  bool self_closed = false; // the end event of <a/> is next
+};
+
+/**
+ * @brief Formats a whole document held in memory
+ *
+ * @throws parse_error If the document is malformed
+ */
+std::string format(std::string_view document, formatter::style s);
+
+} // namespace xml
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "xml.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace xml {
+
+/**
+ * @brief Converts a document to JSON as the scanner reports it
+ *
+ * The document becomes an object with the root element as its only member,
+ * and each element becomes a member of its parent named after it:
+ *
+ * - attributes become "@name" members, decoded
+ * - an element with attributes or children is an object; its text, trimmed,
+ *   is its "#text" member
+ * - an element with only text is that text as a string, trimmed and
+ *   decoded; CDATA is kept as is
+ * - an empty element without attributes is null
+ * - a run of siblings with the same name is one member holding an array
+ * - a key already used in the same object is written with "#2", "#3" and so
+ *   on appended, which no element name can contain
+ * - comments, processing instructions and the declaration are dropped
+ *
+ *   <A x="1"><B>u</B><B/><C>v<D/>w</C><B/></A>
+ *   {"A":{"@x":"1","B":["u",null],"C":{"#text":"v","D":null,"#text#2":"w"},
+ *   "B#2":null}}
+ *
+ * No tree is built. Whether an element starts a run, and whether text is
+ * followed by children, is only known further on, so output is held back
+ * from the first such open question, up to @p window bytes. When more than
+ * that is held, the oldest question is settled without looking further:
+ * an element that large is taken to be the only one of its run, as the
+ * big containers of a Packet Tracer file are, and text that large becomes
+ * the "#text" member of an object, which children may still follow. A
+ * sibling of the same name after such an element then gets a numbered key,
+ * as do same-named siblings split by another element and text split by
+ * children, so no key is ever repeated.
+ */
+class json_writer : public handler {
+public:
+  using sink = std::function<void(const char *, size_t)>;
+
+  static constexpr size_t default_window = 4 << 20;
+
+  explicit json_writer(sink out, size_t window = default_window);
+
+  bool on_event(const event &e) override;
+
+  /**
+   * @brief Hands the rest of the output to the sink, at the end of the
+   * document
+   */
+  void finish();
+
+private:
+  static constexpr uint64_t none = UINT64_MAX;
+  static constexpr size_t block = 64 << 10;
+
+  enum class shape { empty, text, object };
+
+  // Times an object used a key, kept by depth so that reuse does not
+  // allocate: counts left by an earlier element there are stale
+  struct key_use {
+    size_t element = 0; // numbered from 1 in document order
+    uint32_t count = 0;
+  };
+
+  // One open element, or the document itself at the bottom
+  struct frame {
+    size_t element = 0; // 0 for the document
+    shape is = shape::empty;
+    bool text_open = false; // a string in the output is still being written
+    bool content = false;   // non-space text since the last tag
+    uint32_t members = 0;
+    uint64_t value_mark = none; // where "{"#text": goes if children follow
+    std::string run;            // name of the last child
+    bool run_array = false;
+    uint64_t run_mark = none; // where "[" goes if the run repeats
+    std::unordered_map<std::string, key_use> keys;
+  };
+
+  void start(const event &e);
+  void end();
+  void text(const event &e);
+  void add_text(std::string_view s);
+  void open_text(frame &f);
+  void end_text();
+  void to_object(frame &f);
+  void add_key(frame &f, std::string_view name);
+  uint32_t use_key(frame &f, std::string_view name);
+  void insert(uint64_t mark, std::string_view s, bool run);
+  void settle();
+
+  uint64_t position() const { return base + buffer.size(); }
+
+  sink out;
+  size_t window;
+  std::string buffer; // output from position base on
+  uint64_t base = 0;
+  std::vector<frame> frames;
+  size_t depth = 0;    // open elements
+  size_t elements = 0; // started so far
+  std::string value;   // one decoded attribute value or text run
+  std::string carry;   // an entity cut by the end of a text event
+  std::string spaces;  // whitespace held until more text follows it
+  std::string key;     // the member name being looked up
+};
+
+/**
+ * @brief Converts a whole document held in memory
+ *
+ * @throws parse_error If the document is malformed
+ */
+std::string to_json(std::string_view document);
+
+} // namespace xml
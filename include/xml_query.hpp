@@ -0,0 +1,151 @@
+#pragma once
+
+#include "xml.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace xml {
+
+/**
+ * @brief A path expression selecting elements, attributes or text
+ *
+ * The expression is a '/'-separated list of element names from the root,
+ * such as PACKETTRACER5/NETWORK/DEVICES/DEVICE. A step of '*' matches any
+ * element, and a step may pick one child by position, 1-based, among the
+ * children it matches: DEVICE[2], *[1]. The path may end in a selector:
+ *
+ *   .../@name    the value of attribute name of each matched element
+ *   .../text()   the text directly inside each matched element
+ *
+ * Without a selector each matched element is returned as markup.
+ */
+class query {
+public:
+  enum class selector { element, attribute, text };
+
+  struct step {
+    std::string name; // "*" for any element
+    uint32_t position; // 0 for every match
+  };
+
+  /**
+   * @brief Parses a path expression
+   *
+   * @throws std::invalid_argument If the expression is malformed
+   */
+  explicit query(std::string_view expression);
+
+  const std::vector<step> &steps() const { return steps_; }
+  selector select() const { return select_; }
+  const std::string &attribute() const { return attribute_; }
+
+  /**
+   * @brief Number of leading steps that can match at most one element
+   *
+   * The root is unique, and so is a positional step below a unique one. Once
+   * the element matching these steps is closed, nothing later can match.
+   */
+  size_t unique() const { return unique_; }
+
+private:
+  std::vector<step> steps_;
+  selector select_ = selector::element;
+  std::string attribute_;
+  size_t unique_ = 0;
+};
+
+/**
+ * @brief Follows which open elements match the steps of a query
+ *
+ * Fed every start and end event, it tells when an element matches the whole
+ * path and when nothing later in the document can match, see
+ * query::unique(). The selector is left to the caller.
+ */
+class path_state {
+public:
+  explicit path_state(const query &q)
+      : q(q), counts(q.steps().size(), 0) {}
+
+  /**
+   * @brief Start event: whether the element matches every step
+   */
+  bool start(const event &e);
+
+  /**
+   * @brief End event: whether it closes an element start() matched
+   */
+  bool end(const event &e);
+
+  /**
+   * @brief Whether no element later in the document can match
+   */
+  bool finished() const { return done; }
+
+  const query &path() const { return q; }
+
+private:
+  const query &q;
+  // Open elements, from the root, that match the leading steps
+  size_t matched = 0;
+  // counts[d]: children of the matched element at depth d (the document
+  // for 0) that matched step d so far
+  std::vector<uint32_t> counts;
+  bool done = false;
+};
+
+/**
+ * @brief One result of a query
+ *
+ * The views are only valid during the callback.
+ */
+struct match {
+  // Path of the matched element
+  std::string_view path;
+  // Document offset of the matched element's start tag
+  uint64_t offset;
+  // Markup of the element, or the decoded attribute value or text
+  std::string_view value;
+};
+
+/**
+ * @brief Evaluates a query on the scanner's events
+ *
+ * Only the element being matched is buffered, so a query over a streamed
+ * document needs memory for its largest result, not for the document. The
+ * scan is stopped as soon as no later element can match, see query::unique().
+ *
+ * Element results are rebuilt from the events: attribute text and character
+ * data are kept as written, comments and processing instructions are left
+ * out, and empty elements written as <a/> stay that way.
+ */
+class query_matcher : public handler {
+public:
+  using callback = std::function<void(const match &)>;
+
+  query_matcher(const query &q, callback on_match)
+      : q(q), paths(q), on_match(std::move(on_match)) {}
+
+  bool on_event(const event &e) override;
+
+  uint64_t matches() const { return found; }
+
+private:
+  void append_start_tag(const event &e);
+  void emit(const event &e, std::string_view value);
+
+  const query &q;
+  path_state paths;
+  callback on_match;
+  bool capturing = false;
+  bool had_text = false;
+  uint64_t capture_offset = 0;
+  std::string value;
+  uint64_t found = 0;
+};
+
+} // namespace xml
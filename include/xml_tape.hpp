@@ -0,0 +1,144 @@
+#pragma once
+
+#include "xml.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace xml {
+
+/**
+ * @brief Read-only tree of a whole document, stored as a flat tape
+ *
+ * Every element and text run is one fixed-size record in a single array, in
+ * document order, so a subtree is a contiguous range: an element's first
+ * child is the record after it and its next sibling is the record where its
+ * subtree ends. Names and values are not copied; records hold offsets into
+ * the document, which the tape owns, and element names are interned to
+ * small ids so comparing names is comparing integers.
+ *
+ * The tape is built by one scan of the document with xml::scanner. The array
+ * is reserved once from a count of '<' in the document, so building it does
+ * not reallocate for typical documents.
+ */
+class tape {
+public:
+  static constexpr uint32_t none = UINT32_MAX;
+
+  struct node {
+    enum kind_t : uint8_t { element, text };
+    enum flag_t : uint8_t { self_closing = 1, escaped = 2, cdata = 4 };
+
+    // '<' of the start tag, or the first byte of the text
+    uint64_t offset;
+    // Value: raw attribute text of an element, or the text; it starts at
+    // offset + value_begin
+    uint32_t value_begin;
+    uint32_t value_size;
+    // Interned name of an element; none for text
+    uint32_t name;
+    uint32_t parent;
+    // Index after the last record of the subtree
+    uint32_t end;
+    kind_t kind;
+    uint8_t flags;
+  };
+
+  /**
+   * @brief Builds the tape of a document, such as the output of decrypt_pka
+   *
+   * Text outside the root element is dropped; everything else is kept,
+   * including whitespace-only text between elements.
+   *
+   * @param document Taken over by the tape, which points into it
+   * @throws parse_error If the document is malformed
+   * @throws std::length_error If it has more than 4G records
+   */
+  static tape build(std::string document);
+
+  tape(tape &&) = default;
+  tape &operator=(tape &&) = default;
+
+  /**
+   * @brief The root element, or none for an empty document
+   */
+  uint32_t root() const { return nodes_.empty() ? none : 0; }
+
+  uint32_t first_child(uint32_t i) const {
+    return nodes_[i].end > i + 1 ? i + 1 : none;
+  }
+  uint32_t next_sibling(uint32_t i) const {
+    const uint32_t p = nodes_[i].parent;
+    const uint32_t next = nodes_[i].end;
+    return p != none && next < nodes_[p].end ? next : none;
+  }
+  uint32_t parent(uint32_t i) const { return nodes_[i].parent; }
+
+  bool is_element(uint32_t i) const {
+    return nodes_[i].kind == node::element;
+  }
+  std::string_view name(uint32_t i) const {
+    return is_element(i) ? names_[nodes_[i].name] : std::string_view();
+  }
+  std::string_view value(uint32_t i) const {
+    const node &n = nodes_[i];
+    return std::string_view(*document_).substr(n.offset + n.value_begin,
+                                               n.value_size);
+  }
+
+  /**
+   * @brief Id of an element name, or none if no element has it
+   */
+  uint32_t name_id(std::string_view name) const;
+
+  /**
+   * @brief First child element of i with the given name id, or none
+   */
+  uint32_t child(uint32_t i, uint32_t name) const;
+  uint32_t child(uint32_t i, std::string_view name) const {
+    const uint32_t id = name_id(name);
+    return id == none ? none : child(i, id);
+  }
+
+  /**
+   * @brief Next sibling element of i with the same name, or none
+   */
+  uint32_t next_named(uint32_t i) const;
+
+  /**
+   * @brief Looks up an attribute of an element, see xml::attribute
+   */
+  bool attribute(uint32_t i, std::string_view name,
+                 std::string_view &value) const {
+    return is_element(i) && xml::attribute(this->value(i), name, value);
+  }
+
+  /**
+   * @brief Text directly inside an element, entities decoded
+   */
+  std::string text(uint32_t i) const;
+
+  size_t size() const { return nodes_.size(); }
+  const node &operator[](uint32_t i) const { return nodes_[i]; }
+  const std::vector<node> &nodes() const { return nodes_; }
+  const std::string &document() const { return *document_; }
+
+private:
+  tape() = default;
+
+  class builder;
+
+  // Held by pointer so moving the tape never moves the text, as a short
+  // string's would be
+  std::unique_ptr<std::string> document_;
+  std::vector<node> nodes_;
+  // Interned names point into the document
+  std::vector<std::string_view> names_;
+  std::unordered_map<std::string_view, uint32_t> ids_;
+};
+
+} // namespace xml
@@ -1,14 +1,21 @@
 #include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
 #include <cstdlib>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <sstream>
 #include <string>
 #include <vector>
 
 #include "include/command_handlers.hpp"
+#include "include/log_index.hpp"
+#include "include/logs.hpp"
 #include "include/main.hpp"
+#include "include/thread_pool.hpp"
 #include "include/utils.hpp"
 
 namespace {
@@ -25,6 +32,62 @@ char *get_option_value(char *begin[], char *end[], const std::string &option) {
   return nullptr;
 }
 
+// Remove an option (and its value) from argv so positional arguments and
+// file lists are not affected by where it was given; returns the new argc
+int remove_option(int argc, char *argv[], const std::string &option,
+                  bool has_value) {
+  auto it = std::find(argv, argv + argc, option);
+  if (it == argv + argc) {
+    return argc;
+  }
+  const int count = (has_value && it + 1 != argv + argc) ? 2 : 1;
+  std::copy(it + count, argv + argc, it);
+  return argc - count;
+}
+
+// Parses a --from/--to value; a bare date means the start or end of that day
+int64_t parse_time_option(std::string value, const std::string &option,
+                          bool end_of_day) {
+  if (value.size() == 10) {
+    value += end_of_day ? " 23:59:59.999" : " 00:00:00.000";
+  }
+  int64_t ms;
+  if (!logs::parse_timestamp(value.data(), value.size(), ms)) {
+    utils::die("Invalid time for " + option + ": " + value +
+               " (expected dd.MM.yyyy [HH:mm:ss[.zzz]] or yyyy-MM-dd "
+               "[HH:mm:ss[.zzz]])");
+  }
+  return ms;
+}
+
+// Parses a --max-size/--max-memory value in MB into bytes; 0 would turn
+// the cap off, so it is refused like anything that is not a number
+uint64_t parse_megabytes(const char *value, const std::string &option) {
+  char *end = nullptr;
+  errno = 0;
+  const unsigned long long mb = std::strtoull(value, &end, 10);
+  if (!std::isdigit(static_cast<unsigned char>(value[0])) || *end != '\0' ||
+      errno == ERANGE || mb == 0 || mb > (UINT64_MAX >> 20)) {
+    utils::die("Invalid size for " + option + ": " + value +
+               " (expected a whole number of MB, at least 1)");
+  }
+  return static_cast<uint64_t>(mb) << 20;
+}
+
+// Parses a -j/--index-every value, a whole number from 1 to UINT32_MAX; a
+// typo is refused rather than read as 1
+uint32_t parse_count(const char *value, const std::string &option) {
+  char *end = nullptr;
+  errno = 0;
+  const unsigned long n = std::strtoul(value, &end, 10);
+  if (!std::isdigit(static_cast<unsigned char>(value[0])) || *end != '\0' ||
+      errno == ERANGE || n == 0 || n > UINT32_MAX) {
+    utils::die("Invalid value for " + option + ": " + value +
+               " (expected a whole number, at least 1)");
+  }
+  return static_cast<uint32_t>(n);
+}
+
 // RAII wrapper for file operations
 class FileHandler {
 public:
@@ -66,24 +129,61 @@ void print_help() {
 
 Options:
   -d <in> <out>						Decrypt pka/pkt to xml
+  --normalize						With -d, clean up the xml as Packet Tracer does on load
+  --minify							With -d or -e, drop indentation and comments between tags
+  --pretty							With -d, indent the xml two spaces per level
+  --to <xml|json>					Output of -d (json: elements as objects, see README)
   -e <in> <out>						Encrypt xml to pka/pkt
   -f <in> <out>						Allow packet tracer file to be read by any version
   -nets <in>							Decrypt packet tracer "nets" file
   -logs <in>							Decrypt packet tracer log file
+  -logs <in> --follow			Keep decrypting lines as they are appended (file or directory)
+  -logs <in> --index			Build the sidecar time index <in>.idx
+  --index-every <n>				Lines per index segment (default 1024; --from/--to rebuild an index of another stride)
+  --from <time> --to <time>	Only -logs lines in this time range (uses the index)
+  --match <regex>					Only -logs lines matching this RE2 pattern
+  -logs --merge <files...>	Merge several log files into one time-ordered stream
+  --format <text|jsonl>		Output of -logs, -rb, -rbm, --query, --grep, --diff and --canon-hash (jsonl: one JSON object per line)
   -r <in> <name>					Modify user profile name in pka/pkt file (creates new file)
   -rb <name> <files...>		Batch modify user profile name in multiple pka/pkt files
   -rbm <in> <names...>		Create multiple variations of a file with different names
+  -stats <in>							Check that a pka/pkt file is well-formed XML and count its elements
+  --query <path> <files...>	Print the elements, attributes or text at a path
+  --grep <regex> <files...>	Print file:offset:pattern for every hit (repeatable)
+  --grep-file <patterns>		Add --grep patterns from a file, one per line
+  --canon-hash <files or dirs...>			Hash each document's canonical XML, to find duplicates
+  --canon-ignore <path>					Leave an element, @attribute or text() out of --canon-hash
+  --diff <a> <b>						Print the element paths where two files differ
+  --edit-script <script> <in> <out>	Apply the edits listed in a script in one pass
   --forge <out>						Forge authentication file to bypass login
+  --max-size <MB>					Largest document to inflate (default 1024)
+  --max-memory <MB>				Inflate memory cap for the whole process (default 4096)
+  -j <n>									Worker threads for parallel commands (default: all cores)
   -v											Verbose output
 
 Examples:
   pka2xml -d foobar.pka foobar.xml
+  pka2xml -d foobar.pka foobar.xml --normalize
+  pka2xml -d foobar.pka foobar.xml --pretty
+  pka2xml -d foobar.pka foobar.json --to json
   pka2xml -e foobar.xml foobar.pka
+  pka2xml -e foobar.xml foobar.pka --minify
   pka2xml -nets $HOME/packettracer/nets
   pka2xml -logs $HOME/packettracer/pt_12.05.2020_21.07.17.338.log
+  pka2xml -logs $HOME/packettracer --follow
+  pka2xml -logs pt.log --from "12.05.2020 21:00:00" --to "12.05.2020 22:00:00"
+  pka2xml -logs pt.log --match "Error|Warning"
+  pka2xml -logs --merge $HOME/packettracer/pt_*.log
+  pka2xml -logs pt.log --format jsonl
   pka2xml -r file.pka "New Name"
   pka2xml -rb "New Name" file1.pka file2.pka file3.pka
   pka2xml -rbm file.pka "Name1" "Name2" "Name3"
+  pka2xml -stats file.pka
+  pka2xml --edit-script edits.txt file.pka edited.pka
+  pka2xml --diff reference.pka submission.pka
+  pka2xml --canon-hash archive/ --canon-ignore PACKETTRACER5/ACTIVITY/@timer
+  pka2xml --grep "hostname R[0-9]+" --grep "enable secret" archive/*.pka
+  pka2xml --query 'PACKETTRACER5/NETWORK/DEVICES/DEVICE/ENGINE/NAME/text()' *.pka
 )" << std::endl;
   std::exit(0);
 }
@@ -98,24 +198,175 @@ int main(int argc, char *argv[]) {
   // Check for verbose flag
   bool verbose = option_exists(argv, argv + argc, "-v");
 
+  // Decompression memory caps
+  if (const char *mb = get_option_value(argv, argv + argc, "--max-size")) {
+    pka2xml::limits().per_file = parse_megabytes(mb, "--max-size");
+    argc = remove_option(argc, argv, "--max-size", true);
+  }
+  if (const char *mb = get_option_value(argv, argv + argc, "--max-memory")) {
+    pka2xml::limits().per_process = parse_megabytes(mb, "--max-memory");
+    argc = remove_option(argc, argv, "--max-memory", true);
+  }
+
+  // Worker count for the commands that parallelize
+  unsigned jobs = utils::default_jobs();
+  if (const char *n = get_option_value(argv, argv + argc, "-j")) {
+    jobs = parse_count(n, "-j");
+    argc = remove_option(argc, argv, "-j", true);
+  }
+
+  // Keep -logs running and decrypt lines as they are appended
+  const bool follow = option_exists(argv, argv + argc, "--follow");
+  argc = remove_option(argc, argv, "--follow", false);
+
+  // Log queries: time range and pattern, applied to every decrypted line
+  logs::filter keep;
+  if (const char *t = get_option_value(argv, argv + argc, "--from")) {
+    keep.from = parse_time_option(t, "--from", false);
+    argc = remove_option(argc, argv, "--from", true);
+  }
+  // With -d, --to names the output type instead, see below
+  const bool decrypt = option_exists(argv, argv + argc, "-d");
+  const char *to = get_option_value(argv, argv + argc, "--to");
+  if (to && !decrypt) {
+    keep.to = parse_time_option(to, "--to", true);
+    argc = remove_option(argc, argv, "--to", true);
+  }
+  if (const char *re = get_option_value(argv, argv + argc, "--match")) {
+    auto pattern = std::make_shared<re2::RE2>(re);
+    if (!pattern->ok()) {
+      utils::die("Invalid --match pattern: " + pattern->error());
+    }
+    keep.pattern = std::move(pattern);
+    argc = remove_option(argc, argv, "--match", true);
+  }
+
+  // Record format for -logs and the batch rename commands
+  utils::output_format format = utils::output_format::text;
+  if (const char *f = get_option_value(argv, argv + argc, "--format")) {
+    if (std::string(f) == "jsonl") {
+      format = utils::output_format::jsonl;
+    } else if (std::string(f) != "text") {
+      utils::die("Unknown --format: " + std::string(f) +
+                 " (expected text or jsonl)");
+    }
+    argc = remove_option(argc, argv, "--format", true);
+  }
+
+  // Path query over one or more documents; the remaining arguments are files
+  const char *query = get_option_value(argv, argv + argc, "--query");
+  std::string query_expression;
+  if (query) {
+    query_expression = query;
+    argc = remove_option(argc, argv, "--query", true);
+  }
+
+  // Regular expressions searched for together in every file; --grep may be
+  // repeated, and --grep-file adds one pattern per line
+  std::vector<std::string> grep_patterns;
+  while (const char *re = get_option_value(argv, argv + argc, "--grep")) {
+    grep_patterns.emplace_back(re);
+    argc = remove_option(argc, argv, "--grep", true);
+  }
+  if (const char *f = get_option_value(argv, argv + argc, "--grep-file")) {
+    std::istringstream lines(::read_file_contents(f));
+    for (std::string line; std::getline(lines, line);) {
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+      if (!line.empty()) {
+        grep_patterns.push_back(line);
+      }
+    }
+    argc = remove_option(argc, argv, "--grep-file", true);
+  }
+
+  // Parts of a document --canon-hash leaves out, by path; may be repeated
+  std::vector<std::string> canon_ignore;
+  while (const char *path =
+             get_option_value(argv, argv + argc, "--canon-ignore")) {
+    canon_ignore.emplace_back(path);
+    argc = remove_option(argc, argv, "--canon-ignore", true);
+  }
+
+  // Apply Packet Tracer's own clean-up to -d output
+  const bool normalize = option_exists(argv, argv + argc, "--normalize");
+  argc = remove_option(argc, argv, "--normalize", false);
+
+  // Re-lay out the xml written by -d, or read by -e
+  const bool minify = option_exists(argv, argv + argc, "--minify");
+  argc = remove_option(argc, argv, "--minify", false);
+  const bool pretty = option_exists(argv, argv + argc, "--pretty");
+  argc = remove_option(argc, argv, "--pretty", false);
+  if (minify && pretty) {
+    utils::die("--minify and --pretty cannot be used together");
+  }
+
+  // What -d writes
+  handlers::decrypt_output output = handlers::decrypt_output::xml;
+  if (minify) {
+    output = handlers::decrypt_output::minified;
+  } else if (pretty) {
+    output = handlers::decrypt_output::pretty;
+  }
+  if (to && decrypt) {
+    if (std::string(to) == "json") {
+      if (minify || pretty) {
+        utils::die("--minify and --pretty only apply to xml output");
+      }
+      output = handlers::decrypt_output::json;
+    } else if (std::string(to) != "xml") {
+      utils::die("Unknown --to: " + std::string(to) +
+                 " (expected xml or json)");
+    }
+    argc = remove_option(argc, argv, "--to", true);
+  }
+
+  // Interleave several -logs inputs by timestamp
+  const bool merge = option_exists(argv, argv + argc, "--merge");
+  argc = remove_option(argc, argv, "--merge", false);
+
+  // Sidecar time index for -logs, one segment every n lines
+  const bool build_index = option_exists(argv, argv + argc, "--index");
+  argc = remove_option(argc, argv, "--index", false);
+  uint32_t stride = 0; // 0: not given, an existing index keeps its own
+  if (const char *n = get_option_value(argv, argv + argc, "--index-every")) {
+    stride = parse_count(n, "--index-every");
+    argc = remove_option(argc, argv, "--index-every", true);
+  }
+
   try {
     if (option_exists(argv, argv + argc, "-d")) {
       if (argc > 3) {
-        handlers::handle_decrypt(argv[2], argv[3], verbose);
+        handlers::handle_decrypt(argv[2], argv[3], verbose, normalize,
+                                 output);
       } else {
         utils::die(
             "Insufficient arguments for -d. Usage: pka2xml -d <in> <out>");
       }
     } else if (option_exists(argv, argv + argc, "-e")) {
       if (argc > 3) {
-        handlers::handle_encrypt(argv[2], argv[3], verbose);
+        handlers::handle_encrypt(argv[2], argv[3], verbose, minify);
       } else {
         utils::die(
             "Insufficient arguments for -e. Usage: pka2xml -e <in> <out>");
       }
     } else if (option_exists(argv, argv + argc, "-logs")) {
-      if (argc > 2) {
-        handlers::handle_logs(argv[2], verbose);
+      if (argc > 2 && merge) {
+        std::vector<std::string> files;
+        for (int i = 2; i < argc; i++) {
+          if (argv[i][0] != '-') {
+            files.emplace_back(argv[i]);
+          }
+        }
+        handlers::handle_log_merge(files, jobs, keep, format, verbose);
+      } else if (argc > 2 && build_index) {
+        handlers::handle_log_index(
+            argv[2], stride != 0 ? stride : logs::index::default_stride, jobs,
+            verbose);
+      } else if (argc > 2) {
+        handlers::handle_logs(argv[2], jobs, follow, keep, stride, format,
+                              verbose);
       } else {
         utils::die(
             "Insufficient arguments for -logs. Usage: pka2xml -logs <in>");
@@ -127,6 +378,52 @@ int main(int argc, char *argv[]) {
         utils::die(
             "Insufficient arguments for -nets. Usage: pka2xml -nets <in>");
       }
+    } else if (option_exists(argv, argv + argc, "-stats")) {
+      if (argc > 2) {
+        handlers::handle_stats(argv[2], verbose);
+      } else {
+        utils::die(
+            "Insufficient arguments for -stats. Usage: pka2xml -stats <in>");
+      }
+    } else if (!grep_patterns.empty()) {
+      std::vector<std::string> files;
+      for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-') {
+          files.emplace_back(argv[i]);
+        }
+      }
+      handlers::handle_grep(grep_patterns, files, jobs, format, verbose);
+    } else if (query) {
+      std::vector<std::string> files;
+      for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-') {
+          files.emplace_back(argv[i]);
+        }
+      }
+      handlers::handle_query(query_expression.c_str(), files, jobs, format,
+                             verbose);
+    } else if (option_exists(argv, argv + argc, "--canon-hash")) {
+      std::vector<std::string> inputs;
+      for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-') {
+          inputs.emplace_back(argv[i]);
+        }
+      }
+      handlers::handle_canon_hash(inputs, canon_ignore, jobs, format, verbose);
+    } else if (option_exists(argv, argv + argc, "--diff")) {
+      if (argc > 3) {
+        handlers::handle_diff(argv[2], argv[3], format, verbose);
+      } else {
+        utils::die("Insufficient arguments for --diff. Usage: pka2xml --diff "
+                   "<a> <b>");
+      }
+    } else if (option_exists(argv, argv + argc, "--edit-script")) {
+      if (argc > 4) {
+        handlers::handle_edit_script(argv[2], argv[3], argv[4], verbose);
+      } else {
+        utils::die("Insufficient arguments for --edit-script. Usage: pka2xml "
+                   "--edit-script <script> <in> <out>");
+      }
     } else if (option_exists(argv, argv + argc, "--forge")) {
       if (argc > 2) {
         handlers::handle_forge(argv[2], verbose);
@@ -165,14 +462,15 @@ int main(int argc, char *argv[]) {
             "No input files specified for -rb command. Usage: pka2xml -rb "
             "<name> <files...>");
       }
-      handlers::handle_batch_rename(argc, argv, name_index, verbose);
+      handlers::handle_batch_rename(argc, argv, name_index, format, verbose);
 
     } else if (option_exists(argv, argv + argc, "-rbm")) {
       if (argc < 4) { // Need at least pka2xml -rbm <infile> <name1>
         utils::die("Insufficient arguments for -rbm. Usage: pka2xml -rbm <in> "
                    "<names...>");
       }
-      handlers::handle_batch_rename_multiple(argv[2], argc, argv, verbose);
+      handlers::handle_batch_rename_multiple(argv[2], argc, argv, jobs, format,
+                                             verbose);
     } else {
       // If no known option matches (and argc > 1), or if only -v is present
       if (argc > 1 && !(argc == 2 && verbose)) {
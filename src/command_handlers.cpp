@@ -1,14 +1,37 @@
 #include "../include/command_handlers.hpp"
+#include "../include/edit_session.hpp"
+#include "../include/grep.hpp"
+#include "../include/log_index.hpp"
+#include "../include/logs.hpp"
 #include "../include/main.hpp"
+#include "../include/normalize.hpp"
+#include "../include/thread_pool.hpp"
 #include "../include/utils.hpp"
+#include "../include/xml.hpp"
+#include "../include/xml_canon.hpp"
+#include "../include/xml_diff.hpp"
+#include "../include/xml_edit.hpp"
+#include "../include/xml_format.hpp"
+#include "../include/xml_json.hpp"
+#include "../include/xml_query.hpp"
 
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <deque>
+#include <exception>
 #include <filesystem>
 #include <fstream>
+#include <future>
 #include <iostream>
 #include <iterator>
+#include <limits>
+#include <map>
 #include <memory>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
 // RAII wrapper for file operations
@@ -62,23 +85,486 @@ void write_file_contents(const std::string &filename,
   }
 }
 
+// Per-file results of the batch rename commands. Text mode prints the usual
+// messages; JSON lines mode prints one record per file and a summary record
+// to stdout, and sends progress output to stderr so stdout stays parseable.
+class BatchReport {
+public:
+  BatchReport(utils::output_format format, bool verbose)
+      : json(format == utils::output_format::jsonl), verbose(verbose) {}
+
+  std::ostream &log() const { return json ? std::cerr : std::cout; }
+
+  // edit_session's set_user_profile_name (-rb) and find_user_profile_name
+  // (-rbm) trace to stdout, which only carries records in JSON lines mode
+  bool trace() const { return verbose && !json; }
+
+  void created(const std::string &input, const std::string &name,
+               const std::string &output) {
+    succeeded++;
+    if (!json) {
+      if (verbose) {
+        std::cout << "  Successfully created: " << output << std::endl;
+      } else {
+        std::cout << "Created: " << output << std::endl;
+      }
+      return;
+    }
+    record.clear();
+    begin(input, name);
+    record += ",\"status\":\"created\",\"output\":\"";
+    utils::json_escape(record, output);
+    record += "\"}\n";
+    out.write(record);
+  }
+
+  // message is the text mode line; error is the bare reason for the record
+  void failed(const std::string &input, const std::string &name,
+              const std::string &error, const std::string &message) {
+    failures++;
+    if (!json) {
+      std::cerr << message << std::endl;
+      return;
+    }
+    record.clear();
+    begin(input, name);
+    record += ",\"status\":\"failed\",\"error\":\"";
+    utils::json_escape(record, error);
+    record += "\"}\n";
+    out.write(record);
+  }
+
+  void summary(const std::string &title, const std::string &verb,
+               const std::string &failed_label) {
+    if (!json) {
+      std::cout << "\n" << title << ": " << verb << " " << succeeded
+                << " files successfully";
+      if (failures > 0) {
+        std::cout << ", " << failures << " " << failed_label;
+      }
+      std::cout << "." << std::endl;
+      return;
+    }
+    out.write("{\"summary\":true,\"created\":" + std::to_string(succeeded) +
+              ",\"failed\":" + std::to_string(failures) + "}\n");
+    out.flush();
+  }
+
+private:
+  void begin(const std::string &input, const std::string &name) {
+    record += "{\"input\":\"";
+    utils::json_escape(record, input);
+    record += "\",\"name\":\"";
+    utils::json_escape(record, name);
+    record += '"';
+  }
+
+  bool json;
+  bool verbose;
+  int succeeded = 0;
+  int failures = 0;
+  std::string record;
+  utils::output_buffer out;
+};
+
+// Element statistics gathered from the scanner's events. Counts per name
+// use a transparent map so looking up a name does not allocate.
+class DocumentStats : public xml::handler {
+public:
+  bool on_event(const xml::event &e) override {
+    switch (e.kind) {
+    case xml::event::start: {
+      elements++;
+      max_depth = std::max(max_depth, e.depth);
+      auto it = names.find(e.name);
+      if (it == names.end()) {
+        it = names.emplace(std::string(e.name), 0).first;
+      }
+      it->second++;
+      if (!e.value.empty()) {
+        with_attributes++;
+      }
+      break;
+    }
+    case xml::event::text:
+      text_runs++;
+      text_bytes += e.value.size();
+      break;
+    case xml::event::end:
+      break;
+    }
+    return true;
+  }
+
+  void print(std::ostream &out, uint64_t size) const {
+    out << "Document: " << size << " bytes" << std::endl;
+    out << "Elements: " << elements << " (" << names.size()
+        << " distinct names, " << with_attributes << " with attributes)"
+        << std::endl;
+    out << "Max depth: " << max_depth << std::endl;
+    out << "Text: " << text_bytes << " bytes in " << text_runs << " runs"
+        << std::endl;
+
+    std::vector<std::pair<uint64_t, std::string_view>> common;
+    for (const auto &entry : names) {
+      common.emplace_back(entry.second, entry.first);
+    }
+    const size_t shown = std::min<size_t>(common.size(), 10);
+    std::partial_sort(common.begin(), common.begin() + shown, common.end(),
+                      [](const auto &a, const auto &b) {
+                        return a.first > b.first ||
+                               (a.first == b.first && a.second < b.second);
+                      });
+    out << "Most common elements:" << std::endl;
+    for (size_t i = 0; i < shown; i++) {
+      out << "  " << common[i].second << " " << common[i].first << std::endl;
+    }
+  }
+
+private:
+  std::map<std::string, uint64_t, std::less<>> names;
+  uint64_t elements = 0;
+  uint64_t with_attributes = 0;
+  uint64_t text_runs = 0;
+  uint64_t text_bytes = 0;
+  size_t max_depth = 0;
+};
+
+// Message for an exception from the crypto or compression stages, which
+// report zlib failures as a bare int
+std::string describe_error(const std::exception_ptr &error) {
+  try {
+    std::rethrow_exception(error);
+  } catch (const std::exception &e) {
+    return e.what();
+  } catch (int code) {
+    return "zlib error " + std::to_string(code);
+  } catch (...) {
+    return "unknown error";
+  }
+}
+
+// Output records of one file for --query and --grep and how many results
+// they hold
+struct FileRecords {
+  std::string records;
+  uint64_t count = 0;
+};
+
+// Decrypts a pka/pkt file up to the compressed document. Errors are thrown
+// rather than fatal, since this runs on the workers.
+std::string read_compressed(const std::string &file) {
+  std::ifstream stream(file, std::ios::binary);
+  if (!stream.is_open()) {
+    throw std::runtime_error("Failed to open file: " + file);
+  }
+  const std::string input((std::istreambuf_iterator<char>(stream)),
+                          std::istreambuf_iterator<char>());
+  return pka2xml::decrypt_compressed(input, pka2xml::eax::pka);
+}
+
+// Runs task(file) for every file on the pool and prints the records in
+// argument order, with a few files per worker in flight so memory stays
+// bounded. A file that fails is reported, as a record in JSON lines mode,
+// and the others go on; returns the number that failed.
+template <typename Task>
+size_t for_each_file(const std::vector<std::string> &files, unsigned jobs,
+                     utils::output_format format, bool verbose,
+                     const char *action, const char *unit, Task task) {
+  struct pending_file {
+    const std::string *file;
+    std::future<FileRecords> result;
+  };
+  std::unique_ptr<utils::thread_pool> pool;
+  if (jobs > 1) {
+    pool = std::make_unique<utils::thread_pool>(jobs);
+  }
+  std::deque<pending_file> pending;
+  const size_t max_pending = 2 * static_cast<size_t>(jobs);
+  const bool json = format == utils::output_format::jsonl;
+
+  utils::output_buffer out;
+  size_t failures = 0;
+  auto finish = [&](pending_file &p) {
+    try {
+      const FileRecords result = p.result.get();
+      out.write(result.records);
+      if (verbose)
+        std::cerr << *p.file << ": " << result.count << " " << unit
+                  << std::endl;
+    } catch (...) {
+      failures++;
+      const std::string error = describe_error(std::current_exception());
+      if (!json) {
+        out.flush();
+        std::cerr << "Error " << action << " " << *p.file << ": " << error
+                  << std::endl;
+        return;
+      }
+      std::string record = "{\"input\":\"";
+      utils::json_escape(record, *p.file);
+      record += "\",\"error\":\"";
+      utils::json_escape(record, error);
+      record += "\"}\n";
+      out.write(record);
+    }
+  };
+
+  for (const auto &file : files) {
+    auto run = [&task, &file] { return task(file); };
+    pending.push_back({&file, pool ? pool->submit(run)
+                            : std::async(std::launch::deferred, run)});
+    if (pending.size() >= max_pending) {
+      finish(pending.front());
+      pending.pop_front();
+    }
+  }
+  while (!pending.empty()) {
+    finish(pending.front());
+    pending.pop_front();
+  }
+  out.flush();
+  return failures;
+}
+
+// Runs a query over one encrypted file. The document is scanned straight
+// from the inflate output, which stops as soon as the query cannot match
+// anything further on.
+FileRecords query_file(const std::string &file, const xml::query &q,
+                       bool with_file, utils::output_format format) {
+  const std::string compressed = read_compressed(file);
+
+  FileRecords result;
+  std::string &records = result.records;
+  xml::query_matcher matcher(q, [&](const xml::match &m) {
+    if (format == utils::output_format::jsonl) {
+      records += "{\"input\":\"";
+      utils::json_escape(records, file);
+      records += "\",\"path\":\"";
+      utils::json_escape(records, m.path.data(), m.path.size());
+      records += "\",\"offset\":" + std::to_string(m.offset) +
+                 ",\"value\":\"";
+      utils::json_escape(records, m.value.data(), m.value.size());
+      records += "\"}\n";
+      return;
+    }
+    if (with_file) {
+      records += file;
+      records += ": ";
+    }
+    records += m.value;
+    records += '\n';
+  });
+  xml::scanner scanner(matcher);
+  const bool complete = pka2xml::uncompress_chunks(
+      reinterpret_cast<const unsigned char *>(compressed.data()),
+      compressed.size(), [&scanner](const char *data, size_t size) {
+        return scanner.feed(data, size);
+      });
+  if (complete) {
+    scanner.finish();
+  }
+  result.count = matcher.matches();
+  return result;
+}
+
+// Searches the decrypted document of one file, chunk by chunk as it is
+// inflated, without holding it in memory
+FileRecords grep_file(const std::string &file, const grep::patterns &p,
+                      utils::output_format format) {
+  const std::string compressed = read_compressed(file);
+
+  FileRecords result;
+  std::string &records = result.records;
+  grep::searcher searcher(p, [&](const grep::hit &h) {
+    if (format == utils::output_format::jsonl) {
+      records += "{\"input\":\"";
+      utils::json_escape(records, file);
+      records += "\",\"offset\":" + std::to_string(h.offset) +
+                 ",\"pattern\":\"";
+      utils::json_escape(records, p.pattern(h.pattern));
+      records += "\",\"match\":\"";
+      utils::json_escape(records, h.text.data(), h.text.size());
+      records += "\"}\n";
+      return;
+    }
+    records += file;
+    records += ':';
+    records += std::to_string(h.offset);
+    records += ':';
+    records += p.pattern(h.pattern);
+    records += '\n';
+  });
+  pka2xml::uncompress_chunks(
+      reinterpret_cast<const unsigned char *>(compressed.data()),
+      compressed.size(), [&searcher](const char *data, size_t size) {
+        searcher.feed(data, size);
+        return true;
+      });
+  searcher.finish();
+  result.count = searcher.hits();
+  return result;
+}
+
+// Hashes the canonical form of one file's document, written straight from
+// the inflate output into the hash
+FileRecords canon_hash_file(const std::string &file,
+                            const std::vector<xml::query> &ignore,
+                            utils::output_format format) {
+  const std::string compressed = read_compressed(file);
+
+  utils::xxh64 hash;
+  xml::canonicalizer canon(
+      ignore, [&hash](const char *data, size_t size) {
+        hash.update(data, size);
+      });
+  xml::scanner scanner(canon);
+  pka2xml::uncompress_chunks(
+      reinterpret_cast<const unsigned char *>(compressed.data()),
+      compressed.size(), [&scanner](const char *data, size_t size) {
+        return scanner.feed(data, size);
+      });
+  scanner.finish();
+  canon.finish();
+
+  char hex[17];
+  std::snprintf(hex, sizeof hex, "%016llx",
+                static_cast<unsigned long long>(hash.digest()));
+  FileRecords result;
+  result.count = canon.size();
+  if (format == utils::output_format::jsonl) {
+    result.records = "{\"input\":\"";
+    utils::json_escape(result.records, file);
+    result.records += "\",\"hash\":\"";
+    result.records += hex;
+    result.records += "\",\"bytes\":" + std::to_string(canon.size()) + "}\n";
+  } else {
+    // As sha256sum prints, so duplicates sort together
+    result.records = std::string(hex) + "  " + file + "\n";
+  }
+  return result;
+}
+
+// Files named on the command line, with directories replaced by the
+// pka/pkt files anywhere below them, in name order
+std::vector<std::string> expand_inputs(const std::vector<std::string> &inputs) {
+  std::vector<std::string> files;
+  for (const auto &input : inputs) {
+    std::error_code ec;
+    if (!std::filesystem::is_directory(input, ec)) {
+      files.push_back(input);
+      continue;
+    }
+    std::vector<std::string> found;
+    for (std::filesystem::recursive_directory_iterator
+             it(input, std::filesystem::directory_options::skip_permission_denied,
+                ec),
+         end;
+         !ec && it != end; it.increment(ec)) {
+      if (!it->is_regular_file(ec)) {
+        continue;
+      }
+      std::string extension = it->path().extension().string();
+      std::transform(extension.begin(), extension.end(), extension.begin(),
+                     [](unsigned char c) { return std::tolower(c); });
+      if (extension == ".pka" || extension == ".pkt") {
+        found.push_back(it->path().string());
+      }
+    }
+    if (ec) {
+      utils::die("Cannot read directory " + input + ": " + ec.message());
+    }
+    std::sort(found.begin(), found.end());
+    files.insert(files.end(), found.begin(), found.end());
+  }
+  return files;
+}
+
+// Feeds the xml in decrypted, still compressed data to a scanner as it is
+// inflated, through the normalizer if asked
+void scan_inflated(const std::string &compressed, bool normalize,
+                   xml::scanner &s) {
+  pka2xml::normalizer n;
+  std::string cleaned;
+  pka2xml::uncompress_chunks(
+      reinterpret_cast<const unsigned char *>(compressed.data()),
+      compressed.size(),
+      [&](const char *chunk, size_t size) {
+        if (!normalize) {
+          return s.feed(chunk, size);
+        }
+        cleaned.clear();
+        n.feed(chunk, size, cleaned);
+        return s.feed(cleaned);
+      },
+      64 << 10);
+  if (normalize) {
+    cleaned.clear();
+    n.finish(cleaned);
+    s.feed(cleaned);
+  }
+  s.finish();
+}
+
+// Writes a decrypted file minified, pretty-printed or as JSON, without
+// holding the whole document
+void decrypt_converted(const std::string &input, const std::string &outfile,
+                       bool normalize, handlers::decrypt_output output) {
+  const std::string compressed =
+      pka2xml::decrypt_compressed(input, pka2xml::eax::pka);
+  FileHandler file(outfile, std::ios::out);
+  std::fstream &out = file.get();
+  auto write = [&out](const char *data, size_t size) {
+    out.write(data, static_cast<std::streamsize>(size));
+  };
+  if (output == handlers::decrypt_output::json) {
+    xml::json_writer w(write);
+    xml::scanner s(w);
+    scan_inflated(compressed, normalize, s);
+    w.finish();
+  } else {
+    xml::formatter f(output == handlers::decrypt_output::minified
+                         ? xml::formatter::style::minify
+                         : xml::formatter::style::pretty,
+                     write);
+    xml::scanner s(f);
+    scan_inflated(compressed, normalize, s);
+    f.finish();
+  }
+  if (!out.flush()) {
+    throw std::runtime_error("Failed to write all data to file: " + outfile);
+  }
+}
+
 namespace handlers {
 
-void handle_decrypt(const char *infile, const char *outfile, bool verbose) {
+void handle_decrypt(const char *infile, const char *outfile, bool verbose,
+                    bool normalize, decrypt_output output) {
   if (verbose)
     std::cout << "Reading input file: " << infile << std::endl;
   const std::string input = read_file_contents(infile);
   if (verbose)
     std::cout << "Writing to output file: " << outfile << std::endl;
-  write_file_contents(outfile, pka2xml::decrypt_pka(input));
+  if (output == decrypt_output::xml) {
+    write_file_contents(outfile, normalize
+                                     ? pka2xml::decrypt_pka_normalized(input)
+                                     : pka2xml::decrypt_pka(input));
+  } else {
+    decrypt_converted(input, outfile, normalize, output);
+  }
   if (verbose)
     std::cout << "Successfully decrypted file" << std::endl;
 }
 
-void handle_encrypt(const char *infile, const char *outfile, bool verbose) {
+void handle_encrypt(const char *infile, const char *outfile, bool verbose,
+                    bool minify) {
   if (verbose)
     std::cout << "Reading input file: " << infile << std::endl;
-  const std::string input = read_file_contents(infile);
+  std::string input = read_file_contents(infile);
+  if (minify) {
+    // Less for the compressor to get through, and a smaller file
+    input = xml::format(input, xml::formatter::style::minify);
+  }
   if (verbose)
     std::cout << "Writing to output file: " << outfile << std::endl;
   write_file_contents(outfile, pka2xml::encrypt_pka(input));
@@ -86,19 +572,84 @@ void handle_encrypt(const char *infile, const char *outfile, bool verbose) {
     std::cout << "Successfully encrypted file" << std::endl;
 }
 
-void handle_logs(const char *infile, bool /*verbose*/) {
-  // FileHandler is RAII, no need for manual close/check
-  // std::fstream handles binary/text mode automatically on different OS
-  std::ifstream file(infile);
+void handle_logs(const char *infile, unsigned jobs, bool follow,
+                 const logs::filter &keep, uint32_t stride,
+                 utils::output_format format, bool verbose) {
+  if (follow) {
+    if (verbose)
+      std::cerr << "Following " << infile << std::endl;
+    utils::output_buffer out;
+    logs::follow(infile, out, keep, format, verbose);
+    return;
+  }
+
+  std::ifstream file(infile, std::ios::binary);
   if (!file.is_open()) {
     utils::die("Failed to open log file: " + std::string(infile));
   }
-  std::string line;
-  while (std::getline(file, line)) {
-    std::cout << pka2xml::decrypt_logs(line) << std::endl;
+
+  utils::output_buffer out;
+  if (!keep.by_time()) {
+    if (verbose)
+      std::cerr << "Decrypting " << infile << " with " << jobs << " worker(s)"
+                << std::endl;
+    logs::decrypt_stream(file, out, jobs, keep, format);
+    return;
+  }
+
+  // A time range only needs the index segments that overlap it. An existing
+  // index is used unless --index-every asks for another stride.
+  logs::index index;
+  if (!logs::index::load(infile, index) ||
+      (stride != 0 && index.stride() != stride)) {
+    if (verbose)
+      std::cerr << "Building index " << logs::index_path(infile) << std::endl;
+    index = logs::index::build(
+        infile, stride != 0 ? stride : logs::index::default_stride, jobs);
+    try {
+      index.save(infile);
+    } catch (const std::exception &e) {
+      std::cerr << "Warning: " << e.what() << std::endl;
+    }
+  }
+
+  for (const auto &range : index.ranges(keep.from, keep.to)) {
+    if (verbose)
+      std::cerr << "Decrypting " << infile << " bytes " << range.first << "-"
+                << range.second << " with " << jobs << " worker(s)"
+                << std::endl;
+    file.clear();
+    file.seekg(static_cast<std::streamoff>(range.first));
+    logs::decrypt_stream(file, out, jobs, keep, format,
+                         range.second - range.first);
   }
 }
 
+void handle_log_merge(const std::vector<std::string> &files, unsigned jobs,
+                      const logs::filter &keep, utils::output_format format,
+                      bool verbose) {
+  if (files.empty()) {
+    utils::die("No input files specified for --merge. Usage: pka2xml -logs "
+               "--merge <files...>");
+  }
+  if (verbose)
+    std::cerr << "Merging " << files.size() << " log file(s) with " << jobs
+              << " worker(s)" << std::endl;
+
+  utils::output_buffer out;
+  logs::merge(files, out, jobs, keep, format);
+}
+
+void handle_log_index(const char *infile, uint32_t stride, unsigned jobs,
+                      bool verbose) {
+  const logs::index index = logs::index::build(infile, stride, jobs);
+  index.save(infile);
+  if (verbose)
+    std::cout << "Indexed " << infile << " as " << index.segments().size()
+              << " segments of " << index.stride() << " lines into "
+              << logs::index_path(infile) << std::endl;
+}
+
 void handle_nets(const char *infile, bool verbose) {
   if (verbose)
     std::cout << "Reading input file: " << infile << std::endl;
@@ -107,6 +658,246 @@ void handle_nets(const char *infile, bool verbose) {
   std::cout << pka2xml::decrypt_nets(input) << std::endl;
 }
 
+void handle_stats(const char *infile, bool verbose) {
+  if (verbose)
+    std::cout << "Reading input file: " << infile << std::endl;
+  const std::string input = read_file_contents(infile);
+  const std::string compressed =
+      pka2xml::decrypt_compressed(input, pka2xml::eax::pka);
+
+  // Scanned straight from the inflate output, so the document is never held
+  // in memory as a whole
+  DocumentStats stats;
+  xml::scanner scanner(stats);
+  try {
+    pka2xml::uncompress_chunks(
+        reinterpret_cast<const unsigned char *>(compressed.data()),
+        compressed.size(),
+        [&scanner](const char *data, size_t size) {
+          return scanner.feed(data, size);
+        });
+    scanner.finish();
+  } catch (const xml::parse_error &e) {
+    utils::die("Malformed XML in " + std::string(infile) + ": " + e.what());
+  }
+
+  stats.print(std::cout, scanner.offset());
+  std::cout << "Well-formed: yes" << std::endl;
+}
+
+void handle_query(const char *expression,
+                  const std::vector<std::string> &files, unsigned jobs,
+                  utils::output_format format, bool verbose) {
+  if (files.empty()) {
+    utils::die("No input files specified for --query. Usage: pka2xml --query "
+               "<path> <files...>");
+  }
+  std::unique_ptr<xml::query> q;
+  try {
+    q = std::make_unique<xml::query>(expression);
+  } catch (const std::invalid_argument &e) {
+    utils::die(std::string("Invalid --query: ") + e.what());
+  }
+  if (verbose)
+    std::cerr << "Querying " << files.size() << " file(s) with " << jobs
+              << " worker(s)" << std::endl;
+
+  const bool with_file = files.size() > 1;
+  const size_t failures = for_each_file(
+      files, jobs, format, verbose, "querying", "match(es)",
+      [&q, with_file, format](const std::string &file) {
+        return query_file(file, *q, with_file, format);
+      });
+  if (failures > 0) {
+    utils::die(std::to_string(failures) + " of " +
+               std::to_string(files.size()) + " file(s) could not be queried");
+  }
+}
+
+void handle_grep(const std::vector<std::string> &patterns,
+                 const std::vector<std::string> &files, unsigned jobs,
+                 utils::output_format format, bool verbose) {
+  if (files.empty()) {
+    utils::die("No input files specified for --grep. Usage: pka2xml --grep "
+               "<regex> [--grep <regex>...] <files...>");
+  }
+  std::unique_ptr<grep::patterns> p;
+  try {
+    p = std::make_unique<grep::patterns>(patterns);
+  } catch (const std::invalid_argument &e) {
+    utils::die(std::string("Invalid --grep: ") + e.what());
+  }
+  if (verbose)
+    std::cerr << "Searching " << files.size() << " file(s) for "
+              << patterns.size() << " pattern(s) with " << jobs
+              << " worker(s)" << std::endl;
+
+  const size_t failures =
+      for_each_file(files, jobs, format, verbose, "searching", "hit(s)",
+                    [&p, format](const std::string &file) {
+                      return grep_file(file, *p, format);
+                    });
+  if (failures > 0) {
+    utils::die(std::to_string(failures) + " of " +
+               std::to_string(files.size()) + " file(s) could not be searched");
+  }
+}
+
+void handle_canon_hash(const std::vector<std::string> &inputs,
+                       const std::vector<std::string> &ignore, unsigned jobs,
+                       utils::output_format format, bool verbose) {
+  std::vector<xml::query> paths;
+  for (const auto &path : ignore) {
+    try {
+      paths.emplace_back(path);
+    } catch (const std::invalid_argument &e) {
+      utils::die(std::string("Invalid --canon-ignore: ") + e.what());
+    }
+  }
+  const std::vector<std::string> files = expand_inputs(inputs);
+  if (files.empty()) {
+    utils::die("No input files specified for --canon-hash. Usage: pka2xml "
+               "--canon-hash <files or directories...>");
+  }
+  if (verbose)
+    std::cerr << "Hashing " << files.size() << " file(s) with " << jobs
+              << " worker(s)" << std::endl;
+
+  const size_t failures = for_each_file(
+      files, jobs, format, verbose, "hashing", "canonical byte(s)",
+      [&paths, format](const std::string &file) {
+        return canon_hash_file(file, paths, format);
+      });
+  if (failures > 0) {
+    utils::die(std::to_string(failures) + " of " +
+               std::to_string(files.size()) + " file(s) could not be hashed");
+  }
+}
+
+void handle_diff(const char *file_a, const char *file_b,
+                 utils::output_format format, bool verbose) {
+  // Each file is decrypted, inflated and scanned on its reader's thread
+  auto source = [](const char *file) {
+    return [input = read_file_contents(file)](
+               const xml::event_reader::sink &sink) {
+      const std::string compressed =
+          pka2xml::decrypt_compressed(input, pka2xml::eax::pka);
+      pka2xml::uncompress_chunks(
+          reinterpret_cast<const unsigned char *>(compressed.data()),
+          compressed.size(), sink, 64 << 10);
+    };
+  };
+  xml::event_reader a(source(file_a));
+  xml::event_reader b(source(file_b));
+
+  utils::output_buffer out;
+  std::string record;
+  const char *const changes[] = {"removed", "added", "changed"};
+  uint64_t count = 0;
+  try {
+    count = xml::diff(a, b, [&](const xml::difference &d) {
+      // Elements have no value, attributes and text have
+      const bool valued = d.path.find("/@") != std::string_view::npos ||
+                          d.kind == xml::difference::changed;
+      record.clear();
+      if (format == utils::output_format::jsonl) {
+        record += "{\"change\":\"";
+        record += changes[d.kind];
+        record += "\",\"path\":\"";
+        utils::json_escape(record, d.path.data(), d.path.size());
+        record += '"';
+        if (valued && d.kind != xml::difference::added) {
+          record += ",\"a\":\"";
+          utils::json_escape(record, d.a.data(), d.a.size());
+          record += '"';
+        }
+        if (valued && d.kind != xml::difference::removed) {
+          record += ",\"b\":\"";
+          utils::json_escape(record, d.b.data(), d.b.size());
+          record += '"';
+        }
+        record += "}\n";
+      } else {
+        const char *const marks[] = {"- ", "+ ", "~ "};
+        record += marks[d.kind];
+        record += d.path;
+        if (d.kind == xml::difference::changed) {
+          record += ": \"";
+          record += d.a;
+          record += "\" -> \"";
+          record += d.b;
+          record += '"';
+        } else if (valued) {
+          record += " = \"";
+          record += d.kind == xml::difference::removed ? d.a : d.b;
+          record += '"';
+        }
+        record += '\n';
+      }
+      out.write(record);
+    });
+  } catch (...) {
+    out.flush();
+    const char *file = a.failed() ? file_a : file_b;
+    utils::die("Could not compare " + std::string(file) + ": " +
+               describe_error(std::current_exception()));
+  }
+  out.flush();
+  if (verbose)
+    std::cerr << count << " difference(s)" << std::endl;
+}
+
+void handle_edit_script(const char *script_file, const char *infile,
+                        const char *outfile, bool verbose) {
+  std::unique_ptr<xml::edit_script> script;
+  try {
+    script =
+        std::make_unique<xml::edit_script>(read_file_contents(script_file));
+  } catch (const std::invalid_argument &e) {
+    utils::die("Invalid edit script " + std::string(script_file) + ": " +
+               e.what());
+  }
+
+  if (verbose)
+    std::cout << "Reading input file: " << infile << std::endl;
+  std::string xml = pka2xml::decrypt_pka(read_file_contents(infile));
+
+  // One scan finds the edits of every operation; they are then made in a
+  // piece table, which hands deflate slices of the original and the values
+  std::vector<uint64_t> hits;
+  std::vector<xml::replacement> edits;
+  try {
+    edits = script->find(xml, hits);
+  } catch (const xml::parse_error &e) {
+    utils::die("Malformed XML in " + std::string(infile) + ": " + e.what());
+  } catch (const std::invalid_argument &e) {
+    utils::die("Edit script " + std::string(script_file) + ": " + e.what());
+  }
+  for (size_t op = 0; op < script->size(); op++) {
+    if (hits[op] == 0) {
+      std::cerr << "Warning: line " << script->line(op) << " of "
+                << script_file << " matched nothing" << std::endl;
+    } else if (verbose) {
+      std::cout << "  Line " << script->line(op) << ": " << hits[op]
+                << " change(s)" << std::endl;
+    }
+  }
+
+  if (verbose)
+    std::cout << "Writing " << edits.size() << " edit(s) to " << outfile
+              << std::endl;
+  pka2xml::edit_session session(std::move(xml));
+  // Offsets are in the original; each edit moves the ones after it
+  int64_t shift = 0;
+  for (const auto &e : edits) {
+    session.replace(e.offset + shift, e.size, e.text);
+    shift += static_cast<int64_t>(e.text.size()) - static_cast<int64_t>(e.size);
+  }
+  write_file_contents(outfile, session.save());
+  if (verbose)
+    std::cout << "Successfully edited file" << std::endl;
+}
+
 void handle_forge(const char *outfile, bool verbose) {
   if (verbose)
     std::cout << "Creating forged authentication file: " << outfile
@@ -155,10 +946,17 @@ void handle_rename(const char *infile, const char *new_name_arg, bool verbose) {
 
     if (verbose)
       std::cout << "Decrypting file..." << std::endl;
-    std::string xml = pka2xml::decrypt_pka(input);
+    // Keep the deflate stream and its block boundaries, so only the blocks
+    // around the name need compressing again
+    const std::string compressed =
+        pka2xml::decrypt_compressed(input, pka2xml::eax::pka);
+    pka2xml::deflate_index index;
+    const std::string xml = pka2xml::uncompress(
+        reinterpret_cast<const unsigned char *>(compressed.data()),
+        compressed.size(), &index);
     if (verbose)
-      std::cout << "Decrypted XML size: " << xml.size() << " bytes"
-                << std::endl;
+      std::cout << "Decrypted XML size: " << xml.size() << " bytes in "
+                << index.blocks.size() << " deflate blocks" << std::endl;
 
     if (xml.empty()) {
       utils::die("Failed to decrypt the input file: " + std::string(infile));
@@ -167,8 +965,8 @@ void handle_rename(const char *infile, const char *new_name_arg, bool verbose) {
     if (verbose)
       std::cout << "Modifying user profile name to: " << new_name_arg
                 << std::endl;
-    xml = pka2xml::modify_user_profile(xml, new_name_arg, verbose);
-    if (xml.empty()) {
+    pka2xml::profile_name name_at{};
+    if (!pka2xml::find_user_profile_name(xml, name_at, verbose)) {
       utils::die("Failed to modify user profile name in file: " +
                  std::string(infile));
     }
@@ -176,7 +974,12 @@ void handle_rename(const char *infile, const char *new_name_arg, bool verbose) {
     if (verbose)
       std::cout << "Encrypting and writing to new file: " << new_filename
                 << std::endl;
-    write_file_contents(new_filename, pka2xml::encrypt_pka(xml));
+    write_file_contents(new_filename,
+                        pka2xml::encrypt_compressed(
+                            pka2xml::recompress_edit(compressed, index, xml,
+                                                     name_at.begin,
+                                                     name_at.end, new_name_arg),
+                            pka2xml::eax::pka));
     std::cout << "Created: " << new_filename << std::endl;
 
   } catch (const std::filesystem::filesystem_error &e) {
@@ -191,90 +994,128 @@ void handle_rename(const char *infile, const char *new_name_arg, bool verbose) {
   }
 }
 
-void handle_batch_rename(int argc, char *argv[], int name_index, bool verbose) {
+void handle_batch_rename(int argc, char *argv[], int name_index,
+                         utils::output_format format, bool verbose) {
   std::string new_name = argv[name_index];
   if (new_name.empty()) {
     utils::die("New name for batch rename cannot be empty.");
   }
+  BatchReport report(format, verbose);
   if (verbose)
-    std::cout << "Batch processing with new name: " << new_name << std::endl;
+    report.log() << "Batch processing with new name: " << new_name
+                 << std::endl;
 
-  int success_count = 0;
-  int fail_count = 0;
   int file_count = argc - name_index - 1;
 
-  for (int i = name_index + 1; i < argc; i++) {
-    const char *current_infile = argv[i];
-    if (verbose)
-      std::cout << "\nProcessing file " << (i - name_index) << "/" << file_count
-                << ": " << current_infile << std::endl;
+  // Files are handled in groups so the crypto stages of each group can run
+  // through the multi-buffer EAX engine
+  for (int group = name_index + 1; group < argc;
+       group += static_cast<int>(pka2xml::eax::lanes)) {
+    const int group_end =
+        std::min(argc, group + static_cast<int>(pka2xml::eax::lanes));
 
-    try {
-      std::filesystem::path input_path(current_infile);
-      if (!std::filesystem::exists(input_path)) {
-        // Log warning but continue
-        std::cerr << "Warning: Input file does not exist: " << current_infile
-                  << std::endl;
-        fail_count++;
-        continue;
-      }
+    std::vector<const char *> names;
+    std::vector<std::string> new_filenames;
+    std::vector<std::string> inputs;
 
-      std::string stem = input_path.stem().string();
-      std::string extension = input_path.extension().string();
-      std::string new_filename = stem + "_" + new_name + extension;
-
-      const std::string input = read_file_contents(current_infile);
+    for (int i = group; i < group_end; i++) {
+      const char *current_infile = argv[i];
       if (verbose)
-        std::cout << "  Input size: " << input.size() << " bytes" << std::endl;
+        report.log() << "\nProcessing file " << (i - name_index) << "/"
+                     << file_count << ": " << current_infile << std::endl;
 
-      std::string xml = pka2xml::decrypt_pka(input);
-      if (xml.empty()) {
-        std::cerr << "Error: Failed to decrypt file: " << current_infile
-                  << std::endl;
-        fail_count++;
+      try {
+        std::filesystem::path input_path(current_infile);
+        if (!std::filesystem::exists(input_path)) {
+          // Log warning but continue
+          report.failed(current_infile, new_name, "Input file does not exist",
+                        "Warning: Input file does not exist: " +
+                            std::string(current_infile));
+          continue;
+        }
+
+        std::string stem = input_path.stem().string();
+        std::string extension = input_path.extension().string();
+
+        inputs.push_back(read_file_contents(current_infile));
+        names.push_back(current_infile);
+        new_filenames.push_back(stem + "_" + new_name + extension);
+        if (verbose)
+          report.log() << "  Input size: " << inputs.back().size() << " bytes"
+                       << std::endl;
+      } catch (const std::filesystem::filesystem_error &e) {
+        report.failed(current_infile, new_name, e.what(),
+                      "Error processing file " + std::string(current_infile) +
+                          ": Filesystem error - " + e.what());
+      }
+    }
+
+    std::vector<std::exception_ptr> errors;
+    std::vector<std::string> xmls = pka2xml::decrypt_pka_batch(inputs, errors);
+    inputs.clear();
+
+    // Each name is replaced in a piece table over the decrypted document, so
+    // the renamed documents are compressed without being copied
+    std::vector<pka2xml::edit_session> sessions;
+    std::vector<size_t> modified;
+    for (size_t k = 0; k < xmls.size(); k++) {
+      if (errors[k]) {
+        const std::string error = describe_error(errors[k]);
+        report.failed(names[k], new_name, error,
+                      "Error processing file " + std::string(names[k]) +
+                          ": " + error);
+        continue;
+      }
+      if (xmls[k].empty()) {
+        report.failed(names[k], new_name, "Failed to decrypt file",
+                      "Error: Failed to decrypt file: " +
+                          std::string(names[k]));
         continue;
       }
       if (verbose)
-        std::cout << "  Decrypted size: " << xml.size() << " bytes"
-                  << std::endl;
+        report.log() << "  Decrypted size of " << names[k] << ": "
+                     << xmls[k].size() << " bytes" << std::endl;
 
-      xml = pka2xml::modify_user_profile(xml, new_name, verbose);
-      if (xml.empty()) {
-        std::cerr << "Error: Failed to modify user profile name in file: "
-                  << current_infile << std::endl;
-        fail_count++;
+      pka2xml::edit_session session(std::move(xmls[k]));
+      if (!pka2xml::set_user_profile_name(session, new_name,
+                                          report.trace())) {
+        report.failed(names[k], new_name,
+                      "Failed to modify user profile name",
+                      "Error: Failed to modify user profile name in file: " +
+                          std::string(names[k]));
         continue;
       }
+      sessions.push_back(std::move(session));
+      modified.push_back(k);
+    }
 
-      write_file_contents(new_filename, pka2xml::encrypt_pka(xml));
-      if (verbose) {
-        std::cout << "  Successfully created: " << new_filename << std::endl;
-      } else {
-        std::cout << "Created: " << new_filename << std::endl;
-      }
-      success_count++;
+    std::vector<pka2xml::pieces> documents;
+    for (const auto &session : sessions) {
+      documents.push_back(session.view());
+    }
+    std::vector<std::string> encrypted =
+        pka2xml::encrypt_pka_batch(documents, errors);
 
-    } catch (const std::filesystem::filesystem_error &e) {
-      std::cerr << "Error processing file " << current_infile
-                << ": Filesystem error - " << e.what() << std::endl;
-      fail_count++;
-    } catch (const std::exception &e) {
-      std::cerr << "Error processing file " << current_infile << ": "
-                << e.what() << std::endl;
-      fail_count++;
+    for (size_t m = 0; m < modified.size(); m++) {
+      const size_t k = modified[m];
+      if (errors[m]) {
+        const std::string error = describe_error(errors[m]);
+        report.failed(names[k], new_name, error,
+                      "Error processing file " + std::string(names[k]) +
+                          ": " + error);
+        continue;
+      }
+      write_file_contents(new_filenames[k], encrypted[m]);
+      report.created(names[k], new_name, new_filenames[k]);
     }
   }
 
   // Print summary
-  std::cout << "\nBatch Rename Summary: Processed " << success_count
-            << " files successfully";
-  if (fail_count > 0) {
-    std::cout << ", " << fail_count << " failed";
-  }
-  std::cout << "." << std::endl;
+  report.summary("Batch Rename Summary", "Processed", "failed");
 }
 
 void handle_batch_rename_multiple(const char *infile, int argc, char *argv[],
+                                  unsigned jobs, utils::output_format format,
                                   bool verbose) {
   try {
     std::filesystem::path input_path(infile);
@@ -285,12 +1126,13 @@ void handle_batch_rename_multiple(const char *infile, int argc, char *argv[],
     std::string stem = input_path.stem().string();
     std::string extension = input_path.extension().string();
 
+    BatchReport report(format, verbose);
     if (verbose)
-      std::cout << "Reading base file for -rbm: " << infile << std::endl;
+      report.log() << "Reading base file for -rbm: " << infile << std::endl;
     const std::string input = read_file_contents(infile);
     if (verbose)
-      std::cout << "  Input file size: " << input.size() << " bytes"
-                << std::endl;
+      report.log() << "  Input file size: " << input.size() << " bytes"
+                   << std::endl;
 
     std::string base_xml = pka2xml::decrypt_pka(input);
     if (base_xml.empty()) {
@@ -298,60 +1140,91 @@ void handle_batch_rename_multiple(const char *infile, int argc, char *argv[],
                  std::string(infile));
     }
     if (verbose)
-      std::cout << "  Decrypted base XML size: " << base_xml.size() << " bytes"
-                << std::endl;
+      report.log() << "  Decrypted base XML size: " << base_xml.size()
+                   << " bytes" << std::endl;
 
-    int success_count = 0;
-    int fail_count = 0;
     int name_count = argc - 3;
 
+    // The document up to the name is compressed once; each variant resumes
+    // from a copy of that deflate state and only compresses its name and the
+    // rest of the document
+    pka2xml::profile_name name_at{};
+    const bool found =
+        pka2xml::find_user_profile_name(base_xml, name_at, report.trace());
+    const std::string_view xml = base_xml;
+    const std::string_view suffix =
+        found ? xml.substr(name_at.end) : std::string_view();
+    std::unique_ptr<pka2xml::prefix_compressor> prefix;
+    if (found) {
+      prefix = std::make_unique<pka2xml::prefix_compressor>(
+          xml.substr(0, name_at.begin));
+    }
+
+    // Variants are encrypted on the pool and written in argument order, with
+    // a few per worker in flight so memory stays bounded
+    struct variant {
+      std::string name;
+      std::string filename;
+      std::future<std::string> encrypted;
+    };
+    std::unique_ptr<utils::thread_pool> pool;
+    if (jobs > 1) {
+      pool = std::make_unique<utils::thread_pool>(jobs);
+    }
+    std::deque<variant> pending;
+    const size_t max_pending = 2 * static_cast<size_t>(jobs);
+
+    auto finish = [&](variant &v) {
+      try {
+        write_file_contents(v.filename, v.encrypted.get());
+        report.created(infile, v.name, v.filename);
+      } catch (...) {
+        const std::string error = describe_error(std::current_exception());
+        report.failed(infile, v.name, error,
+                      "Error processing name \"" + v.name + "\": " + error);
+      }
+    };
+
     for (int i = 3; i < argc; i++) { // Names start from argv[3]
       const char *current_name = argv[i];
       if (std::string(current_name).empty()) {
-        std::cerr << "Warning: Skipping empty name provided for -rbm."
-                  << std::endl;
-        fail_count++;
+        report.failed(infile, current_name, "Empty name",
+                      "Warning: Skipping empty name provided for -rbm.");
         continue;
       }
       if (verbose)
-        std::cout << "\nProcessing name " << (i - 2) << "/" << name_count
-                  << ": " << current_name << std::endl;
-
-      try {
-        std::string new_filename = stem + "_" + current_name + extension;
-
-        // Use a copy of the base XML for modification
-        std::string modified_xml =
-            pka2xml::modify_user_profile(base_xml, current_name, verbose);
-        if (modified_xml.empty()) {
-          std::cerr << "Error: Failed to modify user profile name to: "
-                    << current_name << " for base file " << infile << std::endl;
-          fail_count++;
-          continue;
-        }
+        report.log() << "\nProcessing name " << (i - 2) << "/" << name_count
+                     << ": " << current_name << std::endl;
 
-        write_file_contents(new_filename, pka2xml::encrypt_pka(modified_xml));
-        if (verbose) {
-          std::cout << "  Successfully created: " << new_filename << std::endl;
-        } else {
-          std::cout << "Created: " << new_filename << std::endl;
-        }
-        success_count++;
+      if (!found) {
+        report.failed(infile, current_name,
+                      "Failed to modify user profile name",
+                      "Error: Failed to modify user profile name to: " +
+                          std::string(current_name) + " for base file " +
+                          infile);
+        continue;
+      }
 
-      } catch (const std::exception &e) {
-        std::cerr << "Error processing name \"" << current_name
-                  << "\": " << e.what() << std::endl;
-        fail_count++;
+      auto task = [&prefix, suffix, name = std::string(current_name)] {
+        return pka2xml::encrypt_compressed(prefix->compress({name, suffix}),
+                                           pka2xml::eax::pka);
+      };
+      pending.push_back({current_name, stem + "_" + current_name + extension,
+                         pool ? pool->submit(task)
+                              : std::async(std::launch::deferred, task)});
+      if (pending.size() >= max_pending) {
+        finish(pending.front());
+        pending.pop_front();
       }
     }
+    while (!pending.empty()) {
+      finish(pending.front());
+      pending.pop_front();
+    }
 
     // Print summary
-    std::cout << "\nBatch Rename Multiple Summary: Created " << success_count
-              << " files successfully";
-    if (fail_count > 0) {
-      std::cout << ", " << fail_count << " failed/skipped";
-    }
-    std::cout << "." << std::endl;
+    report.summary("Batch Rename Multiple Summary", "Created",
+                   "failed/skipped");
 
   } catch (const std::filesystem::filesystem_error &e) {
     utils::die("Filesystem error during -rbm setup: " + std::string(e.what()));
@@ -0,0 +1,111 @@
+#include "../include/grep.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace grep {
+
+namespace {
+
+// Errors are reported with the pattern instead of logged by RE2
+RE2::Options quiet() {
+  RE2::Options options;
+  options.set_log_errors(false);
+  return options;
+}
+
+} // namespace
+
+patterns::patterns(const std::vector<std::string> &list) : list(list) {
+  if (list.empty()) {
+    throw std::invalid_argument("no patterns");
+  }
+  set = std::make_unique<RE2::Set>(quiet(), RE2::UNANCHORED);
+  for (const auto &pattern : list) {
+    auto regex = std::make_unique<RE2>(pattern, quiet());
+    std::string error;
+    if (!regex->ok() || set->Add(pattern, &error) < 0) {
+      throw std::invalid_argument("invalid pattern \"" + pattern + "\": " +
+                                  (regex->ok() ? error : regex->error()));
+    }
+    regexes.push_back(std::move(regex));
+  }
+  if (!set->Compile()) {
+    throw std::invalid_argument("patterns need too much memory to compile");
+  }
+}
+
+patterns::~patterns() = default;
+
+searcher::searcher(const patterns &p, callback on_hit)
+    : p(p), on_hit(std::move(on_hit)), resume(p.size(), 0) {}
+
+void searcher::feed(const char *data, size_t size) {
+  if (size == 0) {
+    return;
+  }
+  window.append(data, size);
+  consumed += size;
+  search(false);
+}
+
+void searcher::finish() {
+  if (!window.empty()) {
+    search(true);
+  }
+  window.clear();
+}
+
+void searcher::search(bool last) {
+  const uint64_t base = consumed - window.size();
+  // An occurrence is only known once overlap bytes follow its start, as
+  // more data could make a greedy match longer; later ones wait
+  uint64_t cutoff = consumed;
+  if (!last) {
+    cutoff = window.size() > overlap ? consumed - overlap : base;
+  }
+
+  // One pass tells which patterns occur; only those are located
+  which.clear();
+  pending.clear();
+  const re2::StringPiece text(window.data(), window.size());
+  if (cutoff > base && p.set->Match(text, &which)) {
+    for (const int w : which) {
+      const RE2 &regex = *p.regexes[w];
+      size_t pos = static_cast<size_t>(std::max(resume[w], from) - base);
+      re2::StringPiece m;
+      while (pos < cutoff - base &&
+             regex.Match(text, pos, window.size(), RE2::UNANCHORED, &m, 1)) {
+        const size_t start = static_cast<size_t>(m.data() - window.data());
+        const size_t end = start + m.size();
+        if (base + start >= cutoff) {
+          break;
+        }
+        if (m.size() != 0) {
+          pending.push_back({base + start, static_cast<size_t>(w),
+                             std::string_view(m.data(), m.size())});
+        }
+        pos = end > start ? end : end + 1;
+      }
+    }
+  }
+
+  std::sort(pending.begin(), pending.end(), [](const hit &a, const hit &b) {
+    return a.offset < b.offset ||
+           (a.offset == b.offset && a.pattern < b.pattern);
+  });
+  for (const auto &h : pending) {
+    found++;
+    resume[h.pattern] = h.offset + h.text.size();
+    on_hit(h);
+  }
+
+  // The bytes from the cutoff on are searched again with the next chunk,
+  // after one byte before them for \b and ^
+  from = cutoff;
+  if (cutoff - base > 1) {
+    window.erase(0, static_cast<size_t>(cutoff - base - 1));
+  }
+}
+
+} // namespace grep
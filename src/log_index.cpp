@@ -0,0 +1,218 @@
+#include "../include/log_index.hpp"
+#include "../include/logs.hpp"
+#include "../include/main.hpp"
+#include "../include/thread_pool.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <limits>
+#include <stdexcept>
+
+namespace logs {
+
+namespace {
+
+constexpr char magic[8] = {'P', 'T', 'L', 'O', 'G', 'I', 'D', 'X'};
+constexpr uint32_t version = 1;
+
+// Fixed-size part of the index file; the segments follow it. Fields are in
+// host byte order, the index is a cache and not meant to be copied around.
+struct header {
+  char magic[8];
+  uint32_t version;
+  uint32_t stride;
+  uint64_t file_size;
+  int64_t modified;
+  uint64_t count;
+};
+
+int64_t modified_time(const std::string &path) {
+  return static_cast<int64_t>(
+      std::filesystem::last_write_time(path).time_since_epoch().count());
+}
+
+// Offsets of every stride-th line start, found without decrypting anything
+std::vector<uint64_t> segment_offsets(std::istream &in, uint32_t stride,
+                                      uint64_t &size) {
+  std::vector<uint64_t> offsets;
+  std::vector<char> buffer(1 << 20);
+  uint64_t offset = 0; // of buffer[0] in the file
+  uint64_t line = 0;
+  bool line_start = true;
+
+  while (in.read(buffer.data(), static_cast<std::streamsize>(buffer.size())) ||
+         in.gcount() > 0) {
+    const char *p = buffer.data();
+    const char *end = p + in.gcount();
+    while (p < end) {
+      if (line_start && line++ % stride == 0) {
+        offsets.push_back(offset + static_cast<uint64_t>(p - buffer.data()));
+      }
+      const char *eol =
+          static_cast<const char *>(std::memchr(p, '\n', end - p));
+      line_start = eol != nullptr;
+      p = eol ? eol + 1 : end;
+    }
+    offset += static_cast<uint64_t>(in.gcount());
+  }
+
+  size = offset;
+  return offsets;
+}
+
+// Decrypts the lines in [begin, end) and returns their time extremes
+index::segment scan_segment(const std::string &path, uint64_t begin,
+                            uint64_t end) {
+  index::segment result{begin, std::numeric_limits<int64_t>::max(),
+                        std::numeric_limits<int64_t>::min()};
+
+  std::ifstream in(path, std::ios::binary);
+  std::string data(static_cast<size_t>(end - begin), '\0');
+  in.seekg(static_cast<std::streamoff>(begin));
+  in.read(&data[0], static_cast<std::streamsize>(data.size()));
+  data.resize(static_cast<size_t>(in.gcount()));
+
+  const char *p = data.data();
+  const char *stop = p + data.size();
+  while (p < stop) {
+    const char *eol =
+        static_cast<const char *>(std::memchr(p, '\n', stop - p));
+    const char *line_end = eol ? eol : stop;
+    try {
+      const std::string text = pka2xml::decrypt_logs(p, line_end - p);
+      int64_t ms;
+      if (parse_timestamp(text.data(), text.size(), ms)) {
+        result.first = std::min(result.first, ms);
+        result.last = std::max(result.last, ms);
+      }
+    } catch (...) {
+      // A corrupt line cannot match a time range anyway
+    }
+    p = eol ? eol + 1 : stop;
+  }
+  return result;
+}
+
+} // namespace
+
+index index::build(const std::string &path, uint32_t stride, unsigned jobs) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in.is_open()) {
+    throw std::runtime_error("Failed to open log file: " + path);
+  }
+
+  index result;
+  result.stride_ = stride == 0 ? 1 : stride;
+  result.modified_ = modified_time(path);
+  const std::vector<uint64_t> offsets =
+      segment_offsets(in, result.stride_, result.file_size_);
+
+  auto end_of = [&](size_t i) {
+    return i + 1 < offsets.size() ? offsets[i + 1] : result.file_size_;
+  };
+
+  result.segments_.resize(offsets.size());
+  if (jobs <= 1) {
+    for (size_t i = 0; i < offsets.size(); i++) {
+      result.segments_[i] = scan_segment(path, offsets[i], end_of(i));
+    }
+    return result;
+  }
+
+  utils::thread_pool pool(jobs);
+  std::vector<std::future<segment>> pending;
+  pending.reserve(offsets.size());
+  for (size_t i = 0; i < offsets.size(); i++) {
+    pending.push_back(pool.submit([&path, begin = offsets[i], end = end_of(i)] {
+      return scan_segment(path, begin, end);
+    }));
+  }
+  for (size_t i = 0; i < pending.size(); i++) {
+    result.segments_[i] = pending[i].get();
+  }
+  return result;
+}
+
+bool index::load(const std::string &path, index &result) {
+  std::ifstream in(index_path(path), std::ios::binary);
+  if (!in.is_open()) {
+    return false;
+  }
+
+  header h;
+  if (!in.read(reinterpret_cast<char *>(&h), sizeof h) ||
+      std::memcmp(h.magic, magic, sizeof magic) != 0 || h.version != version) {
+    return false;
+  }
+
+  std::error_code ec;
+  const uint64_t size = std::filesystem::file_size(path, ec);
+  if (ec || size != h.file_size || modified_time(path) != h.modified) {
+    return false;
+  }
+
+  // The segment count comes from the file; do not trust it for allocation
+  if (h.count > h.file_size) {
+    return false;
+  }
+  result.file_size_ = h.file_size;
+  result.modified_ = h.modified;
+  result.stride_ = h.stride;
+  result.segments_.resize(static_cast<size_t>(h.count));
+  return static_cast<bool>(in.read(
+      reinterpret_cast<char *>(result.segments_.data()),
+      static_cast<std::streamsize>(result.segments_.size() * sizeof(segment))));
+}
+
+void index::save(const std::string &path) const {
+  // Written under a temporary name and renamed so a reader never sees half
+  // an index
+  const std::string target = index_path(path);
+  const std::string temporary = target + ".tmp";
+  {
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    header h;
+    std::memcpy(h.magic, magic, sizeof magic);
+    h.version = version;
+    h.stride = stride_;
+    h.file_size = file_size_;
+    h.modified = modified_;
+    h.count = segments_.size();
+    out.write(reinterpret_cast<const char *>(&h), sizeof h);
+    out.write(reinterpret_cast<const char *>(segments_.data()),
+              static_cast<std::streamsize>(segments_.size() * sizeof(segment)));
+    if (!out) {
+      std::remove(temporary.c_str());
+      throw std::runtime_error("Failed to write index: " + target);
+    }
+  }
+  if (std::rename(temporary.c_str(), target.c_str()) != 0) {
+    std::remove(temporary.c_str());
+    throw std::runtime_error("Failed to write index: " + target);
+  }
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> index::ranges(int64_t from,
+                                                         int64_t to) const {
+  std::vector<std::pair<uint64_t, uint64_t>> result;
+  for (size_t i = 0; i < segments_.size(); i++) {
+    const segment &s = segments_[i];
+    if (s.last < from || s.first > to) {
+      continue;
+    }
+    const uint64_t end =
+        i + 1 < segments_.size() ? segments_[i + 1].offset : file_size_;
+    if (!result.empty() && result.back().second == s.offset) {
+      result.back().second = end; // Extend the current run
+    } else {
+      result.emplace_back(s.offset, end);
+    }
+  }
+  return result;
+}
+
+} // namespace logs
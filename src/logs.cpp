@@ -0,0 +1,656 @@
+#include "../include/logs.hpp"
+#include "../include/main.hpp"
+#include "../include/thread_pool.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <queue>
+#include <thread>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+namespace logs {
+
+namespace {
+
+constexpr size_t block_size = 4 << 20;
+
+// Merging keeps a few blocks per input in memory, so it reads smaller ones
+constexpr size_t merge_block_size = 256 << 10;
+constexpr size_t merge_depth = 2;
+
+struct block_result {
+  std::string text;
+  std::exception_ptr error;
+};
+
+block_result decrypt_block(const std::string &block, const filter &keep,
+                           utils::output_format format) {
+  block_result result;
+  result.text.reserve(keep.empty() ? block.size() : 0);
+  try {
+    decrypt_lines(block.data(), block.size(), result.text, keep, format);
+  } catch (...) {
+    result.error = std::current_exception();
+  }
+  return result;
+}
+
+void emit(block_result &&result, utils::output_buffer &out) {
+  out.write(result.text);
+  if (result.error) {
+    out.flush();
+    std::rethrow_exception(result.error);
+  }
+}
+
+// Reads the next block ending in a newline; the bytes after the last newline
+// are carried into the following block. At most remaining bytes are read.
+bool read_block(std::istream &in, std::string &carry, std::string &block,
+                uint64_t &remaining, size_t size = block_size) {
+  block = std::move(carry);
+  carry.clear();
+  const size_t start = block.size();
+  const size_t want =
+      static_cast<size_t>(std::min<uint64_t>(size, remaining));
+  block.resize(start + want);
+  in.read(&block[start], static_cast<std::streamsize>(want));
+  const size_t got = static_cast<size_t>(in.gcount());
+  block.resize(start + got);
+  remaining -= got;
+
+  if (!in || remaining == 0) {
+    return !block.empty();
+  }
+
+  const size_t last = block.rfind('\n');
+  if (last == std::string::npos) {
+    // A single line longer than the block; keep reading it
+    carry = std::move(block);
+    return read_block(in, carry, block, remaining, size);
+  }
+  carry.assign(block, last + 1, std::string::npos);
+  block.resize(last + 1);
+  return true;
+}
+
+/**
+ * @brief One input of merge(): its decrypted blocks and current line
+ */
+struct merge_source {
+  std::string path;
+  std::string file;
+  uint64_t offset = 0; // where the next block is read from
+  std::string carry;
+  uint64_t remaining = std::numeric_limits<uint64_t>::max();
+  bool exhausted = false;
+  std::deque<std::future<block_result>> pending;
+  block_result current;
+  size_t pos = 0; // start of the next line in current.text
+  const char *line = nullptr;
+  size_t line_size = 0;
+  int64_t time = std::numeric_limits<int64_t>::min();
+};
+
+// Keeps up to merge_depth blocks of a source being decrypted ahead. The
+// file is only open while they are read, so a merge of any number of files
+// stays within the limit on open files.
+void prefetch(merge_source &src, utils::thread_pool *pool,
+              const filter &keep) {
+  if (src.exhausted || src.pending.size() >= merge_depth) {
+    return;
+  }
+  std::ifstream in(src.path, std::ios::binary);
+  if (!in.is_open()) {
+    throw std::runtime_error("Failed to open log file: " + src.path + ": " +
+                             std::strerror(errno));
+  }
+  in.seekg(static_cast<std::streamoff>(src.offset));
+
+  std::string block;
+  while (!src.exhausted && src.pending.size() < merge_depth) {
+    if (!read_block(in, src.carry, block, src.remaining, merge_block_size)) {
+      src.exhausted = true;
+      break;
+    }
+    auto shared = std::make_shared<std::string>(std::move(block));
+    // Lines stay plain text here: the merge needs their timestamps, and
+    // formats them as it writes
+    auto task = [shared, &keep] {
+      return decrypt_block(*shared, keep, utils::output_format::text);
+    };
+    if (pool) {
+      src.pending.push_back(pool->submit(task));
+    } else {
+      src.pending.push_back(std::async(std::launch::deferred, task));
+    }
+  }
+  // read_block() only stops short of a block at the end of the file
+  if (!in) {
+    src.exhausted = true;
+  } else {
+    src.offset = static_cast<uint64_t>(in.tellg());
+  }
+}
+
+// Moves to the next decrypted line of a source; a line without a timestamp
+// keeps the time of the one before it, so it stays next to it in the output
+bool advance(merge_source &src, utils::thread_pool *pool,
+             const filter &keep) {
+  for (;;) {
+    if (src.pos < src.current.text.size()) {
+      const char *start = src.current.text.data() + src.pos;
+      const char *eol = static_cast<const char *>(
+          std::memchr(start, '\n', src.current.text.size() - src.pos));
+      src.line = start;
+      src.line_size = static_cast<size_t>(eol - start);
+      src.pos += src.line_size + 1;
+      int64_t ms;
+      if (parse_timestamp(src.line, src.line_size, ms)) {
+        src.time = ms;
+      }
+      return true;
+    }
+    if (src.current.error) {
+      std::rethrow_exception(src.current.error);
+    }
+    if (src.pending.empty()) {
+      return false;
+    }
+    src.current = src.pending.front().get();
+    src.pending.pop_front();
+    src.pos = 0;
+    prefetch(src, pool, keep);
+  }
+}
+
+/**
+ * @brief A log file being followed
+ *
+ * The file is kept open, so that what was appended to it before a rotation
+ * can still be read after the path names a new file.
+ */
+struct followed_file {
+  std::string path;
+  std::string file; // name shown with each line, empty for a single file
+  int fd = -1;
+  dev_t device = 0;
+  ino_t inode = 0;
+  off_t offset = 0;
+  std::string partial; // bytes after the last newline read so far
+
+  followed_file() = default;
+  followed_file(const followed_file &) = delete;
+  followed_file &operator=(const followed_file &) = delete;
+  ~followed_file() {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+};
+
+bool is_log_file(const std::filesystem::path &p) {
+  return p.extension() == ".log";
+}
+
+// Reads the open file from the remembered offset to its end and decrypts
+// the complete lines in it. Lines are decrypted after each read, so only a
+// line cut by the end of one is held, however much is already in the file.
+void read_appended(followed_file &f, utils::output_buffer &out,
+                   const filter &keep, utils::output_format format) {
+  char buf[1 << 16];
+  std::string text, record;
+  for (;;) {
+    const ssize_t n = ::pread(f.fd, buf, sizeof buf, f.offset);
+    if (n <= 0) {
+      break;
+    }
+    f.offset += n;
+    f.partial.append(buf, static_cast<size_t>(n));
+
+    const size_t last = f.partial.rfind('\n');
+    if (last == std::string::npos) {
+      continue;
+    }
+    const char *data = f.partial.data();
+    const char *end = data + last + 1;
+    while (data < end) {
+      const char *eol = static_cast<const char *>(
+          std::memchr(data, '\n', static_cast<size_t>(end - data)));
+      try {
+        text = pka2xml::decrypt_logs(data, eol - data);
+        if (keep.accept(text.data(), text.size())) {
+          record.clear();
+          append_line(record, f.file, text.data(), text.size(), format);
+          out.write(record);
+        }
+      } catch (const std::exception &e) {
+        std::cerr << "Warning: skipping undecryptable line in " << f.path
+                  << ": " << e.what() << std::endl;
+      }
+      data = eol + 1;
+    }
+    f.partial.erase(0, last + 1);
+  }
+}
+
+// Reads whatever was appended since the last call. When the path names a
+// new file (rotation), the old one is read to its end first.
+void drain(followed_file &f, utils::output_buffer &out, const filter &keep,
+           utils::output_format format, bool verbose) {
+  struct stat st;
+  if (f.fd >= 0) {
+    if (::fstat(f.fd, &st) == 0 && st.st_size < f.offset) {
+      if (verbose)
+        std::cerr << f.path << ": truncated, reading from the start"
+                  << std::endl;
+      f.offset = 0;
+      f.partial.clear();
+    }
+    read_appended(f, out, keep, format);
+  }
+
+  if (::stat(f.path.c_str(), &st) != 0) {
+    return; // Rotated away and not recreated yet
+  }
+  if (f.fd >= 0 && st.st_dev == f.device && st.st_ino == f.inode) {
+    return;
+  }
+  const int fd = ::open(f.path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  if (::fstat(fd, &st) != 0) {
+    ::close(fd);
+    return;
+  }
+  if (f.fd >= 0) {
+    if (verbose)
+      std::cerr << f.path << ": rotated, reading the new file from the start"
+                << std::endl;
+    ::close(f.fd);
+  }
+  f.fd = fd;
+  f.device = st.st_dev;
+  f.inode = st.st_ino;
+  f.offset = 0;
+  // A last line the old file never finished
+  f.partial.clear();
+  read_appended(f, out, keep, format);
+}
+
+// Reads n digits as a decimal number
+bool digits(const char *p, int n, int &value) {
+  value = 0;
+  for (int i = 0; i < n; i++) {
+    if (p[i] < '0' || p[i] > '9') {
+      return false;
+    }
+    value = value * 10 + (p[i] - '0');
+  }
+  return true;
+}
+
+// Days since 1970-01-01 of a proleptic Gregorian date (Hinnant's
+// days_from_civil)
+int64_t days_from_civil(int64_t y, unsigned m, unsigned d) {
+  y -= m <= 2;
+  const int64_t era = (y >= 0 ? y : y - 399) / 400;
+  const unsigned yoe = static_cast<unsigned>(y - era * 400);
+  const unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + static_cast<int64_t>(doe) - 719468;
+}
+
+// Proleptic Gregorian date of a day count since 1970-01-01 (Hinnant's
+// civil_from_days)
+void civil_from_days(int64_t z, int64_t &y, unsigned &m, unsigned &d) {
+  z += 719468;
+  const int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+  const unsigned doe = static_cast<unsigned>(z - era * 146097);
+  const unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  const unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  const unsigned mp = (5 * doy + 2) / 153;
+  d = doy - (153 * mp + 2) / 5 + 1;
+  m = mp < 10 ? mp + 3 : mp - 9;
+  y = static_cast<int64_t>(yoe) + era * 400 + (m <= 2);
+}
+
+// Appends ms (see parse_timestamp) as "yyyy-MM-ddTHH:mm:ss.zzz"
+void append_iso_time(std::string &out, int64_t ms) {
+  int64_t days = ms / 86400000;
+  int64_t rest = ms % 86400000;
+  if (rest < 0) {
+    rest += 86400000;
+    days--;
+  }
+  int64_t year;
+  unsigned month, day;
+  civil_from_days(days, year, month, day);
+
+  char text[32];
+  const int n = std::snprintf(
+      text, sizeof text, "%04lld-%02u-%02uT%02d:%02d:%02d.%03d",
+      static_cast<long long>(year), month, day,
+      static_cast<int>(rest / 3600000), static_cast<int>(rest / 60000 % 60),
+      static_cast<int>(rest / 1000 % 60), static_cast<int>(rest % 1000));
+  out.append(text, static_cast<size_t>(n));
+}
+
+} // namespace
+
+void append_line(std::string &out, const std::string &file, const char *line,
+                 size_t size, utils::output_format format) {
+  if (format == utils::output_format::text) {
+    if (!file.empty()) {
+      out += file;
+      out += ": ";
+    }
+    out.append(line, size);
+    out += '\n';
+    return;
+  }
+
+  out += '{';
+  if (!file.empty()) {
+    out += "\"file\":\"";
+    utils::json_escape(out, file);
+    out += "\",";
+  }
+  int64_t ms;
+  if (parse_timestamp(line, size, ms)) {
+    out += "\"time\":\"";
+    append_iso_time(out, ms);
+    out += "\",";
+  }
+  out += "\"line\":\"";
+  utils::json_escape(out, line, size);
+  out += "\"}\n";
+}
+
+bool parse_timestamp(const char *data, size_t size, int64_t &ms) {
+  // "dd.MM.yyyy HH:mm:ss" and "yyyy-MM-ddTHH:mm:ss" are both 19 characters
+  if (size < 19) {
+    return false;
+  }
+
+  int year, month, day;
+  if (data[2] == '.' && data[5] == '.') {
+    if (!digits(data, 2, day) || !digits(data + 3, 2, month) ||
+        !digits(data + 6, 4, year)) {
+      return false;
+    }
+  } else if (data[4] == '-' && data[7] == '-') {
+    if (!digits(data, 4, year) || !digits(data + 5, 2, month) ||
+        !digits(data + 8, 2, day)) {
+      return false;
+    }
+  } else {
+    return false;
+  }
+
+  int hour, minute, second;
+  if ((data[10] != ' ' && data[10] != 'T') || data[13] != ':' ||
+      data[16] != ':' || !digits(data + 11, 2, hour) ||
+      !digits(data + 14, 2, minute) || !digits(data + 17, 2, second)) {
+    return false;
+  }
+  if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 ||
+      minute > 59 || second > 60) {
+    return false;
+  }
+
+  int millis = 0;
+  if (size >= 23 && data[19] == '.' && !digits(data + 20, 3, millis)) {
+    millis = 0;
+  }
+
+  ms = ((days_from_civil(year, month, day) * 24 + hour) * 60 + minute) * 60 +
+       second;
+  ms = ms * 1000 + millis;
+  return true;
+}
+
+bool filter::accept(const char *data, size_t size) const {
+  if (by_time()) {
+    int64_t ms;
+    if (!parse_timestamp(data, size, ms) || ms < from || ms > to) {
+      return false;
+    }
+  }
+  return !pattern ||
+         re2::RE2::PartialMatch(re2::StringPiece(data, size), *pattern);
+}
+
+void decrypt_lines(const char *data, size_t size, std::string &out,
+                   const filter &keep, utils::output_format format) {
+  static const std::string no_file;
+  const char *end = data + size;
+  while (data < end) {
+    const char *eol =
+        static_cast<const char *>(std::memchr(data, '\n', end - data));
+    const char *line_end = eol ? eol : end;
+    if (keep.empty() && format == utils::output_format::text) {
+      out += pka2xml::decrypt_logs(data, line_end - data);
+      out += '\n';
+    } else {
+      const std::string text = pka2xml::decrypt_logs(data, line_end - data);
+      if (keep.accept(text.data(), text.size())) {
+        append_line(out, no_file, text.data(), text.size(), format);
+      }
+    }
+    data = eol ? eol + 1 : end;
+  }
+}
+
+void decrypt_stream(std::istream &in, utils::output_buffer &out,
+                    unsigned jobs, const filter &keep,
+                    utils::output_format format, uint64_t length) {
+  std::string carry, block;
+  uint64_t remaining = length;
+
+  if (jobs <= 1) {
+    while (read_block(in, carry, block, remaining)) {
+      emit(decrypt_block(block, keep, format), out);
+    }
+    return;
+  }
+
+  utils::thread_pool pool(jobs);
+  std::deque<std::future<block_result>> pending;
+  const size_t max_pending = 2 * static_cast<size_t>(jobs);
+
+  while (read_block(in, carry, block, remaining)) {
+    auto shared = std::make_shared<std::string>(std::move(block));
+    pending.push_back(
+        pool.submit([shared, &keep, format] {
+          return decrypt_block(*shared, keep, format);
+        }));
+    if (pending.size() >= max_pending) {
+      emit(pending.front().get(), out);
+      pending.pop_front();
+    }
+  }
+  while (!pending.empty()) {
+    emit(pending.front().get(), out);
+    pending.pop_front();
+  }
+}
+
+void merge(const std::vector<std::string> &paths, utils::output_buffer &out,
+           unsigned jobs, const filter &keep, utils::output_format format) {
+  std::vector<merge_source> sources(paths.size());
+  for (size_t i = 0; i < paths.size(); i++) {
+    sources[i].path = paths[i];
+    sources[i].file = std::filesystem::path(paths[i]).filename().string();
+  }
+
+  std::unique_ptr<utils::thread_pool> pool;
+  if (jobs > 1) {
+    pool = std::make_unique<utils::thread_pool>(jobs);
+  }
+
+  // Min-heap of (time of current line, source); ties go to the source given
+  // first, so equal timestamps keep command line order
+  using entry = std::pair<int64_t, size_t>;
+  std::priority_queue<entry, std::vector<entry>, std::greater<entry>> heap;
+
+  for (auto &src : sources) {
+    prefetch(src, pool.get(), keep);
+  }
+  for (size_t i = 0; i < sources.size(); i++) {
+    if (advance(sources[i], pool.get(), keep)) {
+      heap.emplace(sources[i].time, i);
+    }
+  }
+
+  std::string record;
+  while (!heap.empty()) {
+    const size_t i = heap.top().second;
+    heap.pop();
+    merge_source &src = sources[i];
+    record.clear();
+    append_line(record, src.file, src.line, src.line_size, format);
+    out.write(record);
+    try {
+      if (advance(src, pool.get(), keep)) {
+        heap.emplace(src.time, i);
+      }
+    } catch (...) {
+      out.flush();
+      throw;
+    }
+  }
+}
+
+void follow(const std::string &path, utils::output_buffer &out,
+            const filter &keep, utils::output_format format, bool verbose) {
+  namespace fs = std::filesystem;
+  const bool directory = fs::is_directory(path);
+  const fs::path dir =
+      directory ? fs::path(path) : fs::absolute(path).parent_path();
+
+  std::map<std::string, followed_file> files;
+  auto add = [&](const fs::path &p) {
+    const std::string name = p.filename().string();
+    const auto added = files.try_emplace(name);
+    if (!added.second) {
+      return;
+    }
+    if (verbose && directory)
+      std::cerr << "Following " << p.string() << std::endl;
+    followed_file &f = added.first->second;
+    f.path = p.string();
+    f.file = directory ? name : "";
+  };
+  // Picks up log files created in the directory
+  auto rescan = [&] {
+    for (const auto &entry : fs::directory_iterator(dir)) {
+      if (entry.is_regular_file() && is_log_file(entry.path())) {
+        add(entry.path());
+      }
+    }
+  };
+
+  if (directory) {
+    rescan();
+  } else {
+    add(fs::path(path));
+  }
+
+  auto drain_all = [&] {
+    for (auto &f : files) {
+      drain(f.second, out, keep, format, verbose);
+    }
+    out.flush();
+  };
+
+#ifdef __linux__
+  const int fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0 || inotify_add_watch(fd, dir.c_str(),
+                                  IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE |
+                                      IN_MOVED_TO | IN_MOVED_FROM |
+                                      IN_DELETE | IN_ATTRIB) < 0) {
+    throw std::runtime_error("Failed to watch " + dir.string() + ": " +
+                             std::strerror(errno));
+  }
+
+  drain_all();
+
+  alignas(struct inotify_event) char events[16 * 1024];
+  for (;;) {
+    // The timeout only guards against missed events (e.g. network
+    // filesystems); normally the process sleeps in poll
+    struct pollfd p = {fd, POLLIN, 0};
+    const int ready = ::poll(&p, 1, 30 * 1000);
+    if (ready < 0 && errno != EINTR) {
+      throw std::runtime_error(std::string("poll failed: ") +
+                               std::strerror(errno));
+    }
+    if (ready <= 0) {
+      drain_all();
+      continue;
+    }
+
+    const ssize_t n = ::read(fd, events, sizeof events);
+    if (n <= 0) {
+      continue;
+    }
+    for (char *e = events; e < events + n;) {
+      const auto *event = reinterpret_cast<const struct inotify_event *>(e);
+      if (event->mask & IN_Q_OVERFLOW) {
+        // Events were lost: any file may have changed
+        if (verbose)
+          std::cerr << "inotify queue overflowed, reading every file"
+                    << std::endl;
+        if (directory) {
+          rescan();
+        }
+        drain_all();
+      } else if (event->len > 0) {
+        const fs::path changed = dir / event->name;
+        const auto it = files.find(event->name);
+        if (it != files.end()) {
+          drain(it->second, out, keep, format, verbose);
+        } else if (directory && is_log_file(changed) &&
+                   fs::is_regular_file(changed)) {
+          add(changed);
+          drain(files.at(event->name), out, keep, format, verbose);
+        }
+      }
+      e += sizeof(struct inotify_event) + event->len;
+    }
+    out.flush();
+  }
+#else
+  for (;;) {
+    if (directory) {
+      rescan();
+    }
+    drain_all();
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  }
+#endif
+}
+
+} // namespace logs
@@ -0,0 +1,157 @@
+#include "../include/normalize.hpp"
+#include "../include/main.hpp"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace pka2xml {
+
+namespace {
+
+struct pass {
+  std::string_view from;
+  std::string_view to;
+};
+
+// In the order decryptFileBytes applies them
+constexpr pass rules[normalizer::passes] = {
+    {"\xC3\x82\xC2\x82", ""},
+    {"\xC3\x83\xC2\x83", ""},
+    {"\xC2\x98\xC2\x94", ""},
+    {"\xC2\x93\xC2\x92", "\""},
+};
+
+// First C2 or C3 byte in [p, end), or end; no pattern starts elsewhere
+const char *find_lead(const char *p, const char *end) {
+#ifdef __SSE2__
+  const __m128i c2 = _mm_set1_epi8(static_cast<char>(0xC2));
+  const __m128i c3 = _mm_set1_epi8(static_cast<char>(0xC3));
+  while (end - p >= 16) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    // Plain ASCII, nearly all of a document, is ruled out by the sign bit
+    if (_mm_movemask_epi8(v) != 0) {
+      const int mask = _mm_movemask_epi8(
+          _mm_or_si128(_mm_cmpeq_epi8(v, c2), _mm_cmpeq_epi8(v, c3)));
+      if (mask != 0) {
+        return p + __builtin_ctz(static_cast<unsigned>(mask));
+      }
+    }
+    p += 16;
+  }
+#endif
+
+  for (; p < end; p++) {
+    if (*p == '\xC2' || *p == '\xC3') {
+      return p;
+    }
+  }
+  return end;
+}
+
+} // namespace
+
+bool normalizer::idle() const {
+  for (const uint8_t n : held) {
+    if (n != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Gives c to a pass; what the pass lets through goes to the next one
+void normalizer::push(size_t i, char c, std::string &out) {
+  if (i == passes) {
+    out += c;
+    return;
+  }
+  const std::string_view from = rules[i].from;
+  uint8_t &n = held[i];
+  if (c == from[n]) {
+    if (++n == from.size()) {
+      n = 0;
+      for (const char r : rules[i].to) {
+        push(i + 1, r, out);
+      }
+    }
+    return;
+  }
+  if (n == 0) {
+    push(i + 1, c, out);
+    return;
+  }
+  // The oldest held byte cannot start a match any more; the search goes on
+  // from the byte after it, as QByteArray::replace does
+  const uint8_t m = n;
+  n = 0;
+  push(i + 1, from[0], out);
+  for (uint8_t k = 1; k < m; k++) {
+    push(i, from[k], out);
+  }
+  push(i, c, out);
+}
+
+void normalizer::feed(const char *data, size_t size, std::string &out) {
+  const char *p = data;
+  const char *end = data + size;
+  while (p < end) {
+    if (idle()) {
+      const char *lead = find_lead(p, end);
+      out.append(p, lead);
+      p = lead;
+      if (p == end) {
+        break;
+      }
+    }
+    push(0, *p++, out);
+  }
+}
+
+void normalizer::finish(std::string &out) {
+  // Held bytes are a partial match that can no longer complete; each pass
+  // lets its own through in turn
+  for (size_t i = 0; i < passes; i++) {
+    const uint8_t m = held[i];
+    held[i] = 0;
+    for (uint8_t k = 0; k < m; k++) {
+      push(i + 1, rules[i].from[k], out);
+    }
+  }
+}
+
+std::string normalize(std::string_view xml) {
+  std::string out;
+  out.reserve(xml.size());
+  normalizer n;
+  n.feed(xml.data(), xml.size(), out);
+  n.finish(out);
+  return out;
+}
+
+std::string decrypt_pka_normalized(const std::string &input) {
+  const std::string compressed = decrypt_compressed(input, eax::pka);
+  const auto *data = reinterpret_cast<const unsigned char *>(compressed.data());
+
+  std::string out;
+  bool reserved = false;
+  normalizer n;
+  uncompress_chunks(data, compressed.size(),
+                    [&](const char *chunk, size_t size) {
+                      if (!reserved) {
+                        reserved = true;
+                        // The size header has been checked against the caps
+                        // by now
+                        out.reserve((static_cast<size_t>(data[0]) << 24) |
+                                    (static_cast<size_t>(data[1]) << 16) |
+                                    (static_cast<size_t>(data[2]) << 8) |
+                                    static_cast<size_t>(data[3]));
+                      }
+                      n.feed(chunk, size, out);
+                      return true;
+                    });
+  n.finish(out);
+  return out;
+}
+
+} // namespace pka2xml
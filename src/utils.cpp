@@ -1,8 +1,231 @@
+#include "../include/utils.hpp"
+
+#include <cstring>
 #include <iostream>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 namespace utils {
 void die(const std::string &message) {
   std::cerr << "Error: " << message << std::endl;
   std::exit(1);
 }
-} // namespace utils
\ No newline at end of file
+
+namespace {
+
+bool needs_escape(unsigned char c) { return c < 0x20 || c == '"' || c == '\\'; }
+
+void append_escape(std::string &out, unsigned char c) {
+  switch (c) {
+  case '"':
+    out += "\\\"";
+    break;
+  case '\\':
+    out += "\\\\";
+    break;
+  case '\n':
+    out += "\\n";
+    break;
+  case '\r':
+    out += "\\r";
+    break;
+  case '\t':
+    out += "\\t";
+    break;
+  case '\b':
+    out += "\\b";
+    break;
+  case '\f':
+    out += "\\f";
+    break;
+  default: {
+    static const char hex[] = "0123456789abcdef";
+    const char escaped[] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+    out.append(escaped, sizeof escaped);
+  }
+  }
+}
+
+} // namespace
+
+void json_escape(std::string &out, const char *data, size_t size) {
+  const char *p = data;
+  const char *end = data + size;
+  const char *run = p; // start of the bytes not yet copied
+
+#ifdef __SSE2__
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x1f);
+  while (end - p >= 16) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    const __m128i special = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+        _mm_cmpeq_epi8(_mm_min_epu8(v, control), v));
+    const int mask = _mm_movemask_epi8(special);
+    if (mask == 0) {
+      p += 16;
+      continue;
+    }
+    p += __builtin_ctz(static_cast<unsigned>(mask));
+    out.append(run, p);
+    append_escape(out, static_cast<unsigned char>(*p));
+    run = ++p;
+  }
+#endif
+
+  for (; p < end; p++) {
+    const unsigned char c = static_cast<unsigned char>(*p);
+    if (needs_escape(c)) {
+      out.append(run, p);
+      append_escape(out, c);
+      run = p + 1;
+    }
+  }
+  out.append(run, end);
+}
+
+output_buffer::output_buffer(std::FILE *stream, size_t capacity)
+    : stream(stream), capacity(capacity) {
+  buffer.reserve(capacity);
+}
+
+output_buffer::~output_buffer() {
+  try {
+    flush();
+  } catch (...) {
+    // Nothing sensible to do with a write error during unwinding
+  }
+}
+
+void output_buffer::write(const char *data, size_t size) {
+  if (buffer.size() + size > capacity) {
+    flush();
+    if (size >= capacity) {
+      if (std::fwrite(data, 1, size, stream) != size) {
+        throw std::runtime_error("Failed to write output");
+      }
+      return;
+    }
+  }
+  buffer.append(data, size);
+}
+
+void output_buffer::flush() {
+  if (!buffer.empty()) {
+    const size_t n = buffer.size();
+    const bool ok = std::fwrite(buffer.data(), 1, n, stream) == n;
+    buffer.clear();
+    if (!ok) {
+      throw std::runtime_error("Failed to write output");
+    }
+  }
+  std::fflush(stream);
+}
+
+namespace {
+
+constexpr uint64_t prime1 = 0x9E3779B185EBCA87ull;
+constexpr uint64_t prime2 = 0xC2B2AE3D27D4EB4Full;
+constexpr uint64_t prime3 = 0x165667B19E3779F9ull;
+constexpr uint64_t prime4 = 0x85EBCA77C2B2AE63ull;
+constexpr uint64_t prime5 = 0x27D4EB2F165667C5ull;
+
+uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+// Little-endian loads, whatever the host order
+uint64_t read64(const unsigned char *p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+uint32_t read32(const unsigned char *p) {
+  return static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8 |
+         static_cast<uint32_t>(p[2]) << 16 | static_cast<uint32_t>(p[3]) << 24;
+}
+
+uint64_t round(uint64_t acc, uint64_t input) {
+  acc += input * prime2;
+  return rotl(acc, 31) * prime1;
+}
+
+uint64_t merge(uint64_t acc, uint64_t lane) {
+  acc ^= round(0, lane);
+  return acc * prime1 + prime4;
+}
+
+void consume(uint64_t lanes[4], const unsigned char *p) {
+  for (int i = 0; i < 4; i++) {
+    lanes[i] = round(lanes[i], read64(p + 8 * i));
+  }
+}
+
+} // namespace
+
+xxh64::xxh64(uint64_t seed)
+    : lanes{seed + prime1 + prime2, seed + prime2, seed, seed - prime1},
+      seed(seed) {}
+
+void xxh64::update(const char *data, size_t size) {
+  const auto *p = reinterpret_cast<const unsigned char *>(data);
+  total += size;
+  if (held + size < sizeof stripe) {
+    std::memcpy(stripe + held, p, size);
+    held += size;
+    return;
+  }
+  if (held != 0) {
+    const size_t fill = sizeof stripe - held;
+    std::memcpy(stripe + held, p, fill);
+    consume(lanes, stripe);
+    p += fill;
+    size -= fill;
+    held = 0;
+  }
+  for (; size >= sizeof stripe; p += sizeof stripe, size -= sizeof stripe) {
+    consume(lanes, p);
+  }
+  std::memcpy(stripe, p, size);
+  held = size;
+}
+
+uint64_t xxh64::digest() const {
+  uint64_t h;
+  if (total >= sizeof stripe) {
+    h = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) +
+        rotl(lanes[3], 18);
+    for (const uint64_t lane : lanes) {
+      h = merge(h, lane);
+    }
+  } else {
+    h = seed + prime5;
+  }
+  h += total;
+
+  const unsigned char *p = stripe;
+  const unsigned char *end = stripe + held;
+  for (; end - p >= 8; p += 8) {
+    h = rotl(h ^ round(0, read64(p)), 27) * prime1 + prime4;
+  }
+  if (end - p >= 4) {
+    h = rotl(h ^ (read32(p) * prime1), 23) * prime2 + prime3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h = rotl(h ^ (*p * prime5), 11) * prime1;
+  }
+
+  h ^= h >> 33;
+  h *= prime2;
+  h ^= h >> 29;
+  h *= prime3;
+  h ^= h >> 32;
+  return h;
+}
+} // namespace utils
@@ -0,0 +1,553 @@
+#include "../include/xml.hpp"
+
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace xml {
+
+namespace {
+
+bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+bool starts_with(const char *p, const char *end, std::string_view prefix) {
+  return static_cast<size_t>(end - p) >= prefix.size() &&
+         std::memcmp(p, prefix.data(), prefix.size()) == 0;
+}
+
+// First '<' in [p, end), or end; sets escaped if an '&' comes before it
+const char *find_text_end(const char *p, const char *end, bool &escaped) {
+#ifdef __SSE2__
+  const __m128i lt = _mm_set1_epi8('<');
+  const __m128i amp = _mm_set1_epi8('&');
+  while (end - p >= 16) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    const unsigned tags =
+        static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, lt)));
+    const unsigned amps =
+        static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, amp)));
+    if (tags != 0) {
+      const unsigned first = static_cast<unsigned>(__builtin_ctz(tags));
+      if (amps & ((1u << first) - 1)) {
+        escaped = true;
+      }
+      return p + first;
+    }
+    if (amps != 0) {
+      escaped = true;
+    }
+    p += 16;
+  }
+#endif
+
+  for (; p < end; p++) {
+    if (*p == '<') {
+      return p;
+    }
+    if (*p == '&') {
+      escaped = true;
+    }
+  }
+  return end;
+}
+
+// First '>' or quote in [p, end), or end
+const char *find_tag_special(const char *p, const char *end) {
+#ifdef __SSE2__
+  const __m128i gt = _mm_set1_epi8('>');
+  const __m128i dq = _mm_set1_epi8('"');
+  const __m128i sq = _mm_set1_epi8('\'');
+  while (end - p >= 16) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    const int mask = _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, gt),
+                     _mm_or_si128(_mm_cmpeq_epi8(v, dq), _mm_cmpeq_epi8(v, sq))));
+    if (mask != 0) {
+      return p + __builtin_ctz(static_cast<unsigned>(mask));
+    }
+    p += 16;
+  }
+#endif
+
+  for (; p < end; p++) {
+    if (*p == '>' || *p == '"' || *p == '\'') {
+      return p;
+    }
+  }
+  return end;
+}
+
+// End of a tag whose text after the '<' starts at p, given the quote open
+// at p; nullptr if it does not end before end, with quote updated
+const char *tag_end(const char *p, const char *end, char &quote) {
+  for (;;) {
+    if (quote != 0) {
+      p = static_cast<const char *>(std::memchr(p, quote, end - p));
+      if (p == nullptr) {
+        return nullptr;
+      }
+      quote = 0;
+      p++;
+      continue;
+    }
+    p = find_tag_special(p, end);
+    if (p == end) {
+      return nullptr;
+    }
+    if (*p == '>') {
+      return p + 1;
+    }
+    quote = *p++;
+  }
+}
+
+// Terminator of a markup kind and the length of its opening
+struct delimiters {
+  std::string_view open;
+  std::string_view close;
+};
+
+} // namespace
+
+// Works out what the markup at p is, or leaves kind unknown when more bytes
+// are needed to tell, and returns its end if it is complete
+const char *scanner::markup_end(const char *p, const char *end, markup &kind) {
+  if (kind == markup::unknown) {
+    if (end - p < 2) {
+      return nullptr;
+    }
+    if (p[1] == '?') {
+      kind = markup::pi;
+    } else if (p[1] != '!') {
+      kind = markup::tag;
+    } else if (end - p < 3) {
+      return nullptr;
+    } else if (p[2] == '-') {
+      if (end - p < 4) {
+        return nullptr;
+      }
+      kind = p[3] == '-' ? markup::comment : markup::declaration;
+    } else if (p[2] == '[') {
+      if (end - p < 9) {
+        return nullptr;
+      }
+      kind = starts_with(p, end, "<![CDATA[") ? markup::cdata
+                                                : markup::declaration;
+    } else {
+      kind = markup::declaration;
+    }
+  }
+
+  if (kind == markup::tag) {
+    quote = 0;
+    return tag_end(p + 1, end, quote);
+  }
+
+  delimiters d{"<!", ">"};
+  if (kind == markup::comment) {
+    d = {"<!--", "-->"};
+  } else if (kind == markup::cdata) {
+    d = {"<![CDATA[", "]]>"};
+  } else if (kind == markup::pi) {
+    d = {"<?", "?>"};
+  }
+  const std::string_view s(p, end - p);
+  const size_t at = s.find(d.close, d.open.size());
+  return at == std::string_view::npos ? nullptr : p + at + d.close.size();
+}
+
+// Continues the markup cut by the end of the last chunk
+bool scanner::resume(const char *&p, const char *end) {
+  if (carry_kind == markup::unknown) {
+    // Take just enough bytes to tell what it is
+    while (p < end && carry_kind == markup::unknown) {
+      carry.push_back(*p++);
+      const char *e =
+          markup_end(carry.data(), carry.data() + carry.size(), carry_kind);
+      if (e != nullptr) {
+        const bool go = token(carry.data(), carry.size(), carry_offset);
+        carry.clear();
+        return go;
+      }
+    }
+    if (carry_kind == markup::unknown) {
+      return true;
+    }
+  }
+
+  if (carry_kind == markup::tag) {
+    const char *e = tag_end(p, end, quote);
+    if (e == nullptr) {
+      carry.append(p, end);
+      p = end;
+      return true;
+    }
+    carry.append(p, e);
+    p = e;
+  } else {
+    // Comments and the like are rare; take the whole chunk and give back
+    // what follows the markup
+    const size_t before = carry.size();
+    carry.append(p, end);
+    markup kind = carry_kind;
+    const char *e = markup_end(carry.data(), carry.data() + carry.size(), kind);
+    if (e == nullptr) {
+      p = end;
+      return true;
+    }
+    const size_t size = static_cast<size_t>(e - carry.data());
+    p += size - before;
+    carry.resize(size);
+  }
+
+  const bool go = token(carry.data(), carry.size(), carry_offset);
+  carry.clear();
+  return go;
+}
+
+bool scanner::feed(const char *data, size_t size) {
+  if (stop) {
+    return false;
+  }
+
+  const char *p = data;
+  const char *end = data + size;
+  const uint64_t base = consumed;
+  consumed += size;
+
+  if (!carry.empty()) {
+    if (!resume(p, end)) {
+      stop = true;
+      return false;
+    }
+    if (!carry.empty()) {
+      return true;
+    }
+  }
+
+  while (p < end) {
+    const uint64_t at = base + static_cast<uint64_t>(p - data);
+    if (*p != '<') {
+      bool escaped = false;
+      const char *lt = find_text_end(p, end, escaped);
+      if (!emit_text(p, lt - p, at, escaped, false)) {
+        stop = true;
+        return false;
+      }
+      p = lt;
+      continue;
+    }
+
+    markup kind = markup::unknown;
+    const char *e = markup_end(p, end, kind);
+    if (e == nullptr) {
+      carry.assign(p, end);
+      carry_offset = at;
+      carry_kind = kind;
+      break;
+    }
+    if (!token(p, e - p, at)) {
+      stop = true;
+      return false;
+    }
+    p = e;
+  }
+  return true;
+}
+
+void scanner::finish() {
+  if (stop) {
+    return;
+  }
+  if (!carry.empty()) {
+    throw parse_error("unterminated markup", carry_offset);
+  }
+  if (!parents.empty()) {
+    const size_t back = parents.back();
+    throw parse_error("unclosed element <" +
+                          path.substr(back == 0 ? 0 : back + 1) + ">",
+                      consumed);
+  }
+}
+
+bool scanner::emit_text(const char *p, size_t size, uint64_t offset,
+                        bool escaped, bool cdata) {
+  if (size == 0) {
+    return true;
+  }
+  event e{};
+  e.kind = event::text;
+  e.path = path;
+  e.value = std::string_view(p, size);
+  e.offset = offset;
+  e.size = size;
+  e.depth = parents.size();
+  e.escaped = escaped;
+  e.cdata = cdata;
+  return h.on_event(e);
+}
+
+// Reports one complete piece of markup
+bool scanner::token(const char *p, size_t size, uint64_t offset) {
+  const char *end = p + size;
+
+  if (p[1] == '/') {
+    // Compared in place against the open element's name; the closing name is
+    // only measured to report a mismatch
+    const char *name = p + 2;
+    const size_t back = parents.empty() ? 0 : parents.back();
+    const std::string_view open =
+        std::string_view(path).substr(back == 0 ? 0 : back + 1);
+    const char *after = name + open.size();
+    if (parents.empty() || after >= end ||
+        std::memcmp(name, open.data(), open.size()) != 0 ||
+        (*after != '>' && !is_space(*after))) {
+      const char *name_end = name;
+      while (name_end < end - 1 && !is_space(*name_end) && *name_end != '>') {
+        name_end++;
+      }
+      const std::string closing(name, name_end);
+      if (parents.empty()) {
+        throw parse_error("end tag </" + closing + "> without an open element",
+                          offset);
+      }
+      throw parse_error("end tag </" + closing + "> does not match <" +
+                            std::string(open) + ">",
+                        offset);
+    }
+
+    event e{};
+    e.kind = event::end;
+    e.name = open;
+    e.path = path;
+    e.offset = offset;
+    e.size = size;
+    e.depth = parents.size();
+    const bool go = h.on_event(e);
+    path.resize(back);
+    parents.pop_back();
+    return go;
+  }
+
+  if (p[1] == '!' || p[1] == '?') {
+    if (starts_with(p, end, "<![CDATA[")) {
+      return emit_text(p + 9, size - 12, offset, false, true);
+    }
+    // Comment, processing instruction or declaration
+    return h.on_markup(std::string_view(p, size), offset);
+  }
+
+  const char *name = p + 1;
+  const char *name_end = name;
+  while (name_end < end - 1 && !is_space(*name_end) && *name_end != '/' &&
+         *name_end != '>') {
+    name_end++;
+  }
+  if (name_end == name) {
+    throw parse_error("tag without a name", offset);
+  }
+  const bool self_closing = size >= 3 && end[-2] == '/';
+  const char *attributes = name_end;
+  const char *attributes_end = end - (self_closing ? 2 : 1);
+  while (attributes < attributes_end && is_space(*attributes)) {
+    attributes++;
+  }
+
+  const size_t back = path.size();
+  parents.push_back(back);
+  if (back != 0) {
+    path += '/';
+  }
+  path.append(name, name_end);
+
+  event e{};
+  e.kind = event::start;
+  e.name = std::string_view(path).substr(back == 0 ? 0 : back + 1);
+  e.path = path;
+  e.value = std::string_view(
+      attributes, attributes < attributes_end ? attributes_end - attributes : 0);
+  e.offset = offset;
+  e.size = size;
+  e.depth = parents.size();
+  e.self_closing = self_closing;
+  bool go = h.on_event(e);
+
+  if (self_closing) {
+    if (go) {
+      e.kind = event::end;
+      e.value = {};
+      e.offset = offset + size;
+      e.size = 0;
+      go = h.on_event(e);
+    }
+    path.resize(back);
+    parents.pop_back();
+  }
+  return go;
+}
+
+bool scan(std::string_view document, handler &h) {
+  scanner s(h);
+  if (!s.feed(document)) {
+    return false;
+  }
+  s.finish();
+  return true;
+}
+
+bool next_attribute(std::string_view &attributes, std::string_view &name,
+                    std::string_view &value) {
+  size_t i = 0;
+  const size_t n = attributes.size();
+  while (i < n && is_space(attributes[i])) {
+    i++;
+  }
+  if (i == n) {
+    return false;
+  }
+  const size_t key = i;
+  while (i < n && attributes[i] != '=' && !is_space(attributes[i])) {
+    i++;
+  }
+  const std::string_view found = attributes.substr(key, i - key);
+  while (i < n && is_space(attributes[i])) {
+    i++;
+  }
+  if (i == n || attributes[i] != '=') {
+    return false;
+  }
+  i++;
+  while (i < n && is_space(attributes[i])) {
+    i++;
+  }
+  if (i == n || (attributes[i] != '"' && attributes[i] != '\'')) {
+    return false;
+  }
+  const char q = attributes[i++];
+  const size_t close = attributes.find(q, i);
+  if (close == std::string_view::npos) {
+    return false;
+  }
+  name = found;
+  value = attributes.substr(i, close - i);
+  attributes.remove_prefix(close + 1);
+  return true;
+}
+
+bool attribute(std::string_view attributes, std::string_view name,
+               std::string_view &value) {
+  std::string_view found;
+  std::string_view raw;
+  while (next_attribute(attributes, found, raw)) {
+    if (found == name) {
+      value = raw;
+      return true;
+    }
+  }
+  return false;
+}
+
+void decode(std::string &out, std::string_view raw) {
+  size_t i = 0;
+  for (;;) {
+    const size_t amp = raw.find('&', i);
+    out.append(raw, i, amp == std::string_view::npos ? amp : amp - i);
+    if (amp == std::string_view::npos) {
+      return;
+    }
+    const size_t semi = raw.find(';', amp + 1);
+    const std::string_view ref = raw.substr(
+        amp + 1, semi == std::string_view::npos ? 0 : semi - amp - 1);
+    i = amp + 1;
+    if (semi == std::string_view::npos || ref.empty()) {
+      out += '&';
+      continue;
+    }
+
+    uint32_t c = 0;
+    if (ref == "lt") {
+      c = '<';
+    } else if (ref == "gt") {
+      c = '>';
+    } else if (ref == "amp") {
+      c = '&';
+    } else if (ref == "quot") {
+      c = '"';
+    } else if (ref == "apos") {
+      c = '\'';
+    } else if (ref[0] == '#' && ref.size() > 1) {
+      const bool hex = ref[1] == 'x' || ref[1] == 'X';
+      const std::string_view digits = ref.substr(hex ? 2 : 1);
+      for (const char d : digits) {
+        uint32_t v;
+        if (d >= '0' && d <= '9') {
+          v = d - '0';
+        } else if (hex && (d | 0x20) >= 'a' && (d | 0x20) <= 'f') {
+          v = (d | 0x20) - 'a' + 10;
+        } else {
+          c = 0;
+          break;
+        }
+        c = c * (hex ? 16 : 10) + v;
+        if (c > 0x10ffff) {
+          c = 0;
+          break;
+        }
+      }
+      if (digits.empty()) {
+        c = 0;
+      }
+    }
+    if (c == 0) {
+      out += '&';
+      continue;
+    }
+
+    if (c < 0x80) {
+      out += static_cast<char>(c);
+    } else if (c < 0x800) {
+      out += static_cast<char>(0xc0 | (c >> 6));
+      out += static_cast<char>(0x80 | (c & 0x3f));
+    } else if (c < 0x10000) {
+      out += static_cast<char>(0xe0 | (c >> 12));
+      out += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+      out += static_cast<char>(0x80 | (c & 0x3f));
+    } else {
+      out += static_cast<char>(0xf0 | (c >> 18));
+      out += static_cast<char>(0x80 | ((c >> 12) & 0x3f));
+      out += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+      out += static_cast<char>(0x80 | (c & 0x3f));
+    }
+    i = semi + 1;
+  }
+}
+
+void escape(std::string &out, std::string_view text, bool attribute) {
+  for (const char c : text) {
+    switch (c) {
+    case '&':
+      out += "&amp;";
+      break;
+    case '<':
+      out += "&lt;";
+      break;
+    case '>':
+      out += "&gt;";
+      break;
+    case '"':
+      out += attribute ? "&quot;" : "\"";
+      break;
+    case '\'':
+      out += attribute ? "&apos;" : "'";
+      break;
+    default:
+      out += c;
+    }
+  }
+}
+
+} // namespace xml
@@ -0,0 +1,206 @@
+#include "../include/xml_canon.hpp"
+
+#include <algorithm>
+
+namespace xml {
+
+namespace {
+
+bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Longest entity reference kept back when a text event ends inside one
+constexpr size_t max_entity = 32;
+
+} // namespace
+
+canonicalizer::canonicalizer(const std::vector<query> &ignore, sink out)
+    : out(std::move(out)) {
+  ignored.reserve(ignore.size());
+  for (const auto &q : ignore) {
+    ignored.emplace_back(q);
+  }
+  buffer.reserve(block);
+}
+
+bool canonicalizer::on_event(const event &e) {
+  switch (e.kind) {
+  case event::start: {
+    end_text();
+    drop.clear();
+    bool dropped = false;
+    bool own_text = true;
+    for (auto &s : ignored) {
+      if (!s.start(e)) {
+        continue;
+      }
+      switch (s.path().select()) {
+      case query::selector::element:
+        dropped = true;
+        break;
+      case query::selector::attribute:
+        drop.push_back(s.path().attribute());
+        break;
+      case query::selector::text:
+        own_text = false;
+        break;
+      }
+    }
+    if (skip_depth != 0) {
+      break;
+    }
+    if (dropped) {
+      skip_depth = e.depth;
+      break;
+    }
+    if (!own_text) {
+      no_text.push_back(e.depth);
+    }
+    start(e);
+    break;
+  }
+
+  case event::end:
+    end_text();
+    for (auto &s : ignored) {
+      s.end(e);
+    }
+    if (skip_depth != 0) {
+      if (e.depth == skip_depth) {
+        skip_depth = 0;
+      }
+      break;
+    }
+    if (!no_text.empty() && no_text.back() == e.depth) {
+      no_text.pop_back();
+    }
+    buffer += "</";
+    buffer += e.name;
+    buffer += '>';
+    flush_if_full();
+    break;
+
+  case event::text:
+    if (skip_depth == 0 && e.depth != 0 &&
+        (no_text.empty() || no_text.back() != e.depth)) {
+      text(e);
+    }
+    break;
+  }
+  return true;
+}
+
+void canonicalizer::start(const event &e) {
+  attributes.clear();
+  std::string_view rest = e.value;
+  std::string_view name;
+  std::string_view raw;
+  while (next_attribute(rest, name, raw)) {
+    if (std::find(drop.begin(), drop.end(), name) == drop.end()) {
+      attributes.emplace_back(name, raw);
+    }
+  }
+  std::sort(attributes.begin(), attributes.end());
+
+  buffer += '<';
+  buffer += e.name;
+  for (const auto &[n, v] : attributes) {
+    buffer += ' ';
+    buffer += n;
+    buffer += "=\"";
+    value.clear();
+    decode(value, v);
+    escape(buffer, value, true);
+    buffer += '"';
+  }
+  buffer += '>';
+  flush_if_full();
+}
+
+void canonicalizer::text(const event &e) {
+  if (e.cdata) {
+    if (!carry.empty()) {
+      value.clear();
+      decode(value, carry);
+      carry.clear();
+      add_text(value);
+    }
+    add_text(e.value);
+    return;
+  }
+  if (!e.escaped && carry.empty()) {
+    add_text(e.value);
+    return;
+  }
+
+  std::string raw = std::move(carry);
+  carry.clear();
+  raw += e.value;
+  // An '&' without its ';' may be finished by the next event
+  const size_t amp = raw.rfind('&');
+  if (amp != std::string::npos && raw.size() - amp <= max_entity &&
+      raw.find(';', amp) == std::string::npos) {
+    carry.assign(raw, amp, std::string::npos);
+    raw.resize(amp);
+  }
+  value.clear();
+  decode(value, raw);
+  add_text(value);
+}
+
+void canonicalizer::add_text(std::string_view s) {
+  size_t i = 0;
+  while (i < s.size()) {
+    size_t j = i;
+    while (j < s.size() && is_space(s[j])) {
+      j++;
+    }
+    if (in_text) {
+      spaces.append(s.substr(i, j - i));
+    }
+    i = j;
+    while (j < s.size() && !is_space(s[j])) {
+      j++;
+    }
+    if (j > i) {
+      escape(buffer, spaces, false);
+      spaces.clear();
+      escape(buffer, s.substr(i, j - i), false);
+      in_text = true;
+    }
+    i = j;
+  }
+  flush_if_full();
+}
+
+// At a tag: the text before it is complete
+void canonicalizer::end_text() {
+  if (!carry.empty()) {
+    value.clear();
+    decode(value, carry);
+    carry.clear();
+    add_text(value);
+  }
+  spaces.clear();
+  in_text = false;
+}
+
+void canonicalizer::flush_if_full() {
+  if (buffer.size() >= block) {
+    written += buffer.size();
+    out(buffer.data(), buffer.size());
+    buffer.clear();
+  }
+}
+
+void canonicalizer::finish() {
+  end_text();
+  if (!buffer.empty()) {
+    written += buffer.size();
+    out(buffer.data(), buffer.size());
+    buffer.clear();
+  }
+}
+
+} // namespace xml
@@ -0,0 +1,411 @@
+#include "../include/xml_diff.hpp"
+
+namespace xml {
+
+// Copies the scanner's events into the batch being filled
+class event_reader::collector : public handler {
+public:
+  explicit collector(std::unique_ptr<batch> &b) : b(b) {}
+
+  bool on_event(const event &e) override {
+    b->at.push_back(b->arena.size());
+    b->arena += e.name;
+    b->at.push_back(b->arena.size());
+    b->arena += e.value;
+    b->events.push_back(e);
+    b->events.back().path = {};
+    return true;
+  }
+
+private:
+  std::unique_ptr<batch> &b;
+};
+
+event_reader::event_reader(source produce)
+    : worker([this, produce = std::move(produce)] { run(produce); }) {}
+
+event_reader::~event_reader() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    cancelled = true;
+  }
+  changed.notify_all();
+  worker.join();
+}
+
+void event_reader::run(const source &produce) {
+  auto b = std::make_unique<batch>();
+  try {
+    collector c(b);
+    scanner s(c);
+    bool stopped = false;
+    produce([&](const char *data, size_t size) {
+      s.feed(data, size);
+      stopped = !publish(b);
+      return !stopped;
+    });
+    if (!stopped) {
+      s.finish();
+      publish(b);
+    }
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(mutex);
+    error = std::current_exception();
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    done = true;
+  }
+  changed.notify_all();
+}
+
+// Queues the filled batch and takes an empty one; false once cancelled
+bool event_reader::publish(std::unique_ptr<batch> &b) {
+  if (b->events.empty()) {
+    return true;
+  }
+  // The arena has stopped moving, so the views can point into it
+  for (size_t i = 0; i < b->events.size(); i++) {
+    event &e = b->events[i];
+    e.name = std::string_view(b->arena.data() + b->at[2 * i], e.name.size());
+    e.value =
+        std::string_view(b->arena.data() + b->at[2 * i + 1], e.value.size());
+  }
+
+  std::unique_lock<std::mutex> lock(mutex);
+  changed.wait(lock, [this] { return cancelled || full.size() < queued; });
+  if (cancelled) {
+    return false;
+  }
+  full.push_back(std::move(b));
+  if (!spare.empty()) {
+    b = std::move(spare.back());
+    spare.pop_back();
+  }
+  lock.unlock();
+  changed.notify_all();
+
+  if (!b) {
+    b = std::make_unique<batch>();
+  }
+  b->arena.clear();
+  b->events.clear();
+  b->at.clear();
+  return true;
+}
+
+const event *event_reader::next() {
+  if (current && position < current->events.size()) {
+    return &current->events[position++];
+  }
+
+  std::unique_lock<std::mutex> lock(mutex);
+  if (current) {
+    spare.push_back(std::move(current));
+  }
+  changed.wait(lock, [this] { return !full.empty() || done; });
+  if (full.empty()) {
+    if (error) {
+      rethrown = true;
+      std::rethrow_exception(error);
+    }
+    return nullptr;
+  }
+  current = std::move(full.front());
+  full.pop_front();
+  lock.unlock();
+  changed.notify_all();
+
+  position = 1;
+  return &current->events[0];
+}
+
+namespace {
+
+constexpr size_t preview_size = 64;
+
+bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Text directly inside one element of one document, runs concatenated and
+// the whole trimmed; the same however the runs were cut
+struct text_digest {
+  uint64_t hash = 14695981039346656037ull; // FNV-1a
+  uint64_t size = 0;
+  std::string preview; // at most preview_size bytes
+  std::string spaces;  // held until more text follows them
+
+  void add(std::string_view s) {
+    size_t i = 0;
+    while (i < s.size()) {
+      size_t j = i;
+      while (j < s.size() && is_space(s[j])) {
+        j++;
+      }
+      if (size > 0) {
+        spaces.append(s.substr(i, j - i));
+      }
+      i = j;
+      while (j < s.size() && !is_space(s[j])) {
+        j++;
+      }
+      if (j > i) {
+        commit(spaces);
+        spaces.clear();
+        commit(s.substr(i, j - i));
+      }
+      i = j;
+    }
+  }
+
+  void commit(std::string_view s) {
+    for (const char c : s) {
+      hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    size += s.size();
+    size_t take = preview_size - preview.size();
+    if (take < s.size()) {
+      // Not in the middle of a UTF-8 sequence
+      while (take > 0 && (static_cast<unsigned char>(s[take]) & 0xC0) == 0x80) {
+        take--;
+      }
+    }
+    preview.append(s.substr(0, take));
+  }
+
+  // The start of the text, decoded and marked when there is more
+  std::string shown() const {
+    std::string s;
+    decode(s, preview);
+    return size > preview.size() ? s + "..." : s;
+  }
+
+  bool operator==(const text_digest &o) const {
+    return hash == o.hash && size == o.size;
+  }
+
+  void clear() {
+    hash = text_digest().hash;
+    size = 0;
+    preview.clear();
+    spaces.clear();
+  }
+};
+
+// Children seen so far of one element, by name; an element has few
+// distinct child names, and a run of one name hits the first probe
+class sibling_counts {
+public:
+  uint32_t next(std::string_view name) {
+    if (last < used && names[last].first == name) {
+      return ++names[last].second;
+    }
+    for (last = 0; last < used; last++) {
+      if (names[last].first == name) {
+        return ++names[last].second;
+      }
+    }
+    if (used == names.size()) {
+      names.emplace_back();
+    }
+    names[used].first.assign(name.data(), name.size());
+    names[used].second = 1;
+    return names[used++].second;
+  }
+
+  // Keeps the strings for the next element at this depth
+  void clear() { used = last = 0; }
+
+private:
+  std::vector<std::pair<std::string, uint32_t>> names;
+  size_t used = 0;
+  size_t last = 0;
+};
+
+// A pair of elements at the same position in both documents
+struct frame {
+  size_t path_size; // length of the path before this element's step
+  sibling_counts count_a, count_b;
+  text_digest text_a, text_b;
+
+  void reset(size_t size) {
+    path_size = size;
+    count_a.clear();
+    count_b.clear();
+    text_a.clear();
+    text_b.clear();
+  }
+};
+
+class walker {
+public:
+  walker(event_reader &a, event_reader &b,
+         const std::function<void(const difference &)> &report)
+      : a(a), b(b), report(report) {
+    // The document itself, holding the root
+    frames.emplace_back();
+    frames[0].reset(0);
+  }
+
+  uint64_t run() {
+    const event *ea = structural(a, top().text_a);
+    const event *eb = structural(b, top().text_b);
+    while (ea || eb) {
+      const bool start_a = ea && ea->kind == event::start;
+      const bool start_b = eb && eb->kind == event::start;
+      if (start_a && start_b && ea->name == eb->name) {
+        open(*ea, *eb);
+      } else if (start_a) {
+        step(ea->name, top().count_a);
+        emit(difference::removed, {}, {});
+        unstep();
+        skip(a, ea->depth);
+        if (start_b) {
+          step(eb->name, top().count_b);
+          emit(difference::added, {}, {});
+          unstep();
+          skip(b, eb->depth);
+          eb = structural(b, top().text_b);
+        }
+        ea = structural(a, top().text_a);
+        continue;
+      } else if (start_b) {
+        step(eb->name, top().count_b);
+        emit(difference::added, {}, {});
+        unstep();
+        skip(b, eb->depth);
+        eb = structural(b, top().text_b);
+        continue;
+      } else {
+        // Both at the end of the pair, as the scanners check
+        if (!ea || !eb || depth == 0) {
+          break;
+        }
+        close();
+      }
+      ea = structural(a, top().text_a);
+      eb = structural(b, top().text_b);
+    }
+    return found;
+  }
+
+private:
+  // Frames are kept when closed, to be reused with their buffers
+  frame &top() { return frames[depth]; }
+
+  // Next start or end event, adding text on the way to the current element
+  static const event *structural(event_reader &r, text_digest &text) {
+    while (const event *e = r.next()) {
+      if (e->kind != event::text) {
+        return e;
+      }
+      if (e->depth == 0) {
+        continue;
+      }
+      // As written: an entity may be cut between two runs
+      text.add(e->value);
+    }
+    return nullptr;
+  }
+
+  // Reads past the end of the element whose start event was at depth
+  static void skip(event_reader &r, size_t depth) {
+    while (const event *e = r.next()) {
+      if (e->kind == event::end && e->depth == depth) {
+        return;
+      }
+    }
+  }
+
+  void step(std::string_view name, sibling_counts &count) {
+    const uint32_t n = count.next(name);
+    step_size = path.size();
+    if (!path.empty()) {
+      path += '/';
+    }
+    path += name;
+    if (depth > 0) {
+      path += '[' + std::to_string(n) + ']';
+    }
+  }
+
+  void unstep() { path.resize(step_size); }
+
+  void emit(difference::kind_t kind, std::string_view va,
+            std::string_view vb) {
+    found++;
+    report({kind, path, va, vb});
+  }
+
+  void open(const event &ea, const event &eb) {
+    top().count_b.next(eb.name);
+    step(ea.name, top().count_a);
+    if (++depth == frames.size()) {
+      frames.emplace_back();
+    }
+    top().reset(step_size);
+    compare_attributes(ea.value, eb.value);
+  }
+
+  void close() {
+    frame &f = top();
+    if (!(f.text_a == f.text_b)) {
+      const size_t size = path.size();
+      path += "/text()";
+      emit(difference::changed, f.text_a.shown(), f.text_b.shown());
+      path.resize(size);
+    }
+    path.resize(f.path_size);
+    depth--;
+  }
+
+  void compare_attributes(std::string_view attrs_a, std::string_view attrs_b) {
+    if (attrs_a == attrs_b) {
+      return;
+    }
+    const size_t size = path.size();
+    std::string_view rest = attrs_a;
+    std::string_view name;
+    std::string_view va;
+    std::string_view vb;
+    while (next_attribute(rest, name, va)) {
+      path.resize(size);
+      path += "/@";
+      path += name;
+      if (!attribute(attrs_b, name, vb)) {
+        emit(difference::removed, va, {});
+      } else if (va != vb) {
+        emit(difference::changed, va, vb);
+      }
+    }
+    rest = attrs_b;
+    while (next_attribute(rest, name, vb)) {
+      if (!attribute(attrs_a, name, va)) {
+        path.resize(size);
+        path += "/@";
+        path += name;
+        emit(difference::added, {}, vb);
+      }
+    }
+    path.resize(size);
+  }
+
+  event_reader &a;
+  event_reader &b;
+  const std::function<void(const difference &)> &report;
+  std::vector<frame> frames;
+  size_t depth = 0; // of the innermost open pair
+  std::string path;
+  size_t step_size = 0;
+  uint64_t found = 0;
+};
+
+} // namespace
+
+uint64_t diff(event_reader &a, event_reader &b,
+              const std::function<void(const difference &)> &report) {
+  return walker(a, b, report).run();
+}
+
+} // namespace xml
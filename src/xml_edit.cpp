@@ -0,0 +1,312 @@
+#include "../include/xml_edit.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace xml {
+
+namespace {
+
+std::string_view trim(std::string_view s) {
+  while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+    s.remove_prefix(1);
+  }
+  while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+    s.remove_suffix(1);
+  }
+  return s;
+}
+
+// Errors are reported with the script line instead of logged by RE2
+RE2::Options quiet() {
+  RE2::Options options;
+  options.set_log_errors(false);
+  return options;
+}
+
+[[noreturn]] void bad_line(size_t line, const std::string &reason) {
+  throw std::invalid_argument("line " + std::to_string(line) + ": " + reason);
+}
+
+} // namespace
+
+edit_script::edit_script(std::string_view script) {
+  size_t number = 0;
+  while (!script.empty()) {
+    const size_t newline = script.find('\n');
+    std::string_view line = script.substr(0, newline);
+    script.remove_prefix(newline == std::string_view::npos ? script.size()
+                                                           : newline + 1);
+    number++;
+    if (!line.empty() && line.back() == '\r') {
+      line.remove_suffix(1);
+    }
+    if (trim(line).empty() || trim(line)[0] == '#') {
+      continue;
+    }
+
+    const size_t eq = line.find(" = ");
+    if (eq == std::string_view::npos) {
+      bad_line(number, "expected <path or /regex/> = <value>");
+    }
+    const std::string_view target = trim(line.substr(0, eq));
+    const std::string value(line.substr(eq + 3));
+    const size_t op = lines.size();
+
+    if (target.size() >= 2 && target.front() == '/' && target.back() == '/') {
+      const std::string pattern(target.substr(1, target.size() - 2));
+      auto regex = std::make_unique<RE2>(pattern, quiet());
+      if (!regex->ok()) {
+        bad_line(number, "invalid pattern: " + regex->error());
+      }
+      std::string error;
+      if (!regex->CheckRewriteString(value, &error)) {
+        bad_line(number, "invalid rewrite: " + error);
+      }
+      if (!set) {
+        set = std::make_unique<RE2::Set>(quiet(), RE2::UNANCHORED);
+      }
+      if (set->Add(pattern, &error) < 0) {
+        bad_line(number, "invalid pattern: " + error);
+      }
+      patterns.push_back({std::move(regex), value, op});
+    } else {
+      try {
+        paths.push_back({query(target), value, op});
+      } catch (const std::invalid_argument &e) {
+        bad_line(number, e.what());
+      }
+    }
+    lines.push_back(number);
+  }
+
+  if (lines.empty()) {
+    throw std::invalid_argument("the script has no edits");
+  }
+  if (set && !set->Compile()) {
+    throw std::invalid_argument("patterns need too much memory to compile");
+  }
+}
+
+edit_script::~edit_script() = default;
+
+// Follows every path of the script through the scan and collects the edits
+// of paths and patterns
+class edit_script::finder : public handler {
+public:
+  finder(const edit_script &script, std::string_view document,
+         std::vector<uint64_t> &hits)
+      : script(script), document(document), hits(hits) {
+    states.reserve(script.paths.size());
+    for (const auto &p : script.paths) {
+      states.emplace_back(p.path);
+    }
+  }
+
+  bool on_event(const event &e) override {
+    switch (e.kind) {
+    case event::start:
+      attributes_set.clear();
+      for (size_t i = 0; i < states.size(); i++) {
+        if (states[i].start(e)) {
+          matched(i, e);
+        }
+      }
+      break;
+
+    case event::text: {
+      if (e.depth == 0) {
+        break;
+      }
+      bool claimed = false;
+      for (auto &s : setting) {
+        if (s.depth == e.depth) {
+          s.runs.push_back(extent(e));
+          claimed = true;
+        }
+      }
+      if (!claimed && script.set) {
+        rewrite(e);
+      }
+      break;
+    }
+
+    case event::end: {
+      bool finished = true;
+      for (size_t i = 0; i < states.size(); i++) {
+        if (states[i].end(e) &&
+            script.paths[i].path.select() != query::selector::attribute) {
+          closed(i);
+        }
+        finished = finished && states[i].finished();
+      }
+      // Without patterns, nothing is left to do once every path is done
+      return !(finished && !script.set);
+    }
+    }
+    return true;
+  }
+
+  std::vector<replacement> edits;
+
+private:
+  // An element whose text a path sets, open until its end tag
+  struct text_target {
+    size_t path;
+    size_t depth;
+    uint64_t tag_end; // just after the start tag
+    bool self_closing;
+    std::string_view name;
+    std::vector<std::pair<uint64_t, uint64_t>> runs; // offset, size
+  };
+
+  // Bytes a text event takes in the document
+  static std::pair<uint64_t, uint64_t> extent(const event &e) {
+    // CDATA is reported without its "<![CDATA[" and "]]>"
+    return {e.offset, e.cdata ? e.size + 12 : e.size};
+  }
+
+  void matched(size_t i, const event &e) {
+    const path_edit &p = script.paths[i];
+    if (p.path.select() != query::selector::attribute) {
+      // The name is taken from the tag in the document, since e.name only
+      // lives for the callback
+      setting.push_back({i, e.depth, e.offset + e.size, e.self_closing,
+                         document.substr(e.offset + 1, e.name.size()), {}});
+      return;
+    }
+
+    // Two additions would both go at the end of the tag, where the overlap
+    // check cannot see them
+    for (const size_t other : attributes_set) {
+      const path_edit &o = script.paths[other];
+      if (o.path.attribute() == p.path.attribute()) {
+        throw std::invalid_argument(
+            "lines " + std::to_string(script.lines[o.op]) + " and " +
+            std::to_string(script.lines[p.op]) + " set the same attribute at "
+            "byte " + std::to_string(e.offset));
+      }
+    }
+    attributes_set.push_back(i);
+
+    hits[p.op]++;
+    std::string_view raw;
+    if (xml::attribute(e.value, p.path.attribute(), raw)) {
+      std::string text;
+      escape(text, p.value, true);
+      edits.push_back({static_cast<uint64_t>(raw.data() - document.data()),
+                       raw.size(), std::move(text), p.op});
+      return;
+    }
+    // Added before the '>' or "/>" of the tag
+    std::string text = " " + p.path.attribute() + "=\"";
+    escape(text, p.value, true);
+    text += '"';
+    edits.push_back({e.offset + e.size - (e.self_closing ? 2 : 1), 0,
+                     std::move(text), p.op});
+  }
+
+  void closed(size_t i) {
+    auto it = std::find_if(setting.rbegin(), setting.rend(),
+                           [i](const text_target &t) { return t.path == i; });
+    const text_target target = std::move(*it);
+    setting.erase(std::next(it).base());
+
+    const path_edit &p = script.paths[i];
+    hits[p.op]++;
+    std::string text;
+    escape(text, p.value, false);
+    if (target.self_closing) {
+      if (!text.empty()) {
+        edits.push_back({target.tag_end - 2, 2,
+                         ">" + text + "</" + std::string(target.name) + ">",
+                         p.op});
+      }
+      return;
+    }
+    if (target.runs.empty()) {
+      edits.push_back({target.tag_end, 0, std::move(text), p.op});
+      return;
+    }
+    // The first run takes the value and the others are dropped
+    edits.push_back(
+        {target.runs[0].first, target.runs[0].second, std::move(text), p.op});
+    for (size_t r = 1; r < target.runs.size(); r++) {
+      edits.push_back({target.runs[r].first, target.runs[r].second, "", p.op});
+    }
+  }
+
+  void rewrite(const event &e) {
+    std::string_view plain = e.value;
+    if (e.escaped) {
+      decoded.clear();
+      decode(decoded, e.value);
+      plain = decoded;
+    }
+    which.clear();
+    if (!script.set->Match(re2::StringPiece(plain.data(), plain.size()),
+                           &which)) {
+      return;
+    }
+
+    // The patterns that matched run in script order
+    std::sort(which.begin(), which.end());
+    std::string text(plain);
+    size_t op = 0;
+    bool changed = false;
+    for (const int w : which) {
+      const pattern_edit &p = script.patterns[w];
+      const int n = RE2::GlobalReplace(&text, *p.regex, p.rewrite);
+      if (n > 0) {
+        hits[p.op] += n;
+        op = changed ? op : p.op;
+        changed = true;
+      }
+    }
+    if (!changed) {
+      return;
+    }
+    std::string escaped;
+    escape(escaped, text, false);
+    const auto [offset, size] = extent(e);
+    edits.push_back({offset, size, std::move(escaped), op});
+  }
+
+  const edit_script &script;
+  std::string_view document;
+  std::vector<uint64_t> &hits;
+  std::vector<path_state> states;
+  std::vector<text_target> setting;
+  std::vector<size_t> attributes_set; // paths that matched the current tag
+  std::vector<int> which;
+  std::string decoded;
+};
+
+std::vector<replacement> edit_script::find(std::string_view document,
+                                           std::vector<uint64_t> &hits) const {
+  hits.assign(lines.size(), 0);
+  finder f(*this, document, hits);
+  scan(document, f);
+
+  std::vector<replacement> edits = std::move(f.edits);
+  // Insertions go before a replacement at the same offset; insertions at
+  // one offset keep script order
+  std::stable_sort(edits.begin(), edits.end(),
+                   [](const replacement &a, const replacement &b) {
+                     return a.offset < b.offset ||
+                            (a.offset == b.offset && a.size < b.size);
+                   });
+  for (size_t i = 1; i < edits.size(); i++) {
+    const replacement &a = edits[i - 1];
+    const replacement &b = edits[i];
+    if (b.offset < a.offset + a.size) {
+      throw std::invalid_argument(
+          "lines " + std::to_string(lines[a.op]) + " and " +
+          std::to_string(lines[b.op]) + " change the same text at byte " +
+          std::to_string(b.offset));
+    }
+  }
+  return edits;
+}
+
+} // namespace xml
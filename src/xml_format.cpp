@@ -0,0 +1,181 @@
+#include "../include/xml_format.hpp"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace xml {
+
+namespace {
+
+bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// First byte in [p, end) that is not XML whitespace, or end
+const char *skip_spaces(const char *p, const char *end) {
+#ifdef __SSE2__
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i lf = _mm_set1_epi8('\n');
+  const __m128i cr = _mm_set1_epi8('\r');
+  while (end - p >= 16) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    const __m128i blank = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, tab)),
+        _mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr)));
+    const unsigned other =
+        ~static_cast<unsigned>(_mm_movemask_epi8(blank)) & 0xffff;
+    if (other != 0) {
+      return p + __builtin_ctz(other);
+    }
+    p += 16;
+  }
+#endif
+
+  while (p < end && is_space(*p)) {
+    p++;
+  }
+  return p;
+}
+
+} // namespace
+
+formatter::formatter(style s, sink out) : s(s), out(std::move(out)) {
+  buffer.reserve(block);
+}
+
+// Drops the whitespace before a piece of markup and, pretty-printed, starts
+// its line when it does not follow text
+void formatter::before_markup(bool end_tag) {
+  in_text = false;
+  // Whitespace that is all an element holds is its content
+  if (end_tag && last == token::open) {
+    buffer += spaces;
+    spaces.clear();
+    return;
+  }
+  spaces.clear();
+  if (s != style::pretty || last == token::none || last == token::text) {
+    return;
+  }
+  buffer += '\n';
+  buffer.append(2 * depth, ' ');
+}
+
+bool formatter::on_event(const event &e) {
+  switch (e.kind) {
+  case event::start: {
+    before_markup(false);
+    buffer += '<';
+    buffer += e.name;
+    std::string_view attributes = e.value;
+    while (!attributes.empty() && is_space(attributes.back())) {
+      attributes.remove_suffix(1);
+    }
+    if (!attributes.empty()) {
+      buffer += ' ';
+      buffer += attributes;
+    }
+    if (e.self_closing) {
+      buffer += "/>";
+      self_closed = true;
+      last = token::close;
+    } else {
+      buffer += '>';
+      last = token::open;
+      depth++;
+    }
+    break;
+  }
+
+  case event::end:
+    if (self_closed) {
+      self_closed = false;
+      break;
+    }
+    depth--;
+    before_markup(true);
+    buffer += "</";
+    buffer += e.name;
+    buffer += '>';
+    last = token::close;
+    break;
+
+  case event::text:
+    text(e);
+    break;
+  }
+  flush_if_full();
+  return true;
+}
+
+void formatter::text(const event &e) {
+  if (e.cdata) {
+    buffer += spaces;
+    spaces.clear();
+    buffer += "<![CDATA[";
+    buffer += e.value;
+    buffer += "]]>";
+    in_text = true;
+    last = token::text;
+    return;
+  }
+  if (!in_text) {
+    const char *begin = e.value.data();
+    const char *end = begin + e.value.size();
+    if (skip_spaces(begin, end) == end) {
+      // May still be the start of content, if text follows in the next event
+      spaces += e.value;
+      return;
+    }
+    buffer += spaces;
+    spaces.clear();
+    in_text = true;
+    last = token::text;
+  }
+  buffer += e.value;
+}
+
+bool formatter::on_markup(std::string_view raw, uint64_t) {
+  // Dropped as if it were not there: text on both sides of it joins up
+  if (s == style::minify && raw.substr(0, 4) == "<!--") {
+    return true;
+  }
+  before_markup(false);
+  buffer += raw;
+  last = token::markup;
+  flush_if_full();
+  return true;
+}
+
+void formatter::flush_if_full() {
+  if (buffer.size() >= block) {
+    out(buffer.data(), buffer.size());
+    buffer.clear();
+  }
+}
+
+void formatter::finish() {
+  spaces.clear();
+  if (s == style::pretty && last != token::none) {
+    buffer += '\n';
+  }
+  if (!buffer.empty()) {
+    out(buffer.data(), buffer.size());
+    buffer.clear();
+  }
+}
+
+std::string format(std::string_view document, formatter::style s) {
+  std::string result;
+  result.reserve(document.size());
+  formatter f(s, [&result](const char *data, size_t size) {
+    result.append(data, size);
+  });
+  scan(document, f);
+  f.finish();
+  return result;
+}
+
+} // namespace xml
@@ -0,0 +1,352 @@
+#include "../include/xml_json.hpp"
+#include "../include/utils.hpp"
+
+namespace xml {
+
+namespace {
+
+bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Longest entity reference kept back when a text event ends inside one
+constexpr size_t max_entity = 32;
+
+} // namespace
+
+json_writer::json_writer(sink out, size_t window)
+    : out(std::move(out)), window(window) {
+  buffer.reserve(block);
+  // The document, whose only member is the root
+  frames.emplace_back();
+  frames[0].is = shape::object;
+  buffer += '{';
+}
+
+bool json_writer::on_event(const event &e) {
+  switch (e.kind) {
+  case event::start:
+    start(e);
+    break;
+  case event::end:
+    end();
+    break;
+  case event::text:
+    if (e.depth != 0) {
+      text(e);
+    }
+    break;
+  }
+  settle();
+  return true;
+}
+
+void json_writer::start(const event &e) {
+  end_text();
+  {
+    frame &p = frames[depth];
+    to_object(p);
+    if (p.text_open) {
+      buffer += '"';
+      p.text_open = false;
+    }
+    if (!p.run.empty() && p.run == e.name &&
+        (p.run_array || p.run_mark != none)) {
+      if (p.run_mark != none) {
+        insert(p.run_mark, "[", true);
+        p.run_mark = none;
+        p.run_array = true;
+      }
+      buffer += ',';
+    } else {
+      if (p.run_array) {
+        buffer += ']';
+        p.run_array = false;
+      }
+      add_key(p, e.name);
+      p.run.assign(e.name.data(), e.name.size());
+      // There is only one root
+      p.run_mark = depth > 0 ? position() : none;
+    }
+  }
+
+  // Frames are kept when closed, to be reused with their buffers
+  if (++depth == frames.size()) {
+    frames.emplace_back();
+  }
+  frame &f = frames[depth];
+  f.element = ++elements;
+  f.is = shape::empty;
+  f.text_open = false;
+  f.content = false;
+  f.members = 0;
+  f.value_mark = none;
+  f.run.clear();
+  f.run_array = false;
+  f.run_mark = none;
+
+  std::string_view rest = e.value;
+  std::string_view name;
+  std::string_view raw;
+  while (next_attribute(rest, name, raw)) {
+    buffer += f.members++ == 0 ? "{\"@" : ",\"@";
+    utils::json_escape(buffer, name.data(), name.size());
+    buffer += "\":\"";
+    value.clear();
+    decode(value, raw);
+    utils::json_escape(buffer, value.data(), value.size());
+    buffer += '"';
+    f.is = shape::object;
+  }
+}
+
+void json_writer::end() {
+  end_text();
+  frame &f = frames[depth];
+  switch (f.is) {
+  case shape::empty:
+    buffer += "null";
+    break;
+  case shape::text:
+    buffer += '"';
+    f.value_mark = none;
+    break;
+  case shape::object:
+    if (f.text_open) {
+      buffer += '"';
+    }
+    if (f.run_array) {
+      buffer += ']';
+    }
+    buffer += '}';
+    break;
+  }
+  f.run_mark = none;
+  depth--;
+}
+
+// Children follow: the element is an object, with its text so far as #text
+void json_writer::to_object(frame &f) {
+  switch (f.is) {
+  case shape::empty:
+    buffer += '{';
+    break;
+  case shape::text:
+    buffer += '"';
+    f.text_open = false;
+    insert(f.value_mark, "{\"#text\":", false);
+    f.value_mark = none;
+    f.members = 1;
+    use_key(f, "#text");
+    break;
+  case shape::object:
+    return;
+  }
+  f.is = shape::object;
+}
+
+// Writes a member name, numbered if the object already has one like it
+void json_writer::add_key(frame &f, std::string_view name) {
+  if (f.members++ != 0) {
+    buffer += ',';
+  }
+  buffer += '"';
+  utils::json_escape(buffer, name.data(), name.size());
+  const uint32_t used = use_key(f, name);
+  if (used > 1) {
+    buffer += '#';
+    buffer += std::to_string(used);
+  }
+  buffer += "\":";
+}
+
+// Counts a use of a member name in the object, returning how many so far
+uint32_t json_writer::use_key(frame &f, std::string_view name) {
+  key.assign(name.data(), name.size());
+  key_use &use = f.keys[key];
+  if (use.element != f.element) {
+    use.element = f.element;
+    use.count = 0;
+  }
+  return ++use.count;
+}
+
+void json_writer::text(const event &e) {
+  if (e.cdata) {
+    if (!carry.empty()) {
+      value.clear();
+      decode(value, carry);
+      carry.clear();
+      add_text(value);
+    }
+    add_text(e.value);
+    return;
+  }
+  if (!e.escaped && carry.empty()) {
+    add_text(e.value);
+    return;
+  }
+
+  std::string raw = std::move(carry);
+  carry.clear();
+  raw += e.value;
+  // An '&' without its ';' may be finished by the next event
+  const size_t amp = raw.rfind('&');
+  if (amp != std::string::npos && raw.size() - amp <= max_entity &&
+      raw.find(';', amp) == std::string::npos) {
+    carry.assign(raw, amp, std::string::npos);
+    raw.resize(amp);
+  }
+  value.clear();
+  decode(value, raw);
+  add_text(value);
+}
+
+void json_writer::add_text(std::string_view s) {
+  frame &f = frames[depth];
+  size_t i = 0;
+  while (i < s.size()) {
+    size_t j = i;
+    while (j < s.size() && is_space(s[j])) {
+      j++;
+    }
+    if (f.content) {
+      spaces.append(s.substr(i, j - i));
+    }
+    i = j;
+    while (j < s.size() && !is_space(s[j])) {
+      j++;
+    }
+    if (j == i) {
+      break;
+    }
+    if (!f.content) {
+      open_text(f);
+    }
+    utils::json_escape(buffer, spaces.data(), spaces.size());
+    spaces.clear();
+    utils::json_escape(buffer, s.data() + i, j - i);
+    i = j;
+  }
+}
+
+// The first non-space text since the last tag starts a string
+void json_writer::open_text(frame &f) {
+  f.content = true;
+  switch (f.is) {
+  case shape::empty:
+    f.value_mark = position();
+    buffer += '"';
+    f.is = shape::text;
+    f.text_open = true;
+    break;
+  case shape::text:
+    break;
+  case shape::object:
+    if (f.text_open) {
+      break;
+    }
+    // Ends the run of children before it
+    if (f.run_array) {
+      buffer += ']';
+      f.run_array = false;
+    }
+    f.run_mark = none;
+    f.run.clear();
+    add_key(f, "#text");
+    buffer += '"';
+    f.text_open = true;
+    break;
+  }
+}
+
+// At a tag: the text before it is complete
+void json_writer::end_text() {
+  if (!carry.empty()) {
+    value.clear();
+    decode(value, carry);
+    carry.clear();
+    add_text(value);
+  }
+  spaces.clear();
+  frames[depth].content = false;
+}
+
+// Inserts before held output. A "[" goes before a value starting at the
+// same mark, "{"#text":" after a run bracket there.
+void json_writer::insert(uint64_t mark, std::string_view s, bool run) {
+  buffer.insert(mark - base, s);
+  for (size_t i = 0; i <= depth; i++) {
+    frame &f = frames[i];
+    if (f.value_mark != none &&
+        (f.value_mark > mark || (run && f.value_mark == mark))) {
+      f.value_mark += s.size();
+    }
+    if (f.run_mark != none && f.run_mark > mark) {
+      f.run_mark += s.size();
+    }
+  }
+}
+
+// Flushes the output no open question can change, settling the oldest
+// question when too much is held
+void json_writer::settle() {
+  if (buffer.size() < block) {
+    return;
+  }
+  for (;;) {
+    frame *oldest = nullptr;
+    uint64_t held = position();
+    for (size_t i = 0; i <= depth && oldest == nullptr; i++) {
+      frame &f = frames[i];
+      // An element's value starts before its children
+      if (f.value_mark != none) {
+        oldest = &f;
+        held = f.value_mark;
+      } else if (f.run_mark != none) {
+        oldest = &f;
+        held = f.run_mark;
+      }
+    }
+
+    if (oldest == nullptr || position() - held <= window) {
+      const size_t ready = held - base;
+      if (ready >= block || ready == buffer.size()) {
+        out(buffer.data(), ready);
+        buffer.erase(0, ready);
+        base = held;
+      }
+      return;
+    }
+
+    if (oldest->value_mark != none) {
+      insert(oldest->value_mark, "{\"#text\":", false);
+      oldest->value_mark = none;
+      oldest->is = shape::object;
+      oldest->members = 1;
+      use_key(*oldest, "#text");
+    } else {
+      oldest->run_mark = none;
+    }
+  }
+}
+
+void json_writer::finish() {
+  buffer += "}\n";
+  out(buffer.data(), buffer.size());
+  base = position();
+  buffer.clear();
+}
+
+std::string to_json(std::string_view document) {
+  std::string result;
+  result.reserve(document.size());
+  json_writer w([&result](const char *data, size_t size) {
+    result.append(data, size);
+  });
+  scan(document, w);
+  w.finish();
+  return result;
+}
+
+} // namespace xml
@@ -0,0 +1,236 @@
+#include "../include/xml_query.hpp"
+
+#include <stdexcept>
+
+namespace xml {
+
+namespace {
+
+bool is_name_char(char c) {
+  return c != '/' && c != '[' && c != ']' && c != '@' && c != '<' &&
+         c != '>' && c != '"' && c != '\'' && c != '=' && c != ' ' &&
+         c != '\t' && c != '\n' && c != '\r';
+}
+
+[[noreturn]] void bad_query(std::string_view expression,
+                            const std::string &reason) {
+  throw std::invalid_argument("invalid query \"" + std::string(expression) +
+                              "\": " + reason);
+}
+
+} // namespace
+
+query::query(std::string_view expression) {
+  std::string_view rest = expression;
+  if (!rest.empty() && rest[0] == '/') {
+    rest.remove_prefix(1);
+  }
+  if (rest.empty()) {
+    bad_query(expression, "empty path");
+  }
+
+  for (;;) {
+    const size_t slash = rest.find('/');
+    std::string_view part = rest.substr(0, slash);
+    const bool last = slash == std::string_view::npos;
+
+    if (last && part == "text()") {
+      select_ = selector::text;
+    } else if (last && !part.empty() && part[0] == '@') {
+      attribute_ = std::string(part.substr(1));
+      if (attribute_.empty()) {
+        bad_query(expression, "attribute without a name");
+      }
+      for (const char c : attribute_) {
+        if (!is_name_char(c)) {
+          bad_query(expression, "bad attribute name @" + attribute_);
+        }
+      }
+      select_ = selector::attribute;
+    } else if (part == "text()" || (!part.empty() && part[0] == '@')) {
+      bad_query(expression, "selector must be the last step");
+    } else {
+      step s{"", 0};
+      const size_t bracket = part.find('[');
+      if (bracket != std::string_view::npos) {
+        if (part.back() != ']' || bracket + 2 >= part.size()) {
+          bad_query(expression, "bad position in " + std::string(part));
+        }
+        for (const char d : part.substr(bracket + 1,
+                                        part.size() - bracket - 2)) {
+          if (d < '0' || d > '9' || s.position > 100000000) {
+            bad_query(expression, "bad position in " + std::string(part));
+          }
+          s.position = s.position * 10 + static_cast<uint32_t>(d - '0');
+        }
+        if (s.position == 0) {
+          bad_query(expression, "positions start at 1 in " +
+                                    std::string(part));
+        }
+        part = part.substr(0, bracket);
+      }
+      if (part.empty()) {
+        bad_query(expression, "empty step");
+      }
+      for (const char c : part) {
+        if (!is_name_char(c)) {
+          bad_query(expression, "bad element name " + std::string(part));
+        }
+      }
+      s.name = std::string(part);
+      steps_.push_back(std::move(s));
+    }
+
+    if (last) {
+      break;
+    }
+    rest = rest.substr(slash + 1);
+  }
+
+  if (steps_.empty()) {
+    bad_query(expression, "no element to select from");
+  }
+  unique_ = 1;
+  while (unique_ < steps_.size() && steps_[unique_].position != 0) {
+    unique_++;
+  }
+}
+
+void query_matcher::append_start_tag(const event &e) {
+  value += '<';
+  value += e.name;
+  if (!e.value.empty()) {
+    value += ' ';
+    value += e.value;
+  }
+  value += e.self_closing ? "/>" : ">";
+}
+
+void query_matcher::emit(const event &e, std::string_view result) {
+  found++;
+  on_match(match{e.path, capture_offset, result});
+}
+
+bool path_state::start(const event &e) {
+  const auto &steps = q.steps();
+  const size_t d = e.depth;
+  if (done || matched != d - 1 || d > steps.size()) {
+    return false;
+  }
+
+  const query::step &s = steps[d - 1];
+  if (s.name != "*" && e.name != s.name) {
+    // A root of another name means nothing can match
+    done = d == 1;
+    return false;
+  }
+  const uint32_t n = ++counts[d - 1];
+  if (s.position != 0 && n != s.position) {
+    // Past the wanted child of a unique parent, nothing else can match
+    done = n > s.position && d - 1 <= q.unique();
+    return false;
+  }
+  matched = d;
+  if (d < steps.size()) {
+    counts[d] = 0;
+    return false;
+  }
+  return true;
+}
+
+bool path_state::end(const event &e) {
+  const size_t d = e.depth;
+  if (matched != d) {
+    return false;
+  }
+  matched = d - 1;
+  // The only element with this path is done
+  done = done || d <= q.unique();
+  return d == q.steps().size();
+}
+
+bool query_matcher::on_event(const event &e) {
+  switch (e.kind) {
+  case event::start:
+    if (capturing) {
+      // Inside a matched element, which is returned as markup or as its own
+      // text only
+      if (q.select() == query::selector::element) {
+        append_start_tag(e);
+      }
+      return true;
+    }
+    if (!paths.start(e)) {
+      return !paths.finished();
+    }
+
+    capture_offset = e.offset;
+    switch (q.select()) {
+    case query::selector::attribute: {
+      std::string_view raw;
+      if (xml::attribute(e.value, q.attribute(), raw)) {
+        value.clear();
+        decode(value, raw);
+        emit(e, value);
+      }
+      break;
+    }
+    case query::selector::text:
+      capturing = true;
+      had_text = false;
+      value.clear();
+      break;
+    case query::selector::element:
+      capturing = true;
+      value.clear();
+      append_start_tag(e);
+      break;
+    }
+    return true;
+
+  case event::text:
+    if (!capturing) {
+      return true;
+    }
+    if (q.select() == query::selector::element) {
+      if (e.cdata) {
+        value += "<![CDATA[";
+        value += e.value;
+        value += "]]>";
+      } else {
+        value += e.value;
+      }
+    } else if (e.depth == q.steps().size()) {
+      had_text = true;
+      if (e.escaped) {
+        decode(value, e.value);
+      } else {
+        value += e.value;
+      }
+    }
+    return true;
+
+  case event::end: {
+    const bool closes = paths.end(e);
+    if (capturing) {
+      const bool markup = q.select() == query::selector::element;
+      if (markup && e.size != 0) {
+        value += "</";
+        value += e.name;
+        value += '>';
+      }
+      if (!closes) {
+        return true;
+      }
+      capturing = false;
+      if (markup || had_text) {
+        emit(e, value);
+      }
+    }
+    return !paths.finished();
+  }
+  }
+  return true;
+}
+
+} // namespace xml
@@ -0,0 +1,143 @@
+#include "../include/xml_tape.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+namespace xml {
+
+static_assert(sizeof(tape::node) == 32, "tape records should stay compact");
+
+// Appends a record per start tag and text run and closes the subtree of an
+// element at its end tag
+class tape::builder : public handler {
+public:
+  explicit builder(tape &t) : t(t), base(t.document_->data()) {}
+
+  bool on_event(const event &e) override {
+    switch (e.kind) {
+    case event::start: {
+      node n = record(e, node::element);
+      n.flags = e.self_closing ? node::self_closing : 0;
+      // The name is interned as a view of the tag itself, which stays put
+      n.name = intern(std::string_view(base + e.offset + 1, e.name.size()));
+      open.push_back(static_cast<uint32_t>(t.nodes_.size()));
+      t.nodes_.push_back(n);
+      break;
+    }
+    case event::end:
+      t.nodes_[open.back()].end = static_cast<uint32_t>(t.nodes_.size());
+      open.pop_back();
+      break;
+    case event::text: {
+      if (open.empty()) {
+        break;
+      }
+      node n = record(e, node::text);
+      n.flags = (e.escaped ? node::escaped : 0) | (e.cdata ? node::cdata : 0);
+      t.nodes_.push_back(n);
+      break;
+    }
+    }
+    return true;
+  }
+
+private:
+  node record(const event &e, node::kind_t kind) {
+    if (t.nodes_.size() >= none) {
+      throw std::length_error("document has too many nodes for a tape");
+    }
+    node n{};
+    n.offset = e.offset;
+    n.value_begin =
+        e.value.empty()
+            ? 0
+            : static_cast<uint32_t>(e.value.data() - base - e.offset);
+    n.value_size = static_cast<uint32_t>(e.value.size());
+    n.name = none;
+    n.parent = open.empty() ? none : open.back();
+    n.end = static_cast<uint32_t>(t.nodes_.size()) + 1;
+    n.kind = kind;
+    return n;
+  }
+
+  uint32_t intern(std::string_view name) {
+    // Siblings usually share a name, so try the previous one before hashing
+    if (last != none && t.names_[last] == name) {
+      return last;
+    }
+    const auto it = t.ids_.find(name);
+    if (it != t.ids_.end()) {
+      last = it->second;
+      return last;
+    }
+    last = static_cast<uint32_t>(t.names_.size());
+    t.names_.push_back(name);
+    t.ids_.emplace(name, last);
+    return last;
+  }
+
+  tape &t;
+  const char *base;
+  std::vector<uint32_t> open;
+  uint32_t last = none;
+};
+
+tape tape::build(std::string document) {
+  tape t;
+  t.document_ = std::make_unique<std::string>(std::move(document));
+
+  // Every record but the last text run starts at or before a '<'
+  size_t tags = 0;
+  const char *p = t.document_->data();
+  const char *end = p + t.document_->size();
+  while ((p = static_cast<const char *>(std::memchr(p, '<', end - p)))) {
+    tags++;
+    p++;
+  }
+  t.nodes_.reserve(tags + 1);
+
+  builder b(t);
+  scan(*t.document_, b);
+  return t;
+}
+
+uint32_t tape::name_id(std::string_view name) const {
+  const auto it = ids_.find(name);
+  return it == ids_.end() ? none : it->second;
+}
+
+uint32_t tape::child(uint32_t i, uint32_t name) const {
+  for (uint32_t c = first_child(i); c != none; c = next_sibling(c)) {
+    if (nodes_[c].name == name) {
+      return c;
+    }
+  }
+  return none;
+}
+
+uint32_t tape::next_named(uint32_t i) const {
+  const uint32_t name = nodes_[i].name;
+  for (uint32_t c = next_sibling(i); c != none; c = next_sibling(c)) {
+    if (nodes_[c].name == name) {
+      return c;
+    }
+  }
+  return none;
+}
+
+std::string tape::text(uint32_t i) const {
+  std::string out;
+  for (uint32_t c = first_child(i); c != none; c = next_sibling(c)) {
+    if (nodes_[c].kind != node::text) {
+      continue;
+    }
+    if (nodes_[c].flags & node::escaped) {
+      decode(out, value(c));
+    } else {
+      out += value(c);
+    }
+  }
+  return out;
+}
+
+} // namespace xml